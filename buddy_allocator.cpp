@@ -0,0 +1,98 @@
+#include "buddy_allocator.h"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+
+static uint64_t get_level_block_size(const BuddyAllocator *buddy_allocator, uint32_t level) {
+    return buddy_allocator->size >> level;
+}
+
+void init_buddy_allocator(BuddyAllocator *buddy_allocator, uint64_t size, uint64_t min_block_size) {
+    assert(std::has_single_bit(size) && std::has_single_bit(min_block_size) && min_block_size <= size);
+    buddy_allocator->size = size;
+    buddy_allocator->min_block_size = min_block_size;
+    buddy_allocator->level_count = std::countr_zero(size) - std::countr_zero(min_block_size) + 1;
+    buddy_allocator->free_blocks.clear();
+    buddy_allocator->free_blocks.resize(buddy_allocator->level_count);
+    buddy_allocator->free_blocks[0].insert(0);
+    buddy_allocator->allocated_levels.assign(size / min_block_size, 0);
+    buddy_allocator->requested_sizes.assign(size / min_block_size, 0);
+    buddy_allocator->allocated_size = 0;
+    buddy_allocator->requested_size = 0;
+    buddy_allocator->allocation_count = 0;
+}
+
+bool allocate_buddy_block(BuddyAllocator *buddy_allocator, uint64_t size, uint64_t alignment, uint64_t *offset) {
+    // 块按自身大小对齐，所以把对齐要求并入块大小即可
+    uint64_t block_size = std::bit_ceil(std::max({size, alignment, buddy_allocator->min_block_size}));
+    if (block_size > buddy_allocator->size) {
+        return false;
+    }
+    uint32_t level = std::countr_zero(buddy_allocator->size) - std::countr_zero(block_size);
+
+    // find the smallest free block that fits, then split it down
+    uint32_t free_level = level;
+    while (buddy_allocator->free_blocks[free_level].empty()) {
+        if (free_level == 0) {
+            return false;
+        }
+        --free_level;
+    }
+    uint64_t block_offset = *buddy_allocator->free_blocks[free_level].begin();
+    buddy_allocator->free_blocks[free_level].erase(buddy_allocator->free_blocks[free_level].begin());
+    while (free_level < level) {
+        ++free_level;
+        // keep the lower half, the upper half becomes free
+        buddy_allocator->free_blocks[free_level].insert(block_offset + get_level_block_size(buddy_allocator, free_level));
+    }
+
+    uint64_t min_block_index = block_offset / buddy_allocator->min_block_size;
+    buddy_allocator->allocated_levels[min_block_index] = static_cast<uint8_t>(level + 1);
+    buddy_allocator->requested_sizes[min_block_index] = size;
+    buddy_allocator->allocated_size += block_size;
+    buddy_allocator->requested_size += size;
+    ++buddy_allocator->allocation_count;
+    *offset = block_offset;
+    return true;
+}
+
+void free_buddy_block(BuddyAllocator *buddy_allocator, uint64_t offset) {
+    uint64_t min_block_index = offset / buddy_allocator->min_block_size;
+    assert(offset % buddy_allocator->min_block_size == 0 && buddy_allocator->allocated_levels[min_block_index] != 0);
+    uint32_t level = buddy_allocator->allocated_levels[min_block_index] - 1;
+    buddy_allocator->allocated_levels[min_block_index] = 0;
+    buddy_allocator->allocated_size -= get_level_block_size(buddy_allocator, level);
+    buddy_allocator->requested_size -= buddy_allocator->requested_sizes[min_block_index];
+    buddy_allocator->requested_sizes[min_block_index] = 0;
+    --buddy_allocator->allocation_count;
+
+    // merge with the buddy as long as it is free
+    while (level > 0) {
+        uint64_t buddy_offset = offset ^ get_level_block_size(buddy_allocator, level);
+        auto it = buddy_allocator->free_blocks[level].find(buddy_offset);
+        if (it == buddy_allocator->free_blocks[level].end()) {
+            break;
+        }
+        buddy_allocator->free_blocks[level].erase(it);
+        offset = std::min(offset, buddy_offset);
+        --level;
+    }
+    buddy_allocator->free_blocks[level].insert(offset);
+}
+
+BuddyAllocatorStatistics get_buddy_allocator_statistics(const BuddyAllocator *buddy_allocator) {
+    BuddyAllocatorStatistics statistics = {};
+    statistics.size = buddy_allocator->size;
+    statistics.allocated_size = buddy_allocator->allocated_size;
+    statistics.requested_size = buddy_allocator->requested_size;
+    statistics.free_size = buddy_allocator->size - buddy_allocator->allocated_size;
+    statistics.allocation_count = buddy_allocator->allocation_count;
+    for (uint32_t level = 0; level < buddy_allocator->level_count; ++level) {
+        size_t free_block_count = buddy_allocator->free_blocks[level].size();
+        statistics.free_block_count += static_cast<uint32_t>(free_block_count);
+        if (free_block_count > 0 && statistics.largest_free_block_size == 0) {
+            statistics.largest_free_block_size = get_level_block_size(buddy_allocator, level);
+        }
+    }
+    return statistics;
+}
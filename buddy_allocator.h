@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <vector>
+
+// 伙伴分配器：只管理[0, size)区间内的偏移，不持有实际内存，可用于GPU内存块、几何缓冲区等。
+// 块大小都是2的幂，且按自身大小对齐；释放时与空闲的伙伴块合并
+struct BuddyAllocator {
+    uint64_t size; // 2的幂
+    uint64_t min_block_size; // 2的幂
+    uint32_t level_count; // level 0为整个区间，level_count - 1为最小块
+    std::vector<std::set<uint64_t>> free_blocks; // 每层的空闲块偏移，按地址排序，优先分配低地址以减少碎片
+    std::vector<uint8_t> allocated_levels; // 以最小块为单位，已分配块起始处记录其层级+1，0表示不是已分配块的起点
+    std::vector<uint64_t> requested_sizes; // 以最小块为单位，已分配块起始处记录请求的大小
+    uint64_t allocated_size; // 已分配块的总大小（按块大小计）
+    uint64_t requested_size; // 请求的总大小
+    uint32_t allocation_count;
+};
+
+struct BuddyAllocatorStatistics {
+    uint64_t size;
+    uint64_t allocated_size;
+    uint64_t requested_size;
+    uint64_t free_size;
+    uint64_t largest_free_block_size;
+    uint32_t allocation_count;
+    uint32_t free_block_count;
+};
+
+void init_buddy_allocator(BuddyAllocator *buddy_allocator, uint64_t size, uint64_t min_block_size);
+
+// 分配失败（空间不足或碎片过多）返回false
+bool allocate_buddy_block(BuddyAllocator *buddy_allocator, uint64_t size, uint64_t alignment, uint64_t *offset);
+
+void free_buddy_block(BuddyAllocator *buddy_allocator, uint64_t offset);
+
+BuddyAllocatorStatistics get_buddy_allocator_statistics(const BuddyAllocator *buddy_allocator);
@@ -1,2 +1,4 @@
 glslc triangle.vert -o triangle.vert.spv
 glslc triangle.frag -o triangle.frag.spv
+glslc cull.comp -o cull.comp.spv
+glslc depth_pyramid.comp -o depth_pyramid.comp.spv
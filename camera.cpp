@@ -67,3 +67,20 @@ glm::vec3 compute_ray_far_plane_intersection(const Camera &camera, const glm::ve
 
     return glm::vec3(intersection_world);
 }
+
+void extract_frustum_planes(const glm::mat4 &view_projection, glm::vec4 planes[6]) {
+    // glm是列主序，第i行为(m[0][i], m[1][i], m[2][i], m[3][i])
+    glm::vec4 row0(view_projection[0][0], view_projection[1][0], view_projection[2][0], view_projection[3][0]);
+    glm::vec4 row1(view_projection[0][1], view_projection[1][1], view_projection[2][1], view_projection[3][1]);
+    glm::vec4 row2(view_projection[0][2], view_projection[1][2], view_projection[2][2], view_projection[3][2]);
+    glm::vec4 row3(view_projection[0][3], view_projection[1][3], view_projection[2][3], view_projection[3][3]);
+    planes[0] = row3 + row0; // left
+    planes[1] = row3 - row0; // right
+    planes[2] = row3 + row1; // bottom
+    planes[3] = row3 - row1; // top
+    planes[4] = row2; // near: z >= 0
+    planes[5] = row3 - row2; // far: z <= w
+    for (uint32_t i = 0; i < 6; ++i) {
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+}
@@ -19,3 +19,7 @@ std::pair<glm::vec3, glm::vec3> compute_ray_from_screen(const Camera &camera, fl
 // 计算射线与远平面的交点
 glm::vec3 compute_ray_far_plane_intersection(const Camera &camera, const glm::vec3 &ray_origin,
                                              const glm::vec3 &ray_dir);
+
+// 从view_projection（已包含vulkan的clip矩阵，z范围[0, 1]）提取视锥体的6个平面：left, right, bottom, top, near, far。
+// 平面已归一化，xyz为指向视锥体内部的法线，dot(xyz, p) + w < 0表示点在平面外
+void extract_frustum_planes(const glm::mat4 &view_projection, glm::vec4 planes[6]);
@@ -0,0 +1,111 @@
+#include "coroutines.h"
+#include "file.h"
+#include <chrono>
+
+void ResumeOnWorkerAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    push_task(task_system, [handle]() { handle.resume(); }, priority);
+}
+
+void NextFrameAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    std::lock_guard<std::mutex> lock(scheduler->main_thread_handles_mutex);
+    scheduler->main_thread_handles[priority].push_back(handle);
+}
+
+void WaitTaskAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    // 依赖在await_ready之后才完成也没关系，push_task会忽略已完成的依赖
+    push_task(task_system, [handle]() { handle.resume(); }, priority, &task_handle, 1);
+}
+
+void LoadFileAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    // awaiter存放在协程帧中，协程恢复之前一直有效
+    push_task(task_system, [this, handle]() {
+        data = read_binary_file(filepath);
+        handle.resume();
+    }, priority);
+}
+
+ResumeOnWorkerAwaiter resume_on_worker(CoroutineScheduler *scheduler, TaskPriority priority) {
+    return ResumeOnWorkerAwaiter{scheduler->task_system, priority};
+}
+
+NextFrameAwaiter next_frame(CoroutineScheduler *scheduler, TaskPriority priority) {
+    return NextFrameAwaiter{scheduler, priority};
+}
+
+WaitTaskAwaiter wait_task_async(CoroutineScheduler *scheduler, TaskHandle task_handle, TaskPriority priority) {
+    return WaitTaskAwaiter{scheduler->task_system, task_handle, priority};
+}
+
+LoadFileAwaiter load_file(CoroutineScheduler *scheduler, std::string filepath, TaskPriority priority) {
+    return LoadFileAwaiter{scheduler->task_system, priority, std::move(filepath), {}};
+}
+
+// spawn的外层协程：立即开始执行，结束时自动销毁帧（连同持有的Async）
+struct SpawnedCoroutine {
+    struct promise_type {
+        SpawnedCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static SpawnedCoroutine run_spawned(CoroutineScheduler *scheduler, Async<void> async) {
+    co_await async;
+    scheduler->spawned_coroutine_count.fetch_sub(1, std::memory_order_release);
+}
+
+void spawn(CoroutineScheduler *scheduler, Async<void> &&async) {
+    scheduler->spawned_coroutine_count.fetch_add(1, std::memory_order_relaxed);
+    run_spawned(scheduler, std::move(async));
+}
+
+void run_main_thread_coroutines(CoroutineScheduler *scheduler) {
+    auto begin = std::chrono::steady_clock::now();
+    bool resumed_budgeted = false;
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        {
+            std::lock_guard<std::mutex> lock(scheduler->main_thread_handles_mutex);
+            std::swap(scheduler->running_handles, scheduler->main_thread_handles[i]);
+        }
+        // 恢复期间再次co_await next_frame的协程会进入main_thread_handles，留到下一帧
+        std::vector<std::coroutine_handle<>> &running_handles = scheduler->running_handles;
+        size_t resumed_count = 0;
+        for (; resumed_count < running_handles.size(); ++resumed_count) {
+            if (i != TASK_PRIORITY_CRITICAL) {
+                double elapsed_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - begin).count();
+                // 每帧至少恢复一个，保证预算被CRITICAL用完时其他协程也能推进
+                if (resumed_budgeted && scheduler->main_thread_budget_ms > 0.0 &&
+                    elapsed_ms >= scheduler->main_thread_budget_ms) {
+                    break;
+                }
+                resumed_budgeted = true;
+            }
+            running_handles[resumed_count].resume();
+        }
+        if (resumed_count < running_handles.size()) {
+            // over budget: keep the rest in front of the ones queued during this frame
+            std::lock_guard<std::mutex> lock(scheduler->main_thread_handles_mutex);
+            std::vector<std::coroutine_handle<>> &main_thread_handles = scheduler->main_thread_handles[i];
+            main_thread_handles.insert(main_thread_handles.begin(), running_handles.begin() + resumed_count,
+                                       running_handles.end());
+        }
+        running_handles.clear();
+    }
+}
+
+void get_main_thread_queue_depths(CoroutineScheduler *scheduler, uint32_t depths[TASK_PRIORITY_COUNT]) {
+    std::lock_guard<std::mutex> lock(scheduler->main_thread_handles_mutex);
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        depths[i] = static_cast<uint32_t>(scheduler->main_thread_handles[i].size());
+    }
+}
+
+void drain_coroutines(CoroutineScheduler *scheduler) {
+    while (scheduler->spawned_coroutine_count.load(std::memory_order_acquire) > 0) {
+        run_main_thread_coroutines(scheduler);
+        std::this_thread::yield();
+    }
+}
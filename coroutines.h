@@ -0,0 +1,173 @@
+#pragma once
+
+#include "tasks.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string>
+#include <vector>
+
+// 协程调度器：协程可以在worker线程上恢复，也可以回到主循环恢复（主循环每帧调用run_main_thread_coroutines）
+struct CoroutineScheduler {
+    TaskSystem *task_system;
+    double main_thread_budget_ms; // 每帧在主线程恢复协程的时间预算，0表示不限制；CRITICAL不受预算限制
+    std::mutex main_thread_handles_mutex;
+    std::vector<std::coroutine_handle<>> main_thread_handles[TASK_PRIORITY_COUNT]; // 等待在主线程恢复的协程
+    std::vector<std::coroutine_handle<>> running_handles; // 本帧正在恢复的协程，复用以避免每帧分配
+    std::atomic<uint32_t> spawned_coroutine_count; // spawn出去尚未结束的协程数
+};
+
+template<typename T>
+struct Async;
+
+// 协程结束时直接转移到等待它的协程（对称转移，连续co_await不会让调用栈增长）
+struct AsyncFinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+};
+
+struct AsyncPromiseBase {
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; } // 惰性启动，被co_await或spawn时才开始执行
+    AsyncFinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct AsyncPromise : AsyncPromiseBase {
+    std::optional<T> value;
+
+    Async<T> get_return_object();
+    void return_value(T result) { value.emplace(std::move(result)); }
+};
+
+template<>
+struct AsyncPromise<void> : AsyncPromiseBase {
+    Async<void> get_return_object();
+    void return_void() {}
+};
+
+// 异步操作的返回类型：在另一个协程中co_await它，或者用spawn启动
+template<typename T = void>
+struct Async {
+    using promise_type = AsyncPromise<T>;
+
+    std::coroutine_handle<promise_type> handle;
+
+    Async() = default;
+
+    explicit Async(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    Async(Async &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+    Async &operator=(Async &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    Async(const Async &) = delete;
+    Async &operator=(const Async &) = delete;
+
+    ~Async() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*handle.promise().value);
+        }
+    }
+};
+
+template<typename T>
+Async<T> AsyncPromise<T>::get_return_object() {
+    return Async<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+}
+
+inline Async<void> AsyncPromise<void>::get_return_object() {
+    return Async<void>(std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+}
+
+// 注意：task system停止后非worker线程提交的任务会被丢弃，此后挂起到worker上的协程不会再恢复
+struct ResumeOnWorkerAwaiter {
+    TaskSystem *task_system;
+    TaskPriority priority;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+};
+
+struct NextFrameAwaiter {
+    CoroutineScheduler *scheduler;
+    TaskPriority priority;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+};
+
+// 任务完成后在worker线程上恢复
+struct WaitTaskAwaiter {
+    TaskSystem *task_system;
+    TaskHandle task_handle;
+    TaskPriority priority;
+
+    bool await_ready() const { return is_task_complete(task_system, task_handle); }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+};
+
+// 在worker线程上读取文件，读取完成后在该worker线程上恢复
+struct LoadFileAwaiter {
+    TaskSystem *task_system;
+    TaskPriority priority;
+    std::string filepath;
+    std::vector<char> data;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    std::vector<char> await_resume() { return std::move(data); }
+};
+
+ResumeOnWorkerAwaiter resume_on_worker(CoroutineScheduler *scheduler, TaskPriority priority = TASK_PRIORITY_BACKGROUND);
+// 下一次run_main_thread_coroutines时在主线程恢复；超出本帧预算则顺延到之后的帧
+NextFrameAwaiter next_frame(CoroutineScheduler *scheduler, TaskPriority priority = TASK_PRIORITY_BACKGROUND);
+WaitTaskAwaiter wait_task_async(CoroutineScheduler *scheduler, TaskHandle task_handle,
+                                TaskPriority priority = TASK_PRIORITY_BACKGROUND);
+LoadFileAwaiter load_file(CoroutineScheduler *scheduler, std::string filepath,
+                          TaskPriority priority = TASK_PRIORITY_BACKGROUND);
+
+// 启动一个协程，协程结束时自动销毁
+void spawn(CoroutineScheduler *scheduler, Async<void> &&async);
+
+// 按优先级恢复等待主线程的协程，非CRITICAL的协程在用完main_thread_budget_ms后留到下一帧
+void run_main_thread_coroutines(CoroutineScheduler *scheduler);
+
+// 各优先级等待在主线程恢复的协程数，用于观察预算是否造成积压
+void get_main_thread_queue_depths(CoroutineScheduler *scheduler, uint32_t depths[TASK_PRIORITY_COUNT]);
+
+// 退出前调用：持续在主线程恢复协程，直到所有spawn出去的协程结束
+void drain_coroutines(CoroutineScheduler *scheduler);
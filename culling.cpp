@@ -0,0 +1,201 @@
+#include "culling.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CULLING_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// AVX2版本单独按AVX2/FMA编译，其余代码仍是基础指令集，运行时检测通过才会调用
+#if defined(__GNUC__)
+#define CULLING_TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+#else
+#define CULLING_TARGET_AVX2_FMA
+#endif
+
+void clear_bounding_spheres(BoundingSpheres *bounding_spheres) {
+    bounding_spheres->center_x.clear();
+    bounding_spheres->center_y.clear();
+    bounding_spheres->center_z.clear();
+    bounding_spheres->radius.clear();
+    bounding_spheres->count = 0;
+}
+
+uint32_t add_bounding_sphere(BoundingSpheres *bounding_spheres, const glm::vec4 &sphere) {
+    uint32_t index = bounding_spheres->count++;
+    if (index % CULLING_BATCH_SIZE == 0) {
+        // 一次补齐一整批，补齐的球半径为负、永远在视锥体外，SIMD循环不需要处理尾部
+        size_t padded_count = index + CULLING_BATCH_SIZE;
+        bounding_spheres->center_x.resize(padded_count, 0.0f);
+        bounding_spheres->center_y.resize(padded_count, 0.0f);
+        bounding_spheres->center_z.resize(padded_count, 0.0f);
+        bounding_spheres->radius.resize(padded_count, -INFINITY);
+    }
+    bounding_spheres->center_x[index] = sphere.x;
+    bounding_spheres->center_y[index] = sphere.y;
+    bounding_spheres->center_z[index] = sphere.z;
+    bounding_spheres->radius[index] = sphere.w;
+    return index;
+}
+
+glm::vec4 transform_bounding_sphere(const glm::mat4 &model, const glm::vec4 &sphere) {
+    glm::vec3 center = glm::vec3(model * glm::vec4(glm::vec3(sphere), 1.0f));
+    float scale_squared = std::max({
+        glm::dot(glm::vec3(model[0]), glm::vec3(model[0])),
+        glm::dot(glm::vec3(model[1]), glm::vec3(model[1])),
+        glm::dot(glm::vec3(model[2]), glm::vec3(model[2])),
+    });
+    return glm::vec4(center, sphere.w * std::sqrt(scale_squared));
+}
+
+#if defined(CULLING_X86)
+static bool detect_avx2_fma() {
+#if defined(_MSC_VER)
+    int registers[4];
+    __cpuid(registers, 1);
+    bool osxsave = (registers[2] & (1 << 27)) != 0;
+    bool avx = (registers[2] & (1 << 28)) != 0;
+    bool fma = (registers[2] & (1 << 12)) != 0;
+    if (!osxsave || !avx || !fma || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(registers, 7, 0);
+    return (registers[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+CULLING_TARGET_AVX2_FMA
+static void cull_bounding_spheres_avx2(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                                       uint32_t count, uint8_t *result) {
+    const float *center_x = bounding_spheres->center_x.data();
+    const float *center_y = bounding_spheres->center_y.data();
+    const float *center_z = bounding_spheres->center_z.data();
+    const float *radius = bounding_spheres->radius.data();
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 x = _mm256_loadu_ps(center_x + i);
+        __m256 y = _mm256_loadu_ps(center_y + i);
+        __m256 z = _mm256_loadu_ps(center_z + i);
+        __m256 negative_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (uint32_t p = 0; p < 6; ++p) {
+            __m256 distance = _mm256_fmadd_ps(x, _mm256_set1_ps(planes[p].x),
+                              _mm256_fmadd_ps(y, _mm256_set1_ps(planes[p].y),
+                              _mm256_fmadd_ps(z, _mm256_set1_ps(planes[p].z), _mm256_set1_ps(planes[p].w))));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negative_radius, _CMP_GE_OQ));
+        }
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(inside));
+        for (uint32_t j = 0; j < 8; ++j) {
+            result[i + j] = (mask >> j) & 1;
+        }
+    }
+}
+
+static void cull_bounding_spheres_sse2(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                                       uint32_t count, uint8_t *result) {
+    const float *center_x = bounding_spheres->center_x.data();
+    const float *center_y = bounding_spheres->center_y.data();
+    const float *center_z = bounding_spheres->center_z.data();
+    const float *radius = bounding_spheres->radius.data();
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 x = _mm_loadu_ps(center_x + i);
+        __m128 y = _mm_loadu_ps(center_y + i);
+        __m128 z = _mm_loadu_ps(center_z + i);
+        __m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (uint32_t p = 0; p < 6; ++p) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)),
+                                                    _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+                                         _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)),
+                                                    _mm_set1_ps(planes[p].w)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negative_radius));
+        }
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_ps(inside));
+        for (uint32_t j = 0; j < 4; ++j) {
+            result[i + j] = (mask >> j) & 1;
+        }
+    }
+}
+#elif defined(__ARM_NEON)
+static void cull_bounding_spheres_neon(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                                       uint32_t count, uint8_t *result) {
+    const float *center_x = bounding_spheres->center_x.data();
+    const float *center_y = bounding_spheres->center_y.data();
+    const float *center_z = bounding_spheres->center_z.data();
+    const float *radius = bounding_spheres->radius.data();
+    for (uint32_t i = 0; i < count; i += 4) {
+        float32x4_t x = vld1q_f32(center_x + i);
+        float32x4_t y = vld1q_f32(center_y + i);
+        float32x4_t z = vld1q_f32(center_z + i);
+        float32x4_t negative_radius = vnegq_f32(vld1q_f32(radius + i));
+        uint32x4_t inside = vdupq_n_u32(UINT32_MAX);
+        for (uint32_t p = 0; p < 6; ++p) {
+            float32x4_t distance = vdupq_n_f32(planes[p].w);
+            distance = vmlaq_n_f32(distance, x, planes[p].x);
+            distance = vmlaq_n_f32(distance, y, planes[p].y);
+            distance = vmlaq_n_f32(distance, z, planes[p].z);
+            inside = vandq_u32(inside, vcgeq_f32(distance, negative_radius));
+        }
+        uint32_t lanes[4];
+        vst1q_u32(lanes, inside);
+        for (uint32_t j = 0; j < 4; ++j) {
+            result[i + j] = lanes[j] != 0;
+        }
+    }
+}
+#else
+static void cull_bounding_spheres_scalar(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                                         uint32_t count, uint8_t *result) {
+    const float *center_x = bounding_spheres->center_x.data();
+    const float *center_y = bounding_spheres->center_y.data();
+    const float *center_z = bounding_spheres->center_z.data();
+    const float *radius = bounding_spheres->radius.data();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t inside = 1;
+        for (uint32_t p = 0; p < 6; ++p) {
+            float distance = planes[p].x * center_x[i] + planes[p].y * center_y[i] + planes[p].z * center_z[i] +
+                             planes[p].w;
+            inside &= distance >= -radius[i];
+        }
+        result[i] = inside;
+    }
+}
+#endif
+
+void cull_bounding_spheres(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                           std::vector<uint8_t> *visible, CullingStatistics *statistics) {
+    uint32_t count = bounding_spheres->count;
+    uint32_t padded_count = (count + CULLING_BATCH_SIZE - 1) / CULLING_BATCH_SIZE * CULLING_BATCH_SIZE;
+    visible->resize(padded_count);
+    uint8_t *result = visible->data();
+
+    // 球在某个平面外（dot(n, c) + d < -r）即不可见，6个平面都通过才可见；各版本都处理补齐后的数量，不需要尾部
+#if defined(CULLING_X86)
+    static const bool avx2_supported = detect_avx2_fma();
+    if (avx2_supported) {
+        cull_bounding_spheres_avx2(bounding_spheres, planes, padded_count, result);
+    } else {
+        cull_bounding_spheres_sse2(bounding_spheres, planes, padded_count, result);
+    }
+#elif defined(__ARM_NEON)
+    cull_bounding_spheres_neon(bounding_spheres, planes, padded_count, result);
+#else
+    cull_bounding_spheres_scalar(bounding_spheres, planes, padded_count, result);
+#endif
+
+    uint32_t visible_count = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        visible_count += result[i];
+    }
+    statistics->tested_count = count;
+    statistics->visible_count = visible_count;
+    statistics->culled_count = count - visible_count;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#define CULLING_BATCH_SIZE 8 // SoA数组按8个补齐：AVX2一次测试8个，SSE/NEON一次4个
+
+// 世界空间的包围球，按分量分开存放（SoA），SIMD一次读取连续的多个球
+struct BoundingSpheres {
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> radius;
+    uint32_t count;
+};
+
+struct CullingStatistics {
+    uint32_t tested_count;
+    uint32_t visible_count;
+    uint32_t culled_count;
+};
+
+void clear_bounding_spheres(BoundingSpheres *bounding_spheres);
+
+// 返回球的下标
+uint32_t add_bounding_sphere(BoundingSpheres *bounding_spheres, const glm::vec4 &sphere);
+
+// 把mesh局部空间的包围球变换到世界空间，半径按最大的轴缩放
+glm::vec4 transform_bounding_sphere(const glm::mat4 &model, const glm::vec4 &sphere);
+
+// 用extract_frustum_planes得到的6个平面测试所有球，(*visible)[i]为1表示第i个球与视锥体相交
+void cull_bounding_spheres(const BoundingSpheres *bounding_spheres, const glm::vec4 planes[6],
+                           std::vector<uint8_t> *visible, CullingStatistics *statistics);
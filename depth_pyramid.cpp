@@ -0,0 +1,292 @@
+#include "depth_pyramid.h"
+#include <cassert>
+
+static void create_depth_pyramid_image_view(VkContext *context, VkImage image, uint32_t base_level,
+                                            uint32_t level_count, VkImageView *image_view) {
+    VkImageViewCreateInfo image_view_create_info = {};
+    image_view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_create_info.image = image;
+    image_view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    image_view_create_info.format = DEPTH_PYRAMID_FORMAT;
+    image_view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_view_create_info.subresourceRange.baseMipLevel = base_level;
+    image_view_create_info.subresourceRange.levelCount = level_count;
+    image_view_create_info.subresourceRange.baseArrayLayer = 0;
+    image_view_create_info.subresourceRange.layerCount = 1;
+    VkResult result = vkCreateImageView(context->device, &image_view_create_info, nullptr, image_view);
+    assert(result == VK_SUCCESS);
+}
+
+static void write_depth_pyramid_descriptor_set(VkContext *context, VkDescriptorSet descriptor_set,
+                                               VkSampler sampler, VkImageView source_image_view,
+                                               VkImageLayout source_image_layout,
+                                               VkImageView destination_image_view) {
+    VkDescriptorImageInfo descriptor_image_infos[2] = {
+        {sampler, source_image_view, source_image_layout},
+        {VK_NULL_HANDLE, destination_image_view, VK_IMAGE_LAYOUT_GENERAL},
+    };
+    VkWriteDescriptorSet write_descriptor_sets[2] = {};
+    for (uint32_t i = 0; i < 2; ++i) {
+        write_descriptor_sets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptor_sets[i].dstSet = descriptor_set;
+        write_descriptor_sets[i].dstBinding = i;
+        write_descriptor_sets[i].descriptorCount = 1;
+        write_descriptor_sets[i].pImageInfo = &descriptor_image_infos[i];
+    }
+    write_descriptor_sets[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write_descriptor_sets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkUpdateDescriptorSets(context->device, 2, write_descriptor_sets, 0, nullptr);
+}
+
+void init_depth_pyramid(DepthPyramid *depth_pyramid, VkContext *context, uint32_t width, uint32_t height,
+                        uint32_t frame_count) {
+    depth_pyramid->width = width;
+    depth_pyramid->height = height;
+    depth_pyramid->level_count = 1;
+    uint32_t level_width = (width + 1) / 2;
+    uint32_t level_height = (height + 1) / 2;
+    while (level_width > 1 || level_height > 1) {
+        level_width = (level_width + 1) / 2;
+        level_height = (level_height + 1) / 2;
+        ++depth_pyramid->level_count;
+    }
+
+    VkImageCreateInfo image_create_info = {};
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.format = DEPTH_PYRAMID_FORMAT;
+    image_create_info.extent = {(width + 1) / 2, (height + 1) / 2, 1};
+    image_create_info.mipLevels = depth_pyramid->level_count;
+    image_create_info.arrayLayers = 1;
+    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_create_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkResult result = vkCreateImage(context->device, &image_create_info, nullptr, &depth_pyramid->image);
+    assert(result == VK_SUCCESS);
+    allocate_image_memory(context, depth_pyramid->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          &depth_pyramid->image_allocation);
+
+    create_depth_pyramid_image_view(context, depth_pyramid->image, 0, depth_pyramid->level_count,
+                                    &depth_pyramid->image_view);
+    depth_pyramid->level_image_views.resize(depth_pyramid->level_count);
+    for (uint32_t i = 0; i < depth_pyramid->level_count; ++i) {
+        create_depth_pyramid_image_view(context, depth_pyramid->image, i, 1, &depth_pyramid->level_image_views[i]);
+    }
+
+    VkSamplerCreateInfo sampler_create_info = {};
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_NEAREST;
+    sampler_create_info.minFilter = VK_FILTER_NEAREST;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.maxLod = VK_LOD_CLAMP_NONE;
+    result = vkCreateSampler(context->device, &sampler_create_info, nullptr, &depth_pyramid->sampler);
+    assert(result == VK_SUCCESS);
+
+    VkDescriptorSetLayoutBinding descriptor_set_layout_bindings[] = {
+        {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // 上一级
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // 当前级
+    };
+    VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {};
+    descriptor_set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptor_set_layout_create_info.bindingCount = std::size(descriptor_set_layout_bindings);
+    descriptor_set_layout_create_info.pBindings = descriptor_set_layout_bindings;
+    result = vkCreateDescriptorSetLayout(context->device, &descriptor_set_layout_create_info, nullptr,
+                                         &depth_pyramid->descriptor_set_layout);
+    assert(result == VK_SUCCESS);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &depth_pyramid->descriptor_set_layout;
+    result = vkCreatePipelineLayout(context->device, &pipeline_layout_create_info, nullptr,
+                                    &depth_pyramid->pipeline_layout);
+    assert(result == VK_SUCCESS);
+
+    VkShaderModule compute_shader_module = get_shader_module(context, "depth_pyramid.comp.spv");
+    VkComputePipelineCreateInfo compute_pipeline_create_info = {};
+    compute_pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    compute_pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    compute_pipeline_create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    compute_pipeline_create_info.stage.module = compute_shader_module;
+    compute_pipeline_create_info.stage.pName = "main";
+    compute_pipeline_create_info.layout = depth_pyramid->pipeline_layout;
+    result = vkCreateComputePipelines(context->device, context->pipeline_cache, 1, &compute_pipeline_create_info,
+                                      nullptr, &depth_pyramid->pipeline);
+    assert(result == VK_SUCCESS);
+
+    uint32_t descriptor_set_count = context->swapchain_image_count + depth_pyramid->level_count - 1;
+    VkDescriptorPoolSize descriptor_pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, descriptor_set_count},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, descriptor_set_count},
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info = {};
+    descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_create_info.maxSets = descriptor_set_count;
+    descriptor_pool_create_info.poolSizeCount = std::size(descriptor_pool_sizes);
+    descriptor_pool_create_info.pPoolSizes = descriptor_pool_sizes;
+    result = vkCreateDescriptorPool(context->device, &descriptor_pool_create_info, nullptr,
+                                    &depth_pyramid->descriptor_pool);
+    assert(result == VK_SUCCESS);
+
+    std::vector<VkDescriptorSetLayout> descriptor_set_layouts(descriptor_set_count,
+                                                              depth_pyramid->descriptor_set_layout);
+    std::vector<VkDescriptorSet> descriptor_sets(descriptor_set_count);
+    VkDescriptorSetAllocateInfo descriptor_set_allocate_info = {};
+    descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_allocate_info.descriptorPool = depth_pyramid->descriptor_pool;
+    descriptor_set_allocate_info.descriptorSetCount = descriptor_set_count;
+    descriptor_set_allocate_info.pSetLayouts = descriptor_set_layouts.data();
+    result = vkAllocateDescriptorSets(context->device, &descriptor_set_allocate_info, descriptor_sets.data());
+    assert(result == VK_SUCCESS);
+
+    depth_pyramid->depth_descriptor_sets.assign(descriptor_sets.begin(),
+                                                descriptor_sets.begin() + context->swapchain_image_count);
+    for (uint32_t i = 0; i < context->swapchain_image_count; ++i) {
+        write_depth_pyramid_descriptor_set(context, depth_pyramid->depth_descriptor_sets[i], depth_pyramid->sampler,
+                                           context->depth_image_views[i], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                           depth_pyramid->level_image_views[0]);
+    }
+    depth_pyramid->level_descriptor_sets.resize(depth_pyramid->level_count, VK_NULL_HANDLE);
+    for (uint32_t i = 1; i < depth_pyramid->level_count; ++i) {
+        depth_pyramid->level_descriptor_sets[i] = descriptor_sets[context->swapchain_image_count + i - 1];
+        write_depth_pyramid_descriptor_set(context, depth_pyramid->level_descriptor_sets[i], depth_pyramid->sampler,
+                                           depth_pyramid->level_image_views[i - 1], VK_IMAGE_LAYOUT_GENERAL,
+                                           depth_pyramid->level_image_views[i]);
+    }
+
+    depth_pyramid->timestamp_query_pool = VK_NULL_HANDLE;
+    if (context->timestamps_supported) {
+        VkQueryPoolCreateInfo query_pool_create_info = {};
+        query_pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        query_pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        query_pool_create_info.queryCount = 2 * frame_count;
+        result = vkCreateQueryPool(context->device, &query_pool_create_info, nullptr,
+                                   &depth_pyramid->timestamp_query_pool);
+        assert(result == VK_SUCCESS);
+    }
+    depth_pyramid->timestamps_written.assign(frame_count, false);
+    depth_pyramid->valid = false;
+}
+
+void cleanup_depth_pyramid(DepthPyramid *depth_pyramid, VkContext *context) {
+    if (depth_pyramid->timestamp_query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(context->device, depth_pyramid->timestamp_query_pool, nullptr);
+    }
+    vkDestroyDescriptorPool(context->device, depth_pyramid->descriptor_pool, nullptr);
+    depth_pyramid->depth_descriptor_sets.clear();
+    depth_pyramid->level_descriptor_sets.clear();
+    vkDestroyPipeline(context->device, depth_pyramid->pipeline, nullptr);
+    vkDestroyPipelineLayout(context->device, depth_pyramid->pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(context->device, depth_pyramid->descriptor_set_layout, nullptr);
+    vkDestroySampler(context->device, depth_pyramid->sampler, nullptr);
+    for (VkImageView level_image_view: depth_pyramid->level_image_views) {
+        vkDestroyImageView(context->device, level_image_view, nullptr);
+    }
+    depth_pyramid->level_image_views.clear();
+    vkDestroyImageView(context->device, depth_pyramid->image_view, nullptr);
+    vkDestroyImage(context->device, depth_pyramid->image, nullptr);
+    free_gpu_memory(context, depth_pyramid->image_allocation);
+}
+
+void record_depth_pyramid_build(DepthPyramid *depth_pyramid, VkContext *context, VkCommandBuffer command_buffer,
+                                uint32_t frame_index, uint32_t image_index, const glm::mat4 &view_projection) {
+    if (depth_pyramid->timestamp_query_pool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(command_buffer, depth_pyramid->timestamp_query_pool, 2 * frame_index, 2);
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, depth_pyramid->timestamp_query_pool,
+                            2 * frame_index);
+    }
+
+    // 深度图从附件转为采样；pyramid整体重写，旧内容（early剔除已经读完）直接丢弃
+    VkImageMemoryBarrier image_memory_barriers[2] = {};
+    image_memory_barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_memory_barriers[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    image_memory_barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    image_memory_barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    image_memory_barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_memory_barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_memory_barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_memory_barriers[0].image = context->depth_images[image_index];
+    image_memory_barriers[0].subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+    image_memory_barriers[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_memory_barriers[1].srcAccessMask = 0;
+    image_memory_barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    image_memory_barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_memory_barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    image_memory_barriers[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_memory_barriers[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_memory_barriers[1].image = depth_pyramid->image;
+    image_memory_barriers[1].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, depth_pyramid->level_count, 0, 1};
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+                         std::size(image_memory_barriers), image_memory_barriers);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, depth_pyramid->pipeline);
+    uint32_t level_width = (depth_pyramid->width + 1) / 2;
+    uint32_t level_height = (depth_pyramid->height + 1) / 2;
+    for (uint32_t i = 0; i < depth_pyramid->level_count; ++i) {
+        VkDescriptorSet descriptor_set = i == 0
+                                             ? depth_pyramid->depth_descriptor_sets[image_index]
+                                             : depth_pyramid->level_descriptor_sets[i];
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, depth_pyramid->pipeline_layout, 0, 1,
+                                &descriptor_set, 0, nullptr);
+        vkCmdDispatch(command_buffer, (level_width + DEPTH_PYRAMID_WORKGROUP_SIZE - 1) / DEPTH_PYRAMID_WORKGROUP_SIZE,
+                      (level_height + DEPTH_PYRAMID_WORKGROUP_SIZE - 1) / DEPTH_PYRAMID_WORKGROUP_SIZE, 1);
+
+        // 下一级（以及之后的剔除）读取这一级
+        VkImageMemoryBarrier level_barrier = {};
+        level_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        level_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        level_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        level_barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        level_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        level_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        level_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        level_barrier.image = depth_pyramid->image;
+        level_barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, i, 1, 0, 1};
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &level_barrier);
+
+        level_width = (level_width + 1) / 2;
+        level_height = (level_height + 1) / 2;
+    }
+
+    // 深度图转回附件，late render pass继续深度测试
+    VkImageMemoryBarrier depth_barrier = image_memory_barriers[0];
+    depth_barrier.srcAccessMask = 0;
+    depth_barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                  VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depth_barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &depth_barrier);
+
+    if (depth_pyramid->timestamp_query_pool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, depth_pyramid->timestamp_query_pool,
+                            2 * frame_index + 1);
+        depth_pyramid->timestamps_written[frame_index] = true;
+    }
+    depth_pyramid->valid = true;
+    depth_pyramid->view_projection = view_projection;
+}
+
+float read_depth_pyramid_build_time(DepthPyramid *depth_pyramid, VkContext *context, uint32_t frame_index) {
+    if (!depth_pyramid->timestamps_written[frame_index]) {
+        return -1.0f;
+    }
+    depth_pyramid->timestamps_written[frame_index] = false;
+    uint64_t timestamps[2] = {};
+    VkResult result = vkGetQueryPoolResults(context->device, depth_pyramid->timestamp_query_pool, 2 * frame_index, 2,
+                                            sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS) {
+        return -1.0f;
+    }
+    return static_cast<float>(timestamps[1] - timestamps[0]) * context->timestamp_period / 1e6f;
+}
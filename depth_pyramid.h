@@ -0,0 +1,44 @@
+#pragma once
+
+#include "vk.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+#define DEPTH_PYRAMID_WORKGROUP_SIZE 8 // 与depth_pyramid.comp的local_size一致
+#define DEPTH_PYRAMID_FORMAT VK_FORMAT_R32_SFLOAT
+
+// Hi-Z：深度缓冲的mip链，每个texel保存它覆盖区域内最远的深度。
+// level 0是深度缓冲的1/2，奇数尺寸时最后一行/列多覆盖一个texel，保证剔除是保守的。
+// image始终处于GENERAL layout，构建时写、剔除时读。
+struct DepthPyramid {
+    VkImage image;
+    GpuAllocation image_allocation;
+    VkImageView image_view; // 全部mip，供剔除读取
+    std::vector<VkImageView> level_image_views; // 每个mip一个，供构建时读写
+    uint32_t width; // 深度缓冲的尺寸
+    uint32_t height;
+    uint32_t level_count;
+    VkSampler sampler; // 只用texelFetch，不做过滤
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    std::vector<VkDescriptorSet> depth_descriptor_sets; // 每个深度图一个：depth -> level 0
+    std::vector<VkDescriptorSet> level_descriptor_sets; // level i - 1 -> level i，下标0不用
+    VkQueryPool timestamp_query_pool; // 每帧两个timestamp，测量构建耗时
+    std::vector<bool> timestamps_written;
+    bool valid; // 是否已经构建过，构建之前不能用来剔除
+    glm::mat4 view_projection; // 构建时的相机，下一帧用它把物体投影到这份pyramid上
+};
+
+void init_depth_pyramid(DepthPyramid *depth_pyramid, VkContext *context, uint32_t width, uint32_t height,
+                        uint32_t frame_count);
+
+void cleanup_depth_pyramid(DepthPyramid *depth_pyramid, VkContext *context);
+
+// 在early render pass之后调用：深度图转为采样layout，逐级构建后再转回附件layout供late render pass使用
+void record_depth_pyramid_build(DepthPyramid *depth_pyramid, VkContext *context, VkCommandBuffer command_buffer,
+                                uint32_t frame_index, uint32_t image_index, const glm::mat4 &view_projection);
+
+// 在该帧的fence等到之后调用，返回上一次用这个frame index构建的耗时（毫秒），没有结果时返回-1
+float read_depth_pyramid_build_time(DepthPyramid *depth_pyramid, VkContext *context, uint32_t frame_index);
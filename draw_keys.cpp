@@ -0,0 +1,89 @@
+#include "draw_keys.h"
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#define DRAW_KEY_RADIX_SIZE (1u << DRAW_KEY_RADIX_BITS)
+#define DRAW_KEY_RADIX_PASS_COUNT (64 / DRAW_KEY_RADIX_BITS)
+
+// 把float映射为按数值大小排序的无符号整数：正数翻转符号位，负数按位取反
+static uint32_t float_to_ordered_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+static uint64_t get_pipeline_bits(const PipelineKey &pipeline_key) {
+    assert(pipeline_key.state_bits < (1u << DRAW_KEY_PIPELINE_BITS));
+    return pipeline_key.state_bits;
+}
+
+static uint64_t get_geometry_arena_bits(uint32_t geometry_arena_index) {
+    assert(geometry_arena_index < (1u << DRAW_KEY_GEOMETRY_ARENA_BITS));
+    return geometry_arena_index;
+}
+
+static uint64_t get_mesh_bits(uint32_t mesh_index) {
+    assert(mesh_index < (1u << DRAW_KEY_MESH_BITS));
+    return mesh_index;
+}
+
+uint64_t make_scene_draw_key(const PipelineKey &compiled_pipeline_key, const PipelineKey &pipeline_key,
+                             uint32_t geometry_arena_index, uint32_t mesh_index, float distance) {
+    static_assert(DRAW_KEY_PIPELINE_BITS * 2 + DRAW_KEY_GEOMETRY_ARENA_BITS + DRAW_KEY_MESH_BITS + DRAW_KEY_DISTANCE_BITS == DRAW_KEY_QUEUE_SHIFT);
+    return static_cast<uint64_t>(RENDER_QUEUE_TYPE_SCENE) << DRAW_KEY_QUEUE_SHIFT |
+           get_pipeline_bits(compiled_pipeline_key) << (DRAW_KEY_PIPELINE_BITS + DRAW_KEY_GEOMETRY_ARENA_BITS + DRAW_KEY_MESH_BITS + DRAW_KEY_DISTANCE_BITS) |
+           get_pipeline_bits(pipeline_key) << (DRAW_KEY_GEOMETRY_ARENA_BITS + DRAW_KEY_MESH_BITS + DRAW_KEY_DISTANCE_BITS) |
+           get_geometry_arena_bits(geometry_arena_index) << (DRAW_KEY_MESH_BITS + DRAW_KEY_DISTANCE_BITS) |
+           get_mesh_bits(mesh_index) << DRAW_KEY_DISTANCE_BITS |
+           float_to_ordered_bits(distance) >> (32 - DRAW_KEY_DISTANCE_BITS);
+}
+
+uint64_t make_ui_draw_key(float z, const PipelineKey &compiled_pipeline_key, uint32_t mesh_index) {
+    uint32_t z_bits = ~float_to_ordered_bits(z); // z值大的先渲染（显示在后面）
+    return static_cast<uint64_t>(RENDER_QUEUE_TYPE_UI) << DRAW_KEY_QUEUE_SHIFT |
+           static_cast<uint64_t>(z_bits) << (DRAW_KEY_PIPELINE_BITS + DRAW_KEY_MESH_BITS) |
+           get_pipeline_bits(compiled_pipeline_key) << DRAW_KEY_MESH_BITS |
+           get_mesh_bits(mesh_index);
+}
+
+void radix_sort_draw_keys(std::vector<DrawKey> *draw_keys, std::vector<DrawKey> *scratch) {
+    size_t count = draw_keys->size();
+    if (count <= 1) {
+        return;
+    }
+    scratch->resize(count);
+
+    // 一次遍历统计所有趟的直方图
+    uint32_t histograms[DRAW_KEY_RADIX_PASS_COUNT][DRAW_KEY_RADIX_SIZE] = {};
+    for (const DrawKey &draw_key: *draw_keys) {
+        for (uint32_t pass = 0; pass < DRAW_KEY_RADIX_PASS_COUNT; ++pass) {
+            ++histograms[pass][(draw_key.key >> (pass * DRAW_KEY_RADIX_BITS)) & (DRAW_KEY_RADIX_SIZE - 1)];
+        }
+    }
+
+    DrawKey *source = draw_keys->data();
+    DrawKey *destination = scratch->data();
+    for (uint32_t pass = 0; pass < DRAW_KEY_RADIX_PASS_COUNT; ++pass) {
+        uint32_t *histogram = histograms[pass];
+        uint32_t shift = pass * DRAW_KEY_RADIX_BITS;
+        if (histogram[(source[0].key >> shift) & (DRAW_KEY_RADIX_SIZE - 1)] == count) {
+            continue;
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < DRAW_KEY_RADIX_SIZE; ++i) {
+            uint32_t bucket_count = histogram[i];
+            histogram[i] = offset;
+            offset += bucket_count;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            destination[histogram[(source[i].key >> shift) & (DRAW_KEY_RADIX_SIZE - 1)]++] = source[i];
+        }
+        std::swap(source, destination);
+    }
+
+    if (source != draw_keys->data()) {
+        draw_keys->swap(*scratch);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "vk.h"
+#include <cstdint>
+#include <vector>
+
+// 64位排序键，按键升序录制，同一队列、同一pipeline、同一mesh的绘制自然相邻。
+// pipeline按编译后的key（get_compiled_pipeline_key）排序，共用一个pipeline的请求状态排在一起，只绑定一次：
+// SCENE: [62-63] queue | [54-61] 编译后的pipeline | [46-53] 请求的pipeline | [43-45] geometry arena | [21-42] mesh |
+//        [0-20] 到相机距离的平方（由近到远，只保留高21位）
+// UI:    [62-63] queue | [30-61] z（由大到小） | [22-29] 编译后的pipeline | [0-21] mesh
+// SCENE在同一pipeline内按请求的状态和arena分组，间接绘制的每个桶只有一组动态状态、只绑定一个arena；
+// UI按z排序，录制时请求的状态或arena变化再重新设置
+#define DRAW_KEY_QUEUE_SHIFT 62
+#define DRAW_KEY_PIPELINE_BITS 8 // PipelineKey的state_bits目前只用到低8位；shader_hash不在键中，每个队列只用一个shader变体
+#define DRAW_KEY_GEOMETRY_ARENA_BITS 3 // MeshBuffers::geometry_arena_index
+#define DRAW_KEY_MESH_BITS 22 // mesh buffers的slot下标
+#define DRAW_KEY_DISTANCE_BITS 21
+#define DRAW_KEY_RADIX_BITS 8 // 基数排序每趟处理的位数
+
+enum RenderQueueType {
+    RENDER_QUEUE_TYPE_SCENE,
+    RENDER_QUEUE_TYPE_UI,
+};
+
+struct DrawKey {
+    uint64_t key;
+    uint32_t item_index; // 在本帧绘制列表中的下标
+};
+
+uint64_t make_scene_draw_key(const PipelineKey &compiled_pipeline_key, const PipelineKey &pipeline_key,
+                             uint32_t geometry_arena_index, uint32_t mesh_index, float distance);
+
+uint64_t make_ui_draw_key(float z, const PipelineKey &compiled_pipeline_key, uint32_t mesh_index);
+
+inline RenderQueueType get_draw_key_queue(uint64_t key) {
+    return static_cast<RenderQueueType>(key >> DRAW_KEY_QUEUE_SHIFT);
+}
+
+// LSD基数排序（稳定），所有键在某一趟的位上都相同时跳过这一趟。
+// scratch是同样大小的临时空间，跨帧复用以避免分配；排序结果在draw_keys中
+void radix_sort_draw_keys(std::vector<DrawKey> *draw_keys, std::vector<DrawKey> *scratch);
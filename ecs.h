@@ -20,3 +20,8 @@ struct Transform2D {
     glm::vec3 position; // x, y pos and z-order
     glm::vec2 scale;
 };
+
+// 标记不会移动的实体：静态缓存模式下它们的绘制命令只在静态场景变化时录制一次。
+// 修改Static实体的组件要通过registry.patch/replace，才会触发重新录制；Static实体的祖先也不应该移动
+struct Static {
+};
@@ -1,5 +1,6 @@
 #include "file.h"
 #include <cassert>
+#include <filesystem>
 #include <fstream>
 
 std::vector<char> read_binary_file(const std::string &filepath) {
@@ -12,3 +13,25 @@ std::vector<char> read_binary_file(const std::string &filepath) {
     file.close();
     return buffer;
 }
+
+bool file_exists(const std::string &filepath) {
+    std::error_code error_code;
+    return std::filesystem::is_regular_file(filepath, error_code);
+}
+
+bool write_binary_file(const std::string &filepath, const void *data, size_t size) {
+    std::string temporary_filepath = filepath + ".tmp";
+    {
+        std::ofstream file{temporary_filepath, std::ios::binary | std::ios::trunc};
+        if (!file.is_open()) {
+            return false;
+        }
+        file.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        if (!file) {
+            return false;
+        }
+    }
+    std::error_code error_code;
+    std::filesystem::rename(temporary_filepath, filepath, error_code);
+    return !error_code;
+}
@@ -4,3 +4,8 @@
 #include <vector>
 
 std::vector<char> read_binary_file(const std::string &filepath);
+
+bool file_exists(const std::string &filepath);
+
+// 先写到filepath.tmp再重命名，进程中途退出不会留下写了一半的文件
+bool write_binary_file(const std::string &filepath, const void *data, size_t size);
@@ -1,7 +1,16 @@
 #include "frame_context.h"
 
-void add_ref(FrameContext *frame_context, MeshBuffersHandle mesh_buffers_handle) {
-    frame_context->mesh_buffers_handles.insert(mesh_buffers_handle);
+bool add_ref(FrameContext *frame_context, MeshBuffersRegistry *mesh_buffers_registry,
+             MeshBuffersHandle mesh_buffers_handle) {
+    auto [it, inserted] = frame_context->mesh_buffers_handles.insert(mesh_buffers_handle);
+    if (!inserted) {
+        return true; // already referenced by this frame
+    }
+    if (!acquire_uploaded_mesh_buffers(mesh_buffers_registry, mesh_buffers_handle)) {
+        frame_context->mesh_buffers_handles.erase(it);
+        return false;
+    }
+    return true;
 }
 
 void on_gpu_complete(FrameContext *frame_context, MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
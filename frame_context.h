@@ -4,9 +4,11 @@
 #include <unordered_set>
 
 struct FrameContext {
-    std::unordered_set<MeshBuffersHandle> mesh_buffers_handles;
+    std::unordered_set<MeshBuffersHandle, MeshBuffersHandleHash> mesh_buffers_handles;
 };
 
-void add_ref(FrameContext *frame_context, MeshBuffersHandle mesh_buffers_handle);
+// 本帧第一次引用该mesh时增加引用计数，之后重复引用不再计数；mesh尚未上传则返回false
+bool add_ref(FrameContext *frame_context, MeshBuffersRegistry *mesh_buffers_registry,
+             MeshBuffersHandle mesh_buffers_handle);
 void on_gpu_complete(FrameContext *frame_context, MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
                      VkContext *vk_context);
@@ -0,0 +1,311 @@
+#include "indirect_draw.h"
+#include "camera.h"
+#include <cassert>
+#include <cstring>
+
+// 与cull.comp中的CullUniforms一致（std140）
+struct IndirectCullUniforms {
+    glm::vec4 frustum_planes[6];
+    glm::mat4 view_projection;
+    glm::mat4 occlusion_view_projection;
+    glm::vec2 depth_size;
+    uint32_t object_count;
+    uint32_t compact; // 1: 可见物体压缩到桶的前部并计数，0: 不可见物体写instanceCount = 0
+    uint32_t early_occlusion_enabled;
+    uint32_t occlusion_enabled;
+    uint32_t late_command_offset;
+    uint32_t padding;
+};
+
+// 与cull.comp中的CullConstants一致
+struct IndirectCullConstants {
+    uint32_t phase;
+};
+
+bool is_indirect_draw_supported(VkContext *context) {
+    return context->draw_indirect_first_instance_supported;
+}
+
+static void create_indirect_draw_frame_buffers(VkContext *context, IndirectDrawFrame *frame, uint32_t capacity) {
+    frame->capacity = capacity;
+    create_buffer_with_memory(context, sizeof(IndirectObject) * capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              &frame->object_buffer, &frame->object_buffer_allocation);
+    create_buffer_with_memory(context, sizeof(VkDrawIndexedIndirectCommand) * 2 * capacity,
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame->command_buffer,
+                              &frame->command_buffer_allocation);
+    create_buffer_with_memory(context, sizeof(uint32_t) * capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame->visibility_buffer,
+                              &frame->visibility_buffer_allocation);
+}
+
+static void destroy_indirect_draw_frame_buffers(VkContext *context, IndirectDrawFrame *frame) {
+    destroy_buffer_with_memory(context, frame->object_buffer, frame->object_buffer_allocation);
+    destroy_buffer_with_memory(context, frame->command_buffer, frame->command_buffer_allocation);
+    destroy_buffer_with_memory(context, frame->visibility_buffer, frame->visibility_buffer_allocation);
+}
+
+void init_indirect_draw(IndirectDrawContext *indirect_draw_context, VkContext *context, uint32_t frame_count) {
+    VkDescriptorSetLayoutBinding descriptor_set_layout_bindings[] = {
+        {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // instances
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // objects
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // commands
+        {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // counts
+        {4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // depth pyramid
+        {5, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // uniforms
+        {6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // visibilities
+        {7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr}, // statistics
+    };
+    VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {};
+    descriptor_set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptor_set_layout_create_info.bindingCount = std::size(descriptor_set_layout_bindings);
+    descriptor_set_layout_create_info.pBindings = descriptor_set_layout_bindings;
+    VkResult result = vkCreateDescriptorSetLayout(context->device, &descriptor_set_layout_create_info, nullptr,
+                                                  &indirect_draw_context->descriptor_set_layout);
+    assert(result == VK_SUCCESS);
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(IndirectCullConstants);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &indirect_draw_context->descriptor_set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    result = vkCreatePipelineLayout(context->device, &pipeline_layout_create_info, nullptr,
+                                    &indirect_draw_context->pipeline_layout);
+    assert(result == VK_SUCCESS);
+
+    VkShaderModule compute_shader_module = get_shader_module(context, "cull.comp.spv");
+    VkComputePipelineCreateInfo compute_pipeline_create_info = {};
+    compute_pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    compute_pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    compute_pipeline_create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    compute_pipeline_create_info.stage.module = compute_shader_module;
+    compute_pipeline_create_info.stage.pName = "main";
+    compute_pipeline_create_info.layout = indirect_draw_context->pipeline_layout;
+    result = vkCreateComputePipelines(context->device, context->pipeline_cache, 1, &compute_pipeline_create_info,
+                                      nullptr, &indirect_draw_context->pipeline);
+    assert(result == VK_SUCCESS);
+
+    VkDescriptorPoolSize descriptor_pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6 * frame_count},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame_count},
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame_count},
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info = {};
+    descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_create_info.maxSets = frame_count;
+    descriptor_pool_create_info.poolSizeCount = std::size(descriptor_pool_sizes);
+    descriptor_pool_create_info.pPoolSizes = descriptor_pool_sizes;
+    result = vkCreateDescriptorPool(context->device, &descriptor_pool_create_info, nullptr,
+                                    &indirect_draw_context->descriptor_pool);
+    assert(result == VK_SUCCESS);
+
+    indirect_draw_context->frames.resize(frame_count);
+    for (IndirectDrawFrame &frame: indirect_draw_context->frames) {
+        create_indirect_draw_frame_buffers(context, &frame, INITIAL_INDIRECT_OBJECT_CAPACITY);
+        create_buffer_with_memory(context, sizeof(uint32_t) * 2 * MAX_INDIRECT_DRAW_BUCKETS,
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame.count_buffer,
+                                  &frame.count_buffer_allocation);
+        create_buffer_with_memory(context, sizeof(IndirectCullUniforms), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  &frame.uniform_buffer, &frame.uniform_buffer_allocation);
+        create_buffer_with_memory(context, sizeof(IndirectDrawStatistics), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  &frame.statistics_buffer, &frame.statistics_buffer_allocation);
+        memset(frame.statistics_buffer_allocation.mapped_data, 0, sizeof(IndirectDrawStatistics));
+
+        VkDescriptorSetAllocateInfo descriptor_set_allocate_info = {};
+        descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        descriptor_set_allocate_info.descriptorPool = indirect_draw_context->descriptor_pool;
+        descriptor_set_allocate_info.descriptorSetCount = 1;
+        descriptor_set_allocate_info.pSetLayouts = &indirect_draw_context->descriptor_set_layout;
+        result = vkAllocateDescriptorSets(context->device, &descriptor_set_allocate_info, &frame.descriptor_set);
+        assert(result == VK_SUCCESS);
+    }
+}
+
+void cleanup_indirect_draw(IndirectDrawContext *indirect_draw_context, VkContext *context) {
+    for (IndirectDrawFrame &frame: indirect_draw_context->frames) {
+        destroy_indirect_draw_frame_buffers(context, &frame);
+        destroy_buffer_with_memory(context, frame.count_buffer, frame.count_buffer_allocation);
+        destroy_buffer_with_memory(context, frame.uniform_buffer, frame.uniform_buffer_allocation);
+        destroy_buffer_with_memory(context, frame.statistics_buffer, frame.statistics_buffer_allocation);
+    }
+    indirect_draw_context->frames.clear();
+    vkDestroyDescriptorPool(context->device, indirect_draw_context->descriptor_pool, nullptr);
+    vkDestroyPipeline(context->device, indirect_draw_context->pipeline, nullptr);
+    vkDestroyPipelineLayout(context->device, indirect_draw_context->pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(context->device, indirect_draw_context->descriptor_set_layout, nullptr);
+}
+
+IndirectObject *map_indirect_objects(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                                     uint32_t frame_index, uint32_t object_count) {
+    IndirectDrawFrame *frame = &indirect_draw_context->frames[frame_index];
+    if (object_count > frame->capacity) {
+        // 这一帧的fence已经等到，旧buffer不再被GPU使用
+        uint32_t capacity = frame->capacity;
+        while (capacity < object_count) {
+            capacity *= 2;
+        }
+        destroy_indirect_draw_frame_buffers(context, frame);
+        create_indirect_draw_frame_buffers(context, frame, capacity);
+    }
+    return static_cast<IndirectObject *>(frame->object_buffer_allocation.mapped_data);
+}
+
+static void dispatch_indirect_culling(IndirectDrawContext *indirect_draw_context, VkCommandBuffer command_buffer,
+                                      uint32_t frame_index, uint32_t object_count, IndirectDrawPhase phase) {
+    IndirectDrawFrame *frame = &indirect_draw_context->frames[frame_index];
+    IndirectCullConstants cull_constants = {};
+    cull_constants.phase = phase;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, indirect_draw_context->pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, indirect_draw_context->pipeline_layout,
+                            0, 1, &frame->descriptor_set, 0, nullptr);
+    vkCmdPushConstants(command_buffer, indirect_draw_context->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(IndirectCullConstants), &cull_constants);
+    vkCmdDispatch(command_buffer, (object_count + INDIRECT_CULL_WORKGROUP_SIZE - 1) / INDIRECT_CULL_WORKGROUP_SIZE, 1,
+                  1);
+}
+
+void record_indirect_culling(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                             VkCommandBuffer command_buffer, uint32_t frame_index, VkBuffer instance_buffer,
+                             uint32_t object_count, const glm::mat4 &view_projection,
+                             const DepthPyramid *depth_pyramid, bool occlusion_enabled) {
+    IndirectDrawFrame *frame = &indirect_draw_context->frames[frame_index];
+
+    IndirectCullUniforms *cull_uniforms = static_cast<IndirectCullUniforms *>(frame->uniform_buffer_allocation.mapped_data);
+    extract_frustum_planes(view_projection, cull_uniforms->frustum_planes);
+    cull_uniforms->view_projection = view_projection;
+    cull_uniforms->occlusion_view_projection = depth_pyramid->view_projection;
+    cull_uniforms->depth_size = glm::vec2(depth_pyramid->width, depth_pyramid->height);
+    cull_uniforms->object_count = object_count;
+    cull_uniforms->compact = context->draw_indirect_count_supported ? 1 : 0;
+    cull_uniforms->early_occlusion_enabled = occlusion_enabled && depth_pyramid->valid ? 1 : 0;
+    cull_uniforms->occlusion_enabled = occlusion_enabled ? 1 : 0;
+    cull_uniforms->late_command_offset = frame->capacity;
+
+    // buffer可能因扩容而重建，每帧重写描述符
+    VkDescriptorBufferInfo descriptor_buffer_infos[] = {
+        {instance_buffer, 0, VK_WHOLE_SIZE},
+        {frame->object_buffer, 0, VK_WHOLE_SIZE},
+        {frame->command_buffer, 0, VK_WHOLE_SIZE},
+        {frame->count_buffer, 0, VK_WHOLE_SIZE},
+        {}, // depth pyramid
+        {frame->uniform_buffer, 0, VK_WHOLE_SIZE},
+        {frame->visibility_buffer, 0, VK_WHOLE_SIZE},
+        {frame->statistics_buffer, 0, VK_WHOLE_SIZE},
+    };
+    VkDescriptorImageInfo descriptor_image_info = {depth_pyramid->sampler, depth_pyramid->image_view,
+                                                   VK_IMAGE_LAYOUT_GENERAL};
+    VkWriteDescriptorSet write_descriptor_sets[std::size(descriptor_buffer_infos)] = {};
+    for (uint32_t i = 0; i < std::size(descriptor_buffer_infos); ++i) {
+        write_descriptor_sets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptor_sets[i].dstSet = frame->descriptor_set;
+        write_descriptor_sets[i].dstBinding = i;
+        write_descriptor_sets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write_descriptor_sets[i].descriptorCount = 1;
+        write_descriptor_sets[i].pBufferInfo = &descriptor_buffer_infos[i];
+    }
+    write_descriptor_sets[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write_descriptor_sets[4].pBufferInfo = nullptr;
+    write_descriptor_sets[4].pImageInfo = &descriptor_image_info;
+    write_descriptor_sets[5].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    vkUpdateDescriptorSets(context->device, std::size(write_descriptor_sets), write_descriptor_sets, 0, nullptr);
+
+    if (!depth_pyramid->valid) {
+        // 还没构建过的pyramid不会被读取，但描述符要求它处于GENERAL
+        VkImageMemoryBarrier image_memory_barrier = {};
+        image_memory_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        image_memory_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        image_memory_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        image_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_memory_barrier.image = depth_pyramid->image;
+        image_memory_barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, depth_pyramid->level_count, 0, 1};
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
+    }
+
+    vkCmdFillBuffer(command_buffer, frame->count_buffer, 0, sizeof(uint32_t) * 2 * MAX_INDIRECT_DRAW_BUCKETS, 0);
+    VkMemoryBarrier memory_barrier = {};
+    memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &memory_barrier, 0, nullptr, 0, nullptr);
+
+    if (object_count > 0) {
+        dispatch_indirect_culling(indirect_draw_context, command_buffer, frame_index, object_count,
+                                  INDIRECT_DRAW_PHASE_EARLY);
+    }
+
+    memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+                         1, &memory_barrier, 0, nullptr, 0, nullptr);
+}
+
+void record_late_indirect_culling(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                                  VkCommandBuffer command_buffer, uint32_t frame_index, uint32_t object_count) {
+    // pyramid的写入已由构建时的barrier保证可见，这里让early阶段写的visibility buffer对late阶段可见
+    VkMemoryBarrier memory_barrier = {};
+    memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &memory_barrier, 0, nullptr, 0, nullptr);
+
+    if (object_count > 0) {
+        dispatch_indirect_culling(indirect_draw_context, command_buffer, frame_index, object_count,
+                                  INDIRECT_DRAW_PHASE_LATE);
+    }
+
+    // 间接绘制读取late阶段的命令，CPU在fence之后读取统计
+    memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memory_barrier, 0,
+                         nullptr, 0, nullptr);
+}
+
+void draw_indirect_bucket(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                          VkCommandBuffer command_buffer, uint32_t frame_index, const IndirectDrawBucket &bucket,
+                          IndirectDrawPhase phase) {
+    IndirectDrawFrame *frame = &indirect_draw_context->frames[frame_index];
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    uint32_t first_command = bucket.first_command;
+    uint32_t count_index = bucket.bucket_index;
+    if (phase == INDIRECT_DRAW_PHASE_LATE) {
+        first_command += frame->capacity;
+        count_index += MAX_INDIRECT_DRAW_BUCKETS;
+    }
+    VkDeviceSize offset = static_cast<VkDeviceSize>(first_command) * stride;
+    if (context->draw_indirect_count_supported) {
+        vkCmdDrawIndexedIndirectCount(command_buffer, frame->command_buffer, offset, frame->count_buffer,
+                                      sizeof(uint32_t) * count_index, bucket.command_count, stride);
+    } else if (context->multi_draw_indirect_supported) {
+        vkCmdDrawIndexedIndirect(command_buffer, frame->command_buffer, offset, bucket.command_count, stride);
+    } else {
+        // 没有multiDrawIndirect时drawCount只能为1
+        for (uint32_t i = 0; i < bucket.command_count; ++i) {
+            vkCmdDrawIndexedIndirect(command_buffer, frame->command_buffer, offset + i * stride, 1, stride);
+        }
+    }
+}
+
+IndirectDrawStatistics read_indirect_draw_statistics(IndirectDrawContext *indirect_draw_context,
+                                                     uint32_t frame_index) {
+    IndirectDrawFrame *frame = &indirect_draw_context->frames[frame_index];
+    IndirectDrawStatistics *statistics = static_cast<IndirectDrawStatistics *>(frame->statistics_buffer_allocation.mapped_data);
+    IndirectDrawStatistics result = *statistics;
+    *statistics = {};
+    return result;
+}
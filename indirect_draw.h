@@ -0,0 +1,101 @@
+#pragma once
+
+#include "depth_pyramid.h"
+#include "vk.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+#define INDIRECT_CULL_WORKGROUP_SIZE 64 // 与cull.comp的local_size_x一致
+#define MAX_INDIRECT_DRAW_BUCKETS 32 // 每帧最多的桶（pipeline × geometry arena）数，与cull.comp一致；count buffer每个阶段各一份
+#define INITIAL_INDIRECT_OBJECT_CAPACITY 1024 // 不够时翻倍
+
+// 一个物体的绘制参数，与cull.comp中IndirectObject的std430布局一致
+struct IndirectObject {
+    glm::vec4 bounding_sphere; // mesh局部空间的包围球，在shader中用实例的model矩阵变换
+    uint32_t first_index;
+    uint32_t index_count;
+    int32_t vertex_offset;
+    uint32_t instance_index; // 在本帧instance buffer中的下标，作为firstInstance
+    uint32_t bucket_index;
+    uint32_t bucket_first_command; // 桶在command buffer中的起点
+    uint32_t command_index; // 不压缩时写入的位置 = 桶的起点 + 桶内序号
+    uint32_t padding;
+};
+
+// 请求的pipeline状态相同、geometry arena相同的物体在command buffer中占一段连续区间，用一次间接绘制画完
+struct IndirectDrawBucket {
+    uint32_t bucket_index;
+    uint32_t first_command;
+    uint32_t command_count; // 桶内物体数，剔除前
+    uint32_t geometry_arena_index; // 桶内所有物体的顶点和索引都在这个arena中
+    PipelineKey pipeline_key; // 请求的key，间接绘制之前按它设置动态状态
+};
+
+// 两阶段遮挡剔除：early阶段用上一帧的Hi-Z剔除并绘制，late阶段用本帧的Hi-Z重测early没画的物体
+enum IndirectDrawPhase {
+    INDIRECT_DRAW_PHASE_EARLY,
+    INDIRECT_DRAW_PHASE_LATE,
+};
+
+// 与cull.comp中的StatisticsBuffer一致
+struct IndirectDrawStatistics {
+    uint32_t occluded_count; // 在视锥体内但被Hi-Z剔除的物体数
+    uint32_t late_drawn_count; // 上一帧的Hi-Z认为被遮挡、本帧露出来的物体数
+};
+
+struct IndirectDrawFrame {
+    VkBuffer object_buffer; // host visible，CPU每帧写入
+    GpuAllocation object_buffer_allocation;
+    VkBuffer command_buffer; // compute写入，间接绘制读取；前一半给early阶段，后一半给late阶段
+    GpuAllocation command_buffer_allocation;
+    VkBuffer visibility_buffer; // 每个物体在early阶段是否已经画过
+    GpuAllocation visibility_buffer_allocation;
+    VkBuffer count_buffer; // 每个阶段每个桶的可见物体数
+    GpuAllocation count_buffer_allocation;
+    VkBuffer uniform_buffer; // host visible，剔除参数
+    GpuAllocation uniform_buffer_allocation;
+    VkBuffer statistics_buffer; // host visible，fence等到后读取
+    GpuAllocation statistics_buffer_allocation;
+    uint32_t capacity;
+    VkDescriptorSet descriptor_set;
+};
+
+// GPU驱动的绘制：物体的绘制参数放在GPU buffer里，compute做视锥剔除并生成间接绘制命令，
+// 每个pipeline一次vkCmdDrawIndexedIndirectCount，CPU录制的命令数与物体数无关
+struct IndirectDrawContext {
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    std::vector<IndirectDrawFrame> frames;
+};
+
+// 设备不支持drawIndirectFirstInstance时不可用，调用方应退回CPU录制
+bool is_indirect_draw_supported(VkContext *context);
+
+void init_indirect_draw(IndirectDrawContext *indirect_draw_context, VkContext *context, uint32_t frame_count);
+
+void cleanup_indirect_draw(IndirectDrawContext *indirect_draw_context, VkContext *context);
+
+// 确保本帧能容纳object_count个物体，返回映射好的object buffer；需在该帧的fence等到之后调用
+IndirectObject *map_indirect_objects(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                                     uint32_t frame_index, uint32_t object_count);
+
+// 在early render pass之前调用：清零计数，用上一次构建的pyramid做early阶段剔除，并插入到间接绘制的barrier
+void record_indirect_culling(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                             VkCommandBuffer command_buffer, uint32_t frame_index, VkBuffer instance_buffer,
+                             uint32_t object_count, const glm::mat4 &view_projection,
+                             const DepthPyramid *depth_pyramid, bool occlusion_enabled);
+
+// 在record_depth_pyramid_build之后、late render pass之前调用
+void record_late_indirect_culling(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                                  VkCommandBuffer command_buffer, uint32_t frame_index, uint32_t object_count);
+
+// 在render pass内、绑定好pipeline和geometry arena之后调用
+void draw_indirect_bucket(IndirectDrawContext *indirect_draw_context, VkContext *context,
+                          VkCommandBuffer command_buffer, uint32_t frame_index, const IndirectDrawBucket &bucket,
+                          IndirectDrawPhase phase);
+
+// 在该帧的fence等到之后调用，读取上一次用这个frame index剔除的统计并清零
+IndirectDrawStatistics read_indirect_draw_statistics(IndirectDrawContext *indirect_draw_context,
+                                                     uint32_t frame_index);
@@ -1,13 +1,22 @@
 #include "camera.h"
+#include "coroutines.h"
+#include "culling.h"
+#include "depth_pyramid.h"
+#include "draw_keys.h"
 #include "ecs.h"
 #include "events.h"
 #include "frame_context.h"
+#include "indirect_draw.h"
 #include "inputs.h"
 #include "meshes.h"
+#include "pipelines.h"
 #include "raycast.h"
+#include "secondary_command_buffers.h"
 #include "semaphores.h"
 #include "tasks.h"
+#include "transforms.h"
 #include "vk.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <unordered_set>
@@ -23,6 +32,8 @@
 #include <iostream>
 
 #define MAX_FRAMES_IN_FLIGHT 2
+#define INITIAL_INSTANCE_CAPACITY 1024 // 每帧instance buffer的初始实例数，不够时翻倍
+#define RECORD_JOB_BATCH_COUNT 256 // 一个录制任务最多录制的批次数，批次多的pipeline拆成多个任务并行录制
 
 struct VkDemo {
 };
@@ -30,18 +41,76 @@ struct VkDemo {
 Inputs inputs = {};
 Events events = {};
 TaskSystem task_system = {};
+CoroutineScheduler coroutine_scheduler = {};
 VkContext vk_context = {};
+PipelineManager pipeline_manager = {};
+uint32_t scene_shader_hash = 0; // triangle.vert + triangle.frag，固定使用场景相机
+uint32_t ui_shader_hash = 0; // 同上，固定使用UI相机
 MeshBuffersRegistry mesh_buffers_registry = {};
+IndirectDrawContext indirect_draw_context = {};
+DepthPyramid depth_pyramid = {};
+SecondaryCommandBuffers secondary_command_buffers = {};
+bool gpu_driven_enabled = false; // G切换：SCENE的有索引mesh由compute剔除并间接绘制
+bool occlusion_culling_enabled = true; // O切换：GPU驱动模式下的Hi-Z两阶段遮挡剔除
+bool static_draw_cache_enabled = false; // K切换：Static实体的绘制命令缓存在secondary command buffer中
+uint64_t static_scene_generation = 1; // Static实体的组件增删改或世界矩阵重新计算时递增，静态场景在下一帧重建
+CullingStatistics culling_statistics = {}; // 最近一帧SCENE实体的视锥剔除结果
+IndirectDrawStatistics indirect_draw_statistics = {}; // 最近一次完成的GPU剔除结果
+float depth_pyramid_build_time_ms = -1.0f;
 Camera camera = {};
 VkPolygonMode polygon_mode = VK_POLYGON_MODE_FILL;
 VkCullModeFlags cull_mode = VK_CULL_MODE_BACK_BIT;
 entt::registry registry;
+WorldMatrixUpdate world_matrix_update = {};
+entt::entity gizmo_entity = entt::null; // gizmo的根节点，圆环是它的子节点：移动gizmo只需patch根节点的Transform
 entt::entity gizmo_y_ring_entity = entt::null;
 
 static void glfw_error_callback(int error, const char *description) {
     assert(false);
 }
 
+// 打印各优先级lane的排队深度和等待时间（自上次打印以来），用于观察低优先级任务是否被饿死
+static void print_task_statistics() {
+    const char *priority_names[TASK_PRIORITY_COUNT] = {"critical", "upload", "background", "destroy"};
+    TaskLaneStatistics statistics[TASK_PRIORITY_COUNT];
+    collect_task_lane_statistics(&task_system, statistics);
+    uint32_t main_thread_queue_depths[TASK_PRIORITY_COUNT];
+    get_main_thread_queue_depths(&coroutine_scheduler, main_thread_queue_depths);
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        std::cout << priority_names[i] << ": 队列深度 " << statistics[i].queue_depth
+                  << ", 已执行 " << statistics[i].executed_count
+                  << ", 平均等待 " << statistics[i].average_wait_ms << " ms"
+                  << ", 最长等待 " << statistics[i].max_wait_ms << " ms"
+                  << ", 等待主线程的协程 " << main_thread_queue_depths[i] << std::endl;
+    }
+}
+
+// 打印GPU内存子分配器的占用与碎片情况
+static void print_gpu_memory_statistics() {
+    GpuAllocatorStatistics statistics = get_gpu_allocator_statistics(&vk_context);
+    std::cout << "GPU内存: 块 " << statistics.block_count
+              << ", 分配 " << statistics.allocation_count
+              << ", 申请 " << statistics.reserved_size / 1024 << " KB"
+              << ", 已用 " << statistics.allocated_size / 1024 << " KB"
+              << " (请求 " << statistics.requested_size / 1024 << " KB)"
+              << ", 最大空闲块 " << statistics.largest_free_block_size / 1024 << " KB"
+              << ", 内部碎片 " << statistics.internal_fragmentation * 100.0f << "%"
+              << ", 外部碎片 " << statistics.external_fragmentation * 100.0f << "%" << std::endl;
+}
+
+// 打印最近一帧的CPU视锥剔除结果
+static void print_culling_statistics() {
+    std::cout << "视锥剔除: 测试 " << culling_statistics.tested_count
+              << ", 可见 " << culling_statistics.visible_count
+              << ", 剔除 " << culling_statistics.culled_count << std::endl;
+    if (gpu_driven_enabled) {
+        std::cout << "Hi-Z遮挡剔除" << (occlusion_culling_enabled ? "" : "(已关闭)")
+                  << ": 被遮挡 " << indirect_draw_statistics.occluded_count
+                  << ", late阶段补画 " << indirect_draw_statistics.late_drawn_count
+                  << ", 构建pyramid " << depth_pyramid_build_time_ms << " ms" << std::endl;
+    }
+}
+
 static void glfw_key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
     if (action == GLFW_PRESS) {
         press_key(&inputs, key);
@@ -55,6 +124,26 @@ static void glfw_key_callback(GLFWwindow *window, int key, int scancode, int act
             polygon_mode = polygon_mode == VK_POLYGON_MODE_FILL ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
         } else if (key == GLFW_KEY_C) {
             cull_mode = cull_mode == VK_CULL_MODE_NONE ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+        } else if (key == GLFW_KEY_T) {
+            print_task_statistics();
+        } else if (key == GLFW_KEY_M) {
+            print_gpu_memory_statistics();
+        } else if (key == GLFW_KEY_V) {
+            print_culling_statistics();
+        } else if (key == GLFW_KEY_O) {
+            occlusion_culling_enabled = !occlusion_culling_enabled;
+            std::cout << (occlusion_culling_enabled ? "启用" : "关闭") << "Hi-Z遮挡剔除" << std::endl;
+        } else if (key == GLFW_KEY_K) {
+            static_draw_cache_enabled = !static_draw_cache_enabled;
+            ++static_scene_generation; // 关闭期间instance buffer的开头被动态实例覆盖，重新开启时要重新录制
+            std::cout << (static_draw_cache_enabled ? "启用" : "关闭") << "静态绘制缓存" << std::endl;
+        } else if (key == GLFW_KEY_G) {
+            if (is_indirect_draw_supported(&vk_context)) {
+                gpu_driven_enabled = !gpu_driven_enabled;
+                std::cout << (gpu_driven_enabled ? "GPU驱动绘制" : "CPU录制绘制") << std::endl;
+            } else {
+                std::cout << "设备不支持drawIndirectFirstInstance，无法使用GPU驱动绘制" << std::endl;
+            }
         }
     }
 }
@@ -75,6 +164,30 @@ static void glfw_cursor_pos_callback(GLFWwindow *window, double xpos, double ypo
     dispatch_event(&events, EVENT_CODE_MOUSE_MOVE, EventData{.f32 = {x, y}});
 }
 
+// 在worker上生成并上传射线mesh，上传完成后回到主循环再创建实体（entt registry只在主线程修改）
+static Async<void> create_ray_line_entity(glm::vec3 start, glm::vec3 end) {
+    co_await resume_on_worker(&coroutine_scheduler, TASK_PRIORITY_UPLOAD);
+    MeshData mesh_data = generate_line_mesh_data(start, end);
+    MeshBuffersHandle mesh_buffers_handle = co_await upload_mesh(&coroutine_scheduler, &mesh_buffers_registry,
+                                                                 &vk_context, std::move(mesh_data));
+    co_await next_frame(&coroutine_scheduler);
+
+    auto entity = registry.create();
+
+    Mesh &mesh = registry.emplace<Mesh>(entity);
+    mesh.mesh_buffers_handle = mesh_buffers_handle;
+
+    Transform &transform = registry.emplace<Transform>(entity);
+    transform.position = glm::vec3(0.0f, 0.0f, 0.0f);
+    transform.orientation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    transform.scale = glm::vec3(1.0f, 1.0f, 1.0f);
+
+    auto &material = registry.emplace<Material>(entity);
+    material.color = glm::vec3(1.0f, 1.0f, 1.0f);
+
+    registry.emplace<Static>(entity); // 射线创建后不再移动
+}
+
 static void glfw_mouse_button_callback(GLFWwindow *window, int button, int action, int mods) {
     if (action == GLFW_PRESS) {
         press_mouse_button(&inputs, button);
@@ -92,19 +205,7 @@ static void glfw_mouse_button_callback(GLFWwindow *window, int button, int actio
 
         glm::vec3 far_plane_intersection = compute_ray_far_plane_intersection(camera, origin, dir);
 
-        auto entity = registry.create();
-
-        Mesh &mesh = registry.emplace<Mesh>(entity);
-        MeshData mesh_data = generate_line_mesh_data(origin, far_plane_intersection);
-        mesh.mesh_buffers_handle = request_mesh_buffers(&mesh_buffers_registry, &task_system, &vk_context, std::move(mesh_data));
-
-        Transform &transform = registry.emplace<Transform>(entity);
-        transform.position = glm::vec3(0.0f, 0.0f, 0.0f);
-        transform.orientation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-        transform.scale = glm::vec3(1.0f, 1.0f, 1.0f);
-
-        auto &material = registry.emplace<Material>(entity);
-        material.color = glm::vec3(1.0f, 1.0f, 1.0f);
+        spawn(&coroutine_scheduler, create_ray_line_entity(origin, far_plane_intersection));
 
         {
             // 创建一个三角形（三个顶点，逆时针顺序）
@@ -152,6 +253,7 @@ static void create_descriptor_pools(VkContext *context) {
 
     VkDescriptorPoolSize descriptor_pool_sizes[] = {
         {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2}, // camera buffer array (2 cameras)
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}, // instance buffer
         {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1},
     };
 
@@ -176,67 +278,252 @@ static void wait_for_frame(VkContext *context, uint32_t frame_index) {
     assert(result == VK_SUCCESS);
 }
 
-struct Renderable {
+// 一个待绘制的实体，按排序键的顺序写入instance buffer
+struct DrawItem {
     MeshBuffersHandle mesh_buffers_handle;
-    glm::mat4 model_matrix;
-    glm::vec3 color;
+    PipelineKey pipeline_key; // 请求的状态，录制时按它设置动态状态
+    PipelineKey compiled_pipeline_key; // 实际绑定的pipeline，见get_compiled_pipeline_key
+    InstanceData instance_data;
 };
 
-static void render_pipeline_renderables(VkCommandBuffer command_buffer, VkContext *vk_context, MeshBuffersRegistry *mesh_buffers_registry, VkDescriptorSet descriptor_set, const PipelineKey &pipeline_key, const std::vector<Renderable> &renderables, uint32_t camera_index, uint32_t width, uint32_t height, VkCullModeFlags cull_mode) {
-    VkPipeline pipeline = get_pipeline(vk_context, pipeline_key);
+// 同一pipeline下同一mesh的一组实例，实例数据在本帧instance buffer的[first_instance, first_instance + instance_count)
+struct InstanceBatch {
+    MeshBuffersHandle mesh_buffers_handle;
+    PipelineKey pipeline_key; // 请求的状态，同一PipelineDraw中的批次可能不同
+    uint32_t first_instance;
+    uint32_t instance_count;
+};
+
+// 排序后同一队列、同一编译后pipeline的一段连续绘制：CPU录制的批次为[first_batch, first_batch + batch_count)，
+// GPU驱动模式下有索引的SCENE mesh按请求的状态和arena放进indirect_buckets[first_indirect_bucket, first_indirect_bucket + indirect_bucket_count)
+struct PipelineDraw {
+    RenderQueueType queue_type;
+    PipelineKey pipeline_key; // 编译后的key
+    uint32_t first_batch;
+    uint32_t batch_count;
+    uint32_t first_indirect_bucket;
+    uint32_t indirect_bucket_count;
+};
+
+// pipeline只绑定一次，请求的状态变化时只重新设置动态状态。indirect_bucket_count非0时，
+// 在CPU录制的批次之后每个桶再用一次间接绘制画完GPU剔除后该阶段的物体。
+// pipeline还在编译时用相近的pipeline代替，返回false；连代替的都没有就跳过这些绘制
+static bool render_pipeline_batches(VkCommandBuffer command_buffer, VkContext *vk_context, MeshBuffersRegistry *mesh_buffers_registry, VkDescriptorSet descriptor_set, const PipelineKey &pipeline_key, const InstanceBatch *batches, uint32_t batch_count, const IndirectDrawBucket *indirect_buckets, uint32_t indirect_bucket_count, IndirectDrawPhase indirect_phase, uint32_t frame_index, uint32_t width, uint32_t height, VkCullModeFlags cull_mode) {
+    bool fallback = false;
+    VkPipeline pipeline = get_pipeline(&pipeline_manager, pipeline_key, &fallback);
+    if (pipeline == VK_NULL_HANDLE) {
+        return false;
+    }
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
     vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_context->pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
     set_viewport(command_buffer, 0, 0, width, height);
     set_scissor(command_buffer, 0, 0, width, height);
-    apply_pipeline_dynamic_states(vk_context, command_buffer, pipeline_key, cull_mode);
-
-    VkDeviceSize offsets[] = {0};
-    for (const auto &renderable: renderables) {
-        MeshBuffers &mesh_buffers = mesh_buffers_registry->entries[renderable.mesh_buffers_handle].mesh_buffers;
-        InstanceConstants instance = {};
-        instance.model = renderable.model_matrix;
-        instance.color = renderable.color;
-        instance.camera_index = camera_index;
-
-        vkCmdPushConstants(command_buffer, vk_context->pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(InstanceConstants), &instance);
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &mesh_buffers.vertex_buffer, offsets);
 
+    // 批次按排序键的顺序，请求的状态和arena都成段出现，变化时才重新设置
+    const PipelineKey *dynamic_state_key = nullptr;
+    uint32_t geometry_arena_index = UINT32_MAX;
+    for (uint32_t i = 0; i < batch_count; ++i) {
+        const InstanceBatch &batch = batches[i];
+        if (dynamic_state_key == nullptr || !(*dynamic_state_key == batch.pipeline_key)) {
+            dynamic_state_key = &batch.pipeline_key;
+            apply_pipeline_dynamic_states(vk_context, command_buffer, batch.pipeline_key, cull_mode);
+        }
+        const MeshBuffers &mesh_buffers = get_mesh_buffers(mesh_buffers_registry, batch.mesh_buffers_handle);
+        if (mesh_buffers.geometry_arena_index != geometry_arena_index) {
+            geometry_arena_index = mesh_buffers.geometry_arena_index;
+            bind_geometry_arena(mesh_buffers_registry, geometry_arena_index, command_buffer);
+        }
         if (mesh_buffers.index_count > 0) {
-            vkCmdBindIndexBuffer(command_buffer, mesh_buffers.index_buffer, 0, mesh_buffers.index_type);
-            vkCmdDrawIndexed(command_buffer, mesh_buffers.index_count, 1, 0, 0, 0);
+            vkCmdDrawIndexed(command_buffer, mesh_buffers.index_count, batch.instance_count, mesh_buffers.first_index,
+                             static_cast<int32_t>(mesh_buffers.first_vertex), batch.first_instance);
         } else {
-            vkCmdDraw(command_buffer, mesh_buffers.vertex_count, 1, 0, 0);
+            vkCmdDraw(command_buffer, mesh_buffers.vertex_count, batch.instance_count, mesh_buffers.first_vertex,
+                      batch.first_instance);
         }
     }
+    for (uint32_t i = 0; i < indirect_bucket_count; ++i) {
+        const IndirectDrawBucket &indirect_bucket = indirect_buckets[i];
+        if (dynamic_state_key == nullptr || !(*dynamic_state_key == indirect_bucket.pipeline_key)) {
+            dynamic_state_key = &indirect_bucket.pipeline_key;
+            apply_pipeline_dynamic_states(vk_context, command_buffer, indirect_bucket.pipeline_key, cull_mode);
+        }
+        if (indirect_bucket.geometry_arena_index != geometry_arena_index) {
+            geometry_arena_index = indirect_bucket.geometry_arena_index;
+            bind_geometry_arena(mesh_buffers_registry, geometry_arena_index, command_buffer);
+        }
+        draw_indirect_bucket(&indirect_draw_context, vk_context, command_buffer, frame_index, indirect_bucket, indirect_phase);
+    }
+    return !fallback;
+}
+
+// 一个secondary command buffer的录制任务：一个PipelineDraw中的一段批次，间接绘制的桶放在该PipelineDraw的最后一段
+struct RecordJob {
+    VkRenderPass render_pass;
+    VkFramebuffer framebuffer;
+    VkDescriptorSet descriptor_set;
+    PipelineKey pipeline_key;
+    const InstanceBatch *batches;
+    uint32_t batch_count;
+    const IndirectDrawBucket *indirect_buckets;
+    uint32_t indirect_bucket_count;
+    IndirectDrawPhase indirect_phase;
+    uint32_t frame_index;
+    uint32_t width;
+    uint32_t height;
+    VkCullModeFlags cull_mode;
+    VkCommandBuffer command_buffer; // 录制结果
+    TaskHandle task_handle;
+};
+
+// 在worker线程上录制，每个worker从自己的command pool分配，不需要加锁
+static void record_job(RecordJob *job) {
+    uint32_t worker_index = get_current_worker_index(&task_system);
+    job->command_buffer = begin_secondary_command_buffer(&secondary_command_buffers, &vk_context, job->frame_index,
+                                                         worker_index, job->render_pass, job->framebuffer);
+    render_pipeline_batches(job->command_buffer, &vk_context, &mesh_buffers_registry, job->descriptor_set, job->pipeline_key, job->batches, job->batch_count, job->indirect_buckets, job->indirect_bucket_count, job->indirect_phase, job->frame_index, job->width, job->height, job->cull_mode);
+    end_command_buffer(&vk_context, job->command_buffer);
 }
 
+// 圆环的中心和法向量取自gizmo的世界矩阵缓存（平移列和y轴列）
 static bool is_gizmo_y_ring_hovered(const glm::vec3 &origin, const glm::vec3 &dir) {
+    const WorldMatrix *world_matrix = registry.try_get<WorldMatrix>(gizmo_y_ring_entity);
+    if (world_matrix == nullptr) {
+        return false;
+    }
+    glm::vec3 center = glm::vec3(world_matrix->matrix[3]);
+    glm::vec3 axis = glm::normalize(glm::vec3(world_matrix->matrix[1]));
     float margin = 0.1f;
-    std::optional<float> distance = ray_ring_intersection_distance(Ray{origin, dir}, Ring{glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1.0f});
+    std::optional<float> distance = ray_ring_intersection_distance(Ray{origin, dir}, Ring{center, axis, 1.0f});
     if (distance && glm::abs(*distance - 1.0f) < margin) {
         return true;
     }
-    std::optional<RayCylinderHit> hit = ray_cylinder_side_intersection(Ray{origin, dir}, Cylinder{glm::vec3(0.0f, -margin, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, 2 * margin});
+    std::optional<RayCylinderHit> hit = ray_cylinder_side_intersection(Ray{origin, dir}, Cylinder{center - axis * margin, axis, 1.0f, 2 * margin});
     return hit ? true : false;
 }
 
-static glm::mat4 compute_transform_matrix(const Transform &transform) {
-    glm::mat4 translation = glm::translate(glm::mat4(1.0f), transform.position);
-    glm::mat4 rotation = glm::mat4_cast(transform.orientation);
-    glm::mat4 scale = glm::scale(glm::mat4(1.0f), transform.scale);
-    return translation * rotation * scale;
+static PipelineKey get_pipeline_key(VkPrimitiveTopology primitive_topology, VkPolygonMode polygon_mode, bool depth_test_enabled, uint32_t shader_hash) {
+    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_LIST || primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
+        polygon_mode = VK_POLYGON_MODE_LINE; // polygon mode must be line for line list or line strip topology
+    }
+    return PipelineKey(primitive_topology, polygon_mode, depth_test_enabled, shader_hash);
 }
 
-static glm::mat4 compute_transform_matrix(const Transform2D &transform) {
-    return glm::translate(glm::mat4(1.0f), transform.position)
-           * glm::scale(glm::mat4(1.0f), glm::vec3(transform.scale, 1.0f));
+// Static实体的绘制数据，静态场景变化时在CPU上重建一次；不依赖相机，所以不做视锥剔除，只按pipeline和mesh排序
+struct StaticScene {
+    uint64_t generation; // 构建时的static_scene_generation
+    uint64_t version; // 每次重建递增，缓存据此判断是否需要重新录制
+    VkPolygonMode polygon_mode; // pipeline key依赖polygon_mode
+    bool complete; // 构建时有mesh还没上传完成则为false，下一帧重建
+    std::vector<DrawItem> draw_items;
+    std::vector<DrawKey> draw_keys;
+    std::vector<DrawKey> draw_key_scratch;
+    std::vector<InstanceData> instances; // 按排序键的顺序，录制时拷贝到该帧instance buffer的开头
+    std::vector<InstanceBatch> batches;
+    std::vector<PipelineDraw> pipeline_draws;
+    std::vector<MeshBuffersHandle> mesh_buffers_handles; // 用到的mesh，每帧加入frame context保证GPU使用期间不被释放
+};
+
+// 每个frame index一个可重复提交的secondary command buffer（descriptor set和instance buffer都是每帧一份），
+// 只在静态场景重建、instance buffer重建或cull_mode变化时重新录制
+struct StaticDrawCache {
+    VkCommandBuffer command_buffer;
+    bool valid;
+    uint64_t version; // 录制时的StaticScene::version
+    VkCullModeFlags cull_mode;
+};
+
+StaticScene static_scene = {};
+StaticDrawCache static_draw_caches[MAX_FRAMES_IN_FLIGHT] = {};
+
+static void mark_static_scene_dirty(entt::registry &registry, entt::entity entity) {
+    if (registry.all_of<Static>(entity)) {
+        ++static_scene_generation;
+    }
 }
 
-static PipelineKey get_pipeline_key(VkPrimitiveTopology primitive_topology, VkPolygonMode polygon_mode, bool depth_test_enabled) {
-    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_LIST || primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
-        polygon_mode = VK_POLYGON_MODE_LINE; // polygon mode must be line for line list or line strip topology
+static void build_static_scene(StaticScene *static_scene, FrameContext *frame_context) {
+    static_scene->generation = static_scene_generation;
+    ++static_scene->version;
+    static_scene->polygon_mode = polygon_mode;
+    static_scene->complete = true;
+
+    static_scene->draw_items.clear();
+    static_scene->draw_keys.clear();
+    for (auto view = registry.view<Mesh, Transform, WorldMatrix, Material, Static>(); auto entity: view) {
+        Mesh &mesh = view.get<Mesh>(entity);
+        WorldMatrix &world_matrix = view.get<WorldMatrix>(entity);
+        Material &material = view.get<Material>(entity);
+
+        if (mesh.mesh_buffers_handle.index == UINT32_MAX) {
+            continue; // 上传失败，永远不会画出来，不必等它
+        }
+        if (!add_ref(frame_context, &mesh_buffers_registry, mesh.mesh_buffers_handle)) {
+            static_scene->complete = false;
+            continue;
+        }
+        const MeshBuffers &mesh_buffers = get_mesh_buffers(&mesh_buffers_registry, mesh.mesh_buffers_handle);
+        PipelineKey pipeline_key = get_pipeline_key(mesh_buffers.primitive_topology, polygon_mode, true, scene_shader_hash);
+        PipelineKey compiled_pipeline_key = get_compiled_pipeline_key(&vk_context, pipeline_key);
+
+        static_scene->draw_keys.push_back({make_scene_draw_key(compiled_pipeline_key, pipeline_key, mesh_buffers.geometry_arena_index, mesh.mesh_buffers_handle.index, 0.0f), static_cast<uint32_t>(static_scene->draw_items.size())});
+        static_scene->draw_items.push_back({
+            .mesh_buffers_handle = mesh.mesh_buffers_handle,
+            .pipeline_key = pipeline_key,
+            .compiled_pipeline_key = compiled_pipeline_key,
+            .instance_data = {
+                .model = world_matrix.matrix,
+                .color = material.color,
+                .camera_index = 0,
+            },
+        });
     }
-    return PipelineKey(primitive_topology, polygon_mode, depth_test_enabled);
+    radix_sort_draw_keys(&static_scene->draw_keys, &static_scene->draw_key_scratch);
+
+    // 排序后同一mesh连续，每个mesh只有一个批次
+    static_scene->instances.clear();
+    static_scene->batches.clear();
+    static_scene->pipeline_draws.clear();
+    static_scene->mesh_buffers_handles.clear();
+    for (uint32_t i = 0; i < static_scene->draw_keys.size(); ++i) {
+        const DrawItem &draw_item = static_scene->draw_items[static_scene->draw_keys[i].item_index];
+        static_scene->instances.push_back(draw_item.instance_data);
+
+        if (static_scene->pipeline_draws.empty() || !(static_scene->pipeline_draws.back().pipeline_key == draw_item.compiled_pipeline_key)) {
+            static_scene->pipeline_draws.push_back({
+                .queue_type = RENDER_QUEUE_TYPE_SCENE,
+                .pipeline_key = draw_item.compiled_pipeline_key,
+                .first_batch = static_cast<uint32_t>(static_scene->batches.size()),
+                .batch_count = 0,
+                .first_indirect_bucket = 0,
+                .indirect_bucket_count = 0,
+            });
+        }
+        PipelineDraw &pipeline_draw = static_scene->pipeline_draws.back();
+        if (pipeline_draw.batch_count > 0 && static_scene->batches.back().mesh_buffers_handle == draw_item.mesh_buffers_handle) {
+            ++static_scene->batches.back().instance_count;
+        } else {
+            static_scene->batches.push_back({draw_item.mesh_buffers_handle, draw_item.pipeline_key, i, 1});
+            ++pipeline_draw.batch_count;
+            static_scene->mesh_buffers_handles.push_back(draw_item.mesh_buffers_handle);
+        }
+    }
+}
+
+// 录制到context的command pool分配的secondary command buffer中，只在主线程上调用；该帧之前的提交已经完成
+static void record_static_draw_cache(StaticDrawCache *static_draw_cache, uint32_t frame_index, uint32_t width, uint32_t height) {
+    if (static_draw_cache->command_buffer == VK_NULL_HANDLE) {
+        static_draw_cache->command_buffer = allocate_reusable_secondary_command_buffer(&vk_context);
+    }
+    // 不指定framebuffer，可以在任一swapchain image的render pass或兼容的early render pass中执行
+    begin_reusable_secondary_command_buffer(&vk_context, static_draw_cache->command_buffer, vk_context.render_pass);
+    bool complete = true; // 用了代替的pipeline时下一帧重新录制
+    for (const PipelineDraw &pipeline_draw : static_scene.pipeline_draws) {
+        complete &= render_pipeline_batches(static_draw_cache->command_buffer, &vk_context, &mesh_buffers_registry, descriptor_sets[frame_index], pipeline_draw.pipeline_key, static_scene.batches.data() + pipeline_draw.first_batch, pipeline_draw.batch_count, nullptr, 0, INDIRECT_DRAW_PHASE_EARLY, frame_index, width, height, cull_mode);
+    }
+    end_command_buffer(&vk_context, static_draw_cache->command_buffer);
+    static_draw_cache->valid = complete;
+    static_draw_cache->version = static_scene.version;
+    static_draw_cache->cull_mode = cull_mode;
 }
 
 static void update_camera(float delta_time) {
@@ -296,7 +583,21 @@ int main() {
 
     init_inputs(&inputs);
     start(&task_system);
+    coroutine_scheduler.task_system = &task_system;
+    coroutine_scheduler.main_thread_budget_ms = 2.0;
     init_vk(&vk_context, window, width, height);
+    // 所有合法状态组合在worker上并行编译，和下面的初始化重叠，进入主循环之前等待
+    init_pipeline_manager(&pipeline_manager, &vk_context, &task_system);
+    scene_shader_hash = register_shader_program(&pipeline_manager, "triangle.vert.spv", "triangle.frag.spv", {.camera_index = 0});
+    ui_shader_hash = register_shader_program(&pipeline_manager, "triangle.vert.spv", "triangle.frag.spv", {.camera_index = 1});
+    prewarm_pipelines(&pipeline_manager, scene_shader_hash);
+    prewarm_pipelines(&pipeline_manager, ui_shader_hash);
+    init_upload_queue(&vk_context, MAX_FRAMES_IN_FLIGHT);
+    init_mesh_buffers_registry(&mesh_buffers_registry, &vk_context);
+    init_indirect_draw(&indirect_draw_context, &vk_context, MAX_FRAMES_IN_FLIGHT);
+    init_depth_pyramid(&depth_pyramid, &vk_context, width, height, MAX_FRAMES_IN_FLIGHT);
+    init_secondary_command_buffers(&secondary_command_buffers, &vk_context, MAX_FRAMES_IN_FLIGHT,
+                                   static_cast<uint32_t>(task_system.workers.size()));
 
     register_event_handler(&events, EVENT_CODE_MOUSE_MOVE, [width, height](const EventData &event_data)-> bool {
         float x = event_data.f32[0];
@@ -355,27 +656,90 @@ int main() {
 
     CameraData camera_data[2] = {}; // [0] = 3D scene camera, [1] = UI camera
 
+    // 本帧的绘制列表，按排序键的顺序写入instance buffer并录制；以下数组跨帧复用，避免每帧重新分配
+    std::vector<DrawItem> draw_items;
+    std::vector<DrawKey> draw_keys;
+    std::vector<DrawKey> draw_key_scratch;
+    std::vector<InstanceBatch> instance_batches;
+    std::vector<PipelineDraw> pipeline_draws;
+    std::vector<IndirectDrawBucket> indirect_buckets;
+    std::vector<RecordJob> record_jobs;
+    std::vector<VkCommandBuffer> secondary_command_buffer_list;
+    BoundingSpheres scene_bounding_spheres = {}; // 与draw_items中的SCENE实体一一对应
+    std::vector<uint8_t> scene_visibilities;
+
     double last_frame_time = glfwGetTime();
 
     std::vector<VkBuffer> camera_buffers = {};
-    std::vector<VkDeviceMemory> camera_buffer_memories = {};
+    std::vector<GpuAllocation> camera_buffer_allocations = {};
     camera_buffers.resize(MAX_FRAMES_IN_FLIGHT);
-    camera_buffer_memories.resize(MAX_FRAMES_IN_FLIGHT);
+    camera_buffer_allocations.resize(MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        create_buffer_with_memory(&vk_context, sizeof(CameraData) * 2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  &camera_buffers[i], &camera_buffer_allocations[i]);
+    }
+
+    std::vector<VkBuffer> instance_buffers = {};
+    std::vector<GpuAllocation> instance_buffer_allocations = {};
+    std::vector<uint32_t> instance_buffer_capacities = {};
+    instance_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    instance_buffer_allocations.resize(MAX_FRAMES_IN_FLIGHT);
+    instance_buffer_capacities.resize(MAX_FRAMES_IN_FLIGHT, INITIAL_INSTANCE_CAPACITY);
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        create_buffer(&vk_context, sizeof(CameraData) * 2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &camera_buffers[i]);
+        create_buffer_with_memory(&vk_context, sizeof(InstanceData) * INITIAL_INSTANCE_CAPACITY,
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  &instance_buffers[i], &instance_buffer_allocations[i]);
+    }
+
+    // camera buffer和instance buffer在descriptor set中只在创建或重建时写入：更新已绑定的descriptor set会使录制过的command buffer失效
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        VkDescriptorBufferInfo descriptor_buffer_infos[2] = {};
+        descriptor_buffer_infos[0].buffer = camera_buffers[i];
+        descriptor_buffer_infos[0].offset = 0;
+        descriptor_buffer_infos[0].range = sizeof(CameraData);
+        descriptor_buffer_infos[1].buffer = camera_buffers[i];
+        descriptor_buffer_infos[1].offset = sizeof(CameraData);
+        descriptor_buffer_infos[1].range = sizeof(CameraData);
 
-        VkMemoryRequirements memory_requirements;
-        vkGetBufferMemoryRequirements(vk_context.device, camera_buffers[i], &memory_requirements);
-        uint32_t memory_type_index = UINT32_MAX;
-        get_memory_type_index(&vk_context, memory_requirements,
-                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                              &memory_type_index);
-        allocate_memory(&vk_context, memory_requirements.size, memory_type_index, &camera_buffer_memories[i]);
-        vkBindBufferMemory(vk_context.device, camera_buffers[i], camera_buffer_memories[i], 0);
+        VkDescriptorBufferInfo instance_descriptor_buffer_info = {};
+        instance_descriptor_buffer_info.buffer = instance_buffers[i];
+        instance_descriptor_buffer_info.offset = 0;
+        instance_descriptor_buffer_info.range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet write_descriptor_sets[2] = {};
+        write_descriptor_sets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptor_sets[0].dstSet = descriptor_sets[i];
+        write_descriptor_sets[0].dstBinding = 0;
+        write_descriptor_sets[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        write_descriptor_sets[0].descriptorCount = 2;
+        write_descriptor_sets[0].pBufferInfo = descriptor_buffer_infos;
+        write_descriptor_sets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptor_sets[1].dstSet = descriptor_sets[i];
+        write_descriptor_sets[1].dstBinding = 1;
+        write_descriptor_sets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write_descriptor_sets[1].descriptorCount = 1;
+        write_descriptor_sets[1].pBufferInfo = &instance_descriptor_buffer_info;
+
+        vkUpdateDescriptorSets(vk_context.device, std::size(write_descriptor_sets), write_descriptor_sets, 0, nullptr);
     }
 
     // registry.on_construct<Mesh>().connect<&MeshBuffers::create_mesh_buffers>();
     // registry.on_destroy<Mesh>().connect<&MeshBuffers::destroy_mesh_buffers>();
+    connect_transform_tracking(&registry);
+    registry.on_construct<Static>().connect<&mark_static_scene_dirty>();
+    registry.on_destroy<Static>().connect<&mark_static_scene_dirty>();
+    registry.on_construct<Mesh>().connect<&mark_static_scene_dirty>();
+    registry.on_update<Mesh>().connect<&mark_static_scene_dirty>();
+    registry.on_destroy<Mesh>().connect<&mark_static_scene_dirty>();
+    registry.on_construct<Transform>().connect<&mark_static_scene_dirty>();
+    registry.on_update<Transform>().connect<&mark_static_scene_dirty>();
+    registry.on_destroy<Transform>().connect<&mark_static_scene_dirty>();
+    registry.on_construct<WorldMatrix>().connect<&mark_static_scene_dirty>();
+    registry.on_construct<Material>().connect<&mark_static_scene_dirty>();
+    registry.on_update<Material>().connect<&mark_static_scene_dirty>();
+    registry.on_destroy<Material>().connect<&mark_static_scene_dirty>();
     {
         auto entity = registry.create();
 
@@ -390,6 +754,8 @@ int main() {
 
         auto &material = registry.emplace<Material>(entity);
         material.color = glm::vec3(1.0f, 1.0f, 1.0f);
+
+        registry.emplace<Static>(entity);
     }
     {
         auto entity = registry.create();
@@ -405,6 +771,18 @@ int main() {
 
         auto &material = registry.emplace<Material>(entity);
         material.color = glm::vec3(0.7f, 0.65f, 0.6f); // 浅棕色地面颜色
+
+        registry.emplace<Static>(entity);
+    }
+    {
+        auto entity = registry.create();
+
+        auto &[position, orientation, scale] = registry.emplace<Transform>(entity);
+        position = glm::vec3(0.0f, 0.0f, 0.0f);
+        orientation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        scale = glm::vec3(1.0f, 1.0f, 1.0f);
+
+        gizmo_entity = entity;
     }
     {
         auto entity = registry.create();
@@ -421,6 +799,7 @@ int main() {
         auto &material = registry.emplace<Material>(entity);
         material.color = glm::vec3(1.0f, 1.0f, 1.0f);
 
+        set_parent(&registry, entity, gizmo_entity); // 上面是相对gizmo根节点的局部变换
         gizmo_y_ring_entity = entity;
     }
     {
@@ -440,6 +819,7 @@ int main() {
         material.color = glm::vec3(1.0f, 1.0f, 1.0f);
     }
 
+    wait_for_pipelines(&pipeline_manager);
     while (!glfwWindowShouldClose(window)) {
         double current_time = glfwGetTime();
         float delta_time = (float) (current_time - last_frame_time);
@@ -448,9 +828,19 @@ int main() {
         begin_inputs_frame(&inputs);
         glfwPollEvents();
 
+        run_main_thread_coroutines(&coroutine_scheduler);
+
         update_camera(delta_time);
+        // 只重新计算本帧Transform变化了的实体及其子树；Static实体的世界矩阵变了，静态场景就要重建
+        if (update_world_matrices(&registry, &task_system, &world_matrix_update)) {
+            ++static_scene_generation;
+        }
 
         wait_for_frame(&vk_context, frame_index);
+        complete_uploads(&vk_context, frame_index); // 发布拷贝已完成的mesh，销毁延迟释放的buffer
+        indirect_draw_statistics = read_indirect_draw_statistics(&indirect_draw_context, frame_index);
+        depth_pyramid_build_time_ms = read_depth_pyramid_build_time(&depth_pyramid, &vk_context, frame_index);
+        reset_secondary_command_buffers(&secondary_command_buffers, &vk_context, frame_index);
 
         on_gpu_complete(&frame_contexts[frame_index], &mesh_buffers_registry, &task_system, &vk_context);
 
@@ -484,151 +874,312 @@ int main() {
         camera_data[1].projection = clip * ui_projection;
 
         // Update unified camera buffer
-        void *ptr = nullptr;
-        vkMapMemory(vk_context.device, camera_buffer_memories[frame_index], 0, sizeof(CameraData) * 2, 0, &ptr);
-        memcpy(ptr, camera_data, sizeof(CameraData) * 2);
-        vkUnmapMemory(vk_context.device, camera_buffer_memories[frame_index]);
-
-        // Update descriptor set with camera array
-        VkDescriptorBufferInfo descriptor_buffer_infos[2] = {};
-        descriptor_buffer_infos[0].buffer = camera_buffers[frame_index];
-        descriptor_buffer_infos[0].offset = 0;
-        descriptor_buffer_infos[0].range = sizeof(CameraData);
-        descriptor_buffer_infos[1].buffer = camera_buffers[frame_index];
-        descriptor_buffer_infos[1].offset = sizeof(CameraData);
-        descriptor_buffer_infos[1].range = sizeof(CameraData);
-
-        VkWriteDescriptorSet write_descriptor_set = {};
-        write_descriptor_set.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        write_descriptor_set.dstSet = descriptor_sets[frame_index];
-        write_descriptor_set.dstBinding = 0;
-        write_descriptor_set.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        write_descriptor_set.descriptorCount = 2;
-        write_descriptor_set.pBufferInfo = descriptor_buffer_infos;
+        memcpy(camera_buffer_allocations[frame_index].mapped_data, camera_data, sizeof(CameraData) * 2);
 
-        vkUpdateDescriptorSets(vk_context.device, 1, &write_descriptor_set, 0, nullptr);
-
-        // 按渲染队列和Pipeline分组收集renderables
-        enum RenderQueueType {
-            RENDER_QUEUE_TYPE_SCENE,
-            RENDER_QUEUE_TYPE_UI,
-        };
-        std::unordered_map<RenderQueueType, std::unordered_map<PipelineKey, std::vector<Renderable>, PipelineKeyHash>> render_queue_pipeline_renderables;
-
-        // 收集Scene实体（Mesh + Transform + Material）
-        for (auto view = registry.view<Mesh, Transform, Material>(); auto entity: view) {
-            Mesh &mesh = view.get<Mesh>(entity);
-            Transform &transform = view.get<Transform>(entity);
-            Material &material = view.get<Material>(entity);
-
-            std::lock_guard lock(mesh_buffers_registry.mutex);
-            MeshBuffersEntry &entry = mesh_buffers_registry.entries[mesh.mesh_buffers_handle];
-            if (!entry.uploaded) { continue; }
+        // 静态缓存模式：Static实体不参与每帧的收集、剔除和排序，实例数据在instance buffer的[0, static_instance_count)
+        uint32_t static_instance_count = 0;
+        if (static_draw_cache_enabled) {
+            if (static_scene.generation != static_scene_generation || static_scene.polygon_mode != polygon_mode || !static_scene.complete) {
+                build_static_scene(&static_scene, &frame_contexts[frame_index]);
+            } else {
+                for (MeshBuffersHandle mesh_buffers_handle : static_scene.mesh_buffers_handles) {
+                    bool uploaded = add_ref(&frame_contexts[frame_index], &mesh_buffers_registry, mesh_buffers_handle);
+                    assert(uploaded);
+                }
+            }
+            static_instance_count = static_cast<uint32_t>(static_scene.instances.size());
+        }
 
-            add_ref(&frame_contexts[frame_index], mesh.mesh_buffers_handle);
-            ++entry.ref_count;
+        // 收集Scene实体（Mesh + Transform + Material），读取世界矩阵缓存，先把世界空间包围球按SoA打包
+        draw_items.clear();
+        draw_keys.clear();
+        clear_bounding_spheres(&scene_bounding_spheres);
+        auto collect_scene_entity = [&](entt::entity entity, Mesh &mesh, Transform &transform, WorldMatrix &world_matrix, Material &material) {
+            if (!add_ref(&frame_contexts[frame_index], &mesh_buffers_registry, mesh.mesh_buffers_handle)) { return; }
+            const MeshBuffers &mesh_buffers = get_mesh_buffers(&mesh_buffers_registry, mesh.mesh_buffers_handle);
 
             // Scene使用深度测试
-            PipelineKey pipeline_key = get_pipeline_key(entry.mesh_buffers.primitive_topology, polygon_mode, true);
+            PipelineKey pipeline_key = get_pipeline_key(mesh_buffers.primitive_topology, polygon_mode, true, scene_shader_hash);
+            const glm::mat4 &model = world_matrix.matrix;
 
-            render_queue_pipeline_renderables[RENDER_QUEUE_TYPE_SCENE][pipeline_key].push_back({
+            add_bounding_sphere(&scene_bounding_spheres, transform_bounding_sphere(model, mesh_buffers.bounding_sphere));
+            draw_items.push_back({
                 .mesh_buffers_handle = mesh.mesh_buffers_handle,
-                .model_matrix = compute_transform_matrix(transform),
-                .color = material.color,
+                .pipeline_key = pipeline_key,
+                .compiled_pipeline_key = get_compiled_pipeline_key(&vk_context, pipeline_key),
+                .instance_data = {
+                    .model = model,
+                    .color = material.color,
+                    .camera_index = 0,
+                },
             });
+        };
+        if (static_draw_cache_enabled) {
+            registry.view<Mesh, Transform, WorldMatrix, Material>(entt::exclude<Static>).each(collect_scene_entity);
+        } else {
+            registry.view<Mesh, Transform, WorldMatrix, Material>().each(collect_scene_entity);
+        }
+
+        // 视锥剔除，只有可见的实体生成排序键；同一mesh内按到相机的距离由近到远
+        glm::vec4 frustum_planes[6];
+        extract_frustum_planes(camera_data[0].projection * camera_data[0].view, frustum_planes);
+        cull_bounding_spheres(&scene_bounding_spheres, frustum_planes, &scene_visibilities, &culling_statistics);
+        uint32_t indirect_object_count = 0;
+        for (uint32_t i = 0; i < draw_items.size(); ++i) {
+            if (!scene_visibilities[i]) { continue; }
+            const DrawItem &draw_item = draw_items[i];
+            glm::vec3 offset = glm::vec3(scene_bounding_spheres.center_x[i], scene_bounding_spheres.center_y[i],
+                                         scene_bounding_spheres.center_z[i]) - camera.position;
+            const MeshBuffers &mesh_buffers = get_mesh_buffers(&mesh_buffers_registry, draw_item.mesh_buffers_handle);
+            draw_keys.push_back({make_scene_draw_key(draw_item.compiled_pipeline_key, draw_item.pipeline_key, mesh_buffers.geometry_arena_index, draw_item.mesh_buffers_handle.index, glm::dot(offset, offset)), i});
+            if (gpu_driven_enabled && mesh_buffers.index_count > 0) {
+                ++indirect_object_count;
+            }
         }
 
-        // 收集UI实体（Mesh + Transform2D + Material）
-        for (auto view = registry.view<Mesh, Transform2D, Material>(); auto entity: view) {
+        // 收集UI实体（Mesh + Transform2D + Material），按z值排序
+        for (auto view = registry.view<Mesh, Transform2D, WorldMatrix, Material>(); auto entity: view) {
             Mesh &mesh = view.get<Mesh>(entity);
-            Transform2D &transform = view.get<Transform2D>(entity);
+            WorldMatrix &world_matrix = view.get<WorldMatrix>(entity);
             Material &material = view.get<Material>(entity);
 
-            std::lock_guard lock(mesh_buffers_registry.mutex);
-            MeshBuffersEntry &entry = mesh_buffers_registry.entries[mesh.mesh_buffers_handle];
-            if (!entry.uploaded) { continue; }
-
-            add_ref(&frame_contexts[frame_index], mesh.mesh_buffers_handle);
-            ++entry.ref_count;
+            if (!add_ref(&frame_contexts[frame_index], &mesh_buffers_registry, mesh.mesh_buffers_handle)) { continue; }
+            const MeshBuffers &mesh_buffers = get_mesh_buffers(&mesh_buffers_registry, mesh.mesh_buffers_handle);
 
             // UI禁用深度测试
-            PipelineKey pipeline_key = get_pipeline_key(entry.mesh_buffers.primitive_topology, polygon_mode, false);
+            PipelineKey pipeline_key = get_pipeline_key(mesh_buffers.primitive_topology, polygon_mode, false, ui_shader_hash);
+            PipelineKey compiled_pipeline_key = get_compiled_pipeline_key(&vk_context, pipeline_key);
+            const glm::mat4 &model = world_matrix.matrix;
 
-            render_queue_pipeline_renderables[RENDER_QUEUE_TYPE_UI][pipeline_key].push_back({
+            // model[3]是平移向量，[3][2]是z分量
+            draw_keys.push_back({make_ui_draw_key(model[3][2], compiled_pipeline_key, mesh.mesh_buffers_handle.index), static_cast<uint32_t>(draw_items.size())});
+            draw_items.push_back({
                 .mesh_buffers_handle = mesh.mesh_buffers_handle,
-                .model_matrix = compute_transform_matrix(transform),
-                .color = material.color,
+                .pipeline_key = pipeline_key,
+                .compiled_pipeline_key = compiled_pipeline_key,
+                .instance_data = {
+                    .model = model,
+                    .color = material.color,
+                    .camera_index = 1,
+                },
             });
         }
 
-        // UI队列按z值排序（在收集阶段完成，避免渲染时重复排序）
-        auto &ui_pipeline_renderables = render_queue_pipeline_renderables[RENDER_QUEUE_TYPE_UI];
-        for (auto &[pipeline_key, renderables] : ui_pipeline_renderables) {
-            // 按z值排序：从model_matrix的平移向量中提取z值，z值大的先渲染
-            std::sort(renderables.begin(), renderables.end(),
-                [](const Renderable &a, const Renderable &b) {
-                    // model_matrix[3]是平移向量，[3][2]是z分量
-                    float z_a = a.model_matrix[3][2];
-                    float z_b = b.model_matrix[3][2];
-                    return z_a > z_b; // z值大的先渲染（显示在后面）
-                });
+        radix_sort_draw_keys(&draw_keys, &draw_key_scratch);
+        uint32_t instance_count = static_cast<uint32_t>(draw_keys.size());
+
+        // 本帧的instance buffer不够时翻倍重建，这一帧的fence已经等到，旧buffer不再被GPU使用；
+        // 重建后更新descriptor set，绑定了它的静态缓存要重新录制
+        uint32_t total_instance_count = static_instance_count + instance_count;
+        if (total_instance_count > instance_buffer_capacities[frame_index]) {
+            destroy_buffer_with_memory(&vk_context, instance_buffers[frame_index], instance_buffer_allocations[frame_index]);
+            while (instance_buffer_capacities[frame_index] < total_instance_count) {
+                instance_buffer_capacities[frame_index] *= 2;
+            }
+            create_buffer_with_memory(&vk_context, sizeof(InstanceData) * instance_buffer_capacities[frame_index],
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                      &instance_buffers[frame_index], &instance_buffer_allocations[frame_index]);
+
+            VkDescriptorBufferInfo instance_descriptor_buffer_info = {};
+            instance_descriptor_buffer_info.buffer = instance_buffers[frame_index];
+            instance_descriptor_buffer_info.offset = 0;
+            instance_descriptor_buffer_info.range = VK_WHOLE_SIZE;
+
+            VkWriteDescriptorSet instance_write_descriptor_set = {};
+            instance_write_descriptor_set.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            instance_write_descriptor_set.dstSet = descriptor_sets[frame_index];
+            instance_write_descriptor_set.dstBinding = 1;
+            instance_write_descriptor_set.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            instance_write_descriptor_set.descriptorCount = 1;
+            instance_write_descriptor_set.pBufferInfo = &instance_descriptor_buffer_info;
+
+            vkUpdateDescriptorSets(vk_context.device, 1, &instance_write_descriptor_set, 0, nullptr);
+            static_draw_caches[frame_index].valid = false;
         }
 
-        // 定义渲染队列顺序（SCENE -> UI）
-        const std::vector<RenderQueueType> render_queue_order = {
-            RENDER_QUEUE_TYPE_SCENE,
-            RENDER_QUEUE_TYPE_UI,
-        };
+        StaticDrawCache &static_draw_cache = static_draw_caches[frame_index];
+        if (static_draw_cache_enabled && (!static_draw_cache.valid || static_draw_cache.version != static_scene.version ||
+                                          static_draw_cache.cull_mode != cull_mode)) {
+            memcpy(instance_buffer_allocations[frame_index].mapped_data, static_scene.instances.data(),
+                   sizeof(InstanceData) * static_instance_count);
+            record_static_draw_cache(&static_draw_cache, frame_index, width, height);
+        }
 
-        // 定义SCENE队列的Pipeline渲染顺序（减少状态切换）
-        const std::vector<PipelineKey> scene_pipeline_render_order = {
-            PipelineKey(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_FILL, true),
-            PipelineKey(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_LINE, true),
-            PipelineKey(VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, true),
-            PipelineKey(VK_PRIMITIVE_TOPOLOGY_LINE_LIST, VK_POLYGON_MODE_LINE, true),
+        IndirectObject *indirect_objects = gpu_driven_enabled ? map_indirect_objects(&indirect_draw_context, &vk_context, frame_index, indirect_object_count) : nullptr;
+
+        // 按排序后的顺序写入instance buffer（静态实例之后），队列或编译后的pipeline变化时开始新的一段，相邻的同一mesh合并为一个批次；
+        // GPU驱动模式下SCENE中有索引的mesh交给compute剔除、间接绘制。一次间接绘制只能有一组动态状态和一个arena，
+        // 所以段内按请求的状态和arena分桶（SCENE按这个顺序排序，桶在段内成片出现），桶在command buffer中连续
+        InstanceData *instances = static_cast<InstanceData *>(instance_buffer_allocations[frame_index].mapped_data);
+        instance_batches.clear();
+        pipeline_draws.clear();
+        indirect_buckets.clear();
+        uint32_t indirect_command_count = 0;
+        for (uint32_t i = 0; i < instance_count; ++i) {
+            RenderQueueType queue_type = get_draw_key_queue(draw_keys[i].key);
+            const DrawItem &draw_item = draw_items[draw_keys[i].item_index];
+            uint32_t instance_index = static_instance_count + i;
+            instances[instance_index] = draw_item.instance_data;
+
+            if (pipeline_draws.empty() || pipeline_draws.back().queue_type != queue_type || !(pipeline_draws.back().pipeline_key == draw_item.compiled_pipeline_key)) {
+                pipeline_draws.push_back({
+                    .queue_type = queue_type,
+                    .pipeline_key = draw_item.compiled_pipeline_key,
+                    .first_batch = static_cast<uint32_t>(instance_batches.size()),
+                    .batch_count = 0,
+                    .first_indirect_bucket = static_cast<uint32_t>(indirect_buckets.size()),
+                    .indirect_bucket_count = 0,
+                });
+            }
+            PipelineDraw &pipeline_draw = pipeline_draws.back();
+
+            const MeshBuffers &mesh_buffers = get_mesh_buffers(&mesh_buffers_registry, draw_item.mesh_buffers_handle);
+            if (gpu_driven_enabled && queue_type == RENDER_QUEUE_TYPE_SCENE && mesh_buffers.index_count > 0) {
+                if (pipeline_draw.indirect_bucket_count == 0 || !(indirect_buckets.back().pipeline_key == draw_item.pipeline_key) ||
+                    indirect_buckets.back().geometry_arena_index != mesh_buffers.geometry_arena_index) {
+                    assert(indirect_buckets.size() < MAX_INDIRECT_DRAW_BUCKETS);
+                    indirect_buckets.push_back({
+                        .bucket_index = static_cast<uint32_t>(indirect_buckets.size()),
+                        .first_command = indirect_command_count,
+                        .command_count = 0,
+                        .geometry_arena_index = mesh_buffers.geometry_arena_index,
+                        .pipeline_key = draw_item.pipeline_key,
+                    });
+                    ++pipeline_draw.indirect_bucket_count;
+                }
+                // 每个实例一个物体、一条间接绘制命令，firstInstance指向它的实例数据
+                IndirectDrawBucket &bucket = indirect_buckets.back();
+                uint32_t command_index = indirect_command_count++;
+                ++bucket.command_count;
+                indirect_objects[command_index] = {
+                    .bounding_sphere = mesh_buffers.bounding_sphere,
+                    .first_index = mesh_buffers.first_index,
+                    .index_count = mesh_buffers.index_count,
+                    .vertex_offset = static_cast<int32_t>(mesh_buffers.first_vertex),
+                    .instance_index = instance_index,
+                    .bucket_index = bucket.bucket_index,
+                    .bucket_first_command = bucket.first_command,
+                    .command_index = command_index,
+                };
+            } else if (pipeline_draw.batch_count > 0 && instance_batches.back().mesh_buffers_handle == draw_item.mesh_buffers_handle &&
+                       instance_batches.back().first_instance + instance_batches.back().instance_count == instance_index) {
+                ++instance_batches.back().instance_count;
+            } else {
+                instance_batches.push_back({draw_item.mesh_buffers_handle, draw_item.pipeline_key, instance_index, 1});
+                ++pipeline_draw.batch_count;
+            }
+        }
+        assert(indirect_command_count == indirect_object_count);
+
+        // 每个render pass的内容拆成录制任务，先全部分发给worker，主线程同时录制primary command buffer中的上传和剔除
+        record_jobs.clear();
+        auto add_record_jobs = [&](VkRenderPass render_pass, RenderQueueType queue_type, IndirectDrawPhase indirect_phase) {
+            for (const PipelineDraw &pipeline_draw : pipeline_draws) {
+                if (pipeline_draw.queue_type != queue_type) { continue; }
+
+                // late阶段只补画间接绘制的桶
+                uint32_t batch_count = indirect_phase == INDIRECT_DRAW_PHASE_EARLY ? pipeline_draw.batch_count : 0;
+                if (batch_count == 0 && pipeline_draw.indirect_bucket_count == 0) { continue; }
+
+                uint32_t first_batch = 0;
+                do {
+                    uint32_t job_batch_count = std::min(batch_count - first_batch, static_cast<uint32_t>(RECORD_JOB_BATCH_COUNT));
+                    bool is_last_job = first_batch + job_batch_count == batch_count;
+                    record_jobs.push_back({
+                        .render_pass = render_pass,
+                        .framebuffer = vk_context.framebuffers[image_index],
+                        .descriptor_set = descriptor_sets[frame_index],
+                        .pipeline_key = pipeline_draw.pipeline_key,
+                        .batches = instance_batches.data() + pipeline_draw.first_batch + first_batch,
+                        .batch_count = job_batch_count,
+                        .indirect_buckets = indirect_buckets.data() + pipeline_draw.first_indirect_bucket,
+                        .indirect_bucket_count = is_last_job ? pipeline_draw.indirect_bucket_count : 0,
+                        .indirect_phase = indirect_phase,
+                        .frame_index = frame_index,
+                        .width = static_cast<uint32_t>(width),
+                        .height = static_cast<uint32_t>(height),
+                        .cull_mode = cull_mode,
+                        .command_buffer = VK_NULL_HANDLE,
+                        .task_handle = {},
+                    });
+                    first_batch += job_batch_count;
+                } while (first_batch < batch_count);
+            }
         };
+        // early：CPU录制的批次和上一帧Hi-Z判定可见的物体，它们的深度构建本帧的Hi-Z；
+        // late：补画本帧Hi-Z判定可见、early没画的物体，最后画UI（UI不写入Hi-Z）
+        uint32_t first_pass_job_count;
+        if (gpu_driven_enabled) {
+            add_record_jobs(vk_context.early_render_pass, RENDER_QUEUE_TYPE_SCENE, INDIRECT_DRAW_PHASE_EARLY);
+            first_pass_job_count = static_cast<uint32_t>(record_jobs.size());
+            add_record_jobs(vk_context.late_render_pass, RENDER_QUEUE_TYPE_SCENE, INDIRECT_DRAW_PHASE_LATE);
+            add_record_jobs(vk_context.late_render_pass, RENDER_QUEUE_TYPE_UI, INDIRECT_DRAW_PHASE_EARLY);
+        } else {
+            add_record_jobs(vk_context.render_pass, RENDER_QUEUE_TYPE_SCENE, INDIRECT_DRAW_PHASE_EARLY);
+            add_record_jobs(vk_context.render_pass, RENDER_QUEUE_TYPE_UI, INDIRECT_DRAW_PHASE_EARLY);
+            first_pass_job_count = static_cast<uint32_t>(record_jobs.size());
+        }
+        // record_jobs在分发之后不再增长，任务持有的指针保持有效
+        for (RecordJob &job : record_jobs) {
+            RecordJob *record_job_pointer = &job;
+            job.task_handle = push_task(&task_system, [record_job_pointer]() {
+                record_job(record_job_pointer);
+            }, TASK_PRIORITY_CRITICAL);
+        }
 
         VkCommandBuffer command_buffer = command_buffers[frame_index];
         begin_command_buffer(&vk_context, command_buffer);
+        record_uploads(&vk_context, command_buffer, frame_index);
+        glm::mat4 view_projection = camera_data[0].projection * camera_data[0].view;
+        if (gpu_driven_enabled) {
+            record_indirect_culling(&indirect_draw_context, &vk_context, command_buffer, frame_index, instance_buffers[frame_index],
+                                    indirect_object_count, view_projection, &depth_pyramid, occlusion_culling_enabled);
+        }
+
+        // 按排序后的顺序执行[first_job, first_job + job_count)的secondary command buffer，SCENE所在的pass先执行静态缓存
+        bool has_static_draws = static_draw_cache_enabled && static_instance_count > 0;
+        auto execute_record_jobs = [&](uint32_t first_job, uint32_t job_count, bool execute_static_draw_cache) {
+            secondary_command_buffer_list.clear();
+            if (execute_static_draw_cache && has_static_draws) {
+                secondary_command_buffer_list.push_back(static_draw_cache.command_buffer);
+            }
+            for (uint32_t i = first_job; i < first_job + job_count; ++i) {
+                wait_task(&task_system, record_jobs[i].task_handle);
+                secondary_command_buffer_list.push_back(record_jobs[i].command_buffer);
+            }
+            if (secondary_command_buffer_list.empty()) { return; }
+            vkCmdExecuteCommands(command_buffer, static_cast<uint32_t>(secondary_command_buffer_list.size()),
+                                 secondary_command_buffer_list.data());
+        };
 
         {
             VkClearValue clear_values[2] = {};
             clear_values[0].color = {.float32 = {0.2f, 0.6f, 0.4f, 1.0f}};
             clear_values[1].depthStencil = {.depth = 1.0f, .stencil = 0};
 
-            begin_render_pass(&vk_context, command_buffer, vk_context.render_pass,
-                              vk_context.framebuffers[image_index], window_width, window_height, clear_values, std::size(clear_values));
-
-            for (RenderQueueType queue_type : render_queue_order) {
-                auto queue_it = render_queue_pipeline_renderables.find(queue_type);
-                if (queue_it == render_queue_pipeline_renderables.end()) { continue; }
-
-                const auto &pipeline_renderables = queue_it->second;
-                uint32_t camera_index = (queue_type == RENDER_QUEUE_TYPE_UI) ? 1 : 0;
-
-                // SCENE队列按pipeline order顺序渲染，UI队列直接遍历
-                if (queue_type == RENDER_QUEUE_TYPE_SCENE) {
-                    // 按预定义的pipeline顺序渲染
-                    for (const PipelineKey &pipeline_key : scene_pipeline_render_order) {
-                        auto pipeline_it = pipeline_renderables.find(pipeline_key);
-                        if (pipeline_it == pipeline_renderables.end()) { continue; }
-
-                        const auto &renderables = pipeline_it->second;
-                        if (renderables.empty()) { continue; }
-
-                        render_pipeline_renderables(command_buffer, &vk_context, &mesh_buffers_registry, descriptor_sets[frame_index], pipeline_key, renderables, camera_index, window_width, window_height, cull_mode);
-                    }
-                } else {
-                    // UI队列直接遍历所有pipeline（已在收集阶段完成z值排序）
-                    for (const auto &[pipeline_key, renderables] : pipeline_renderables) {
-                        if (renderables.empty()) { continue; }
-
-                        render_pipeline_renderables(command_buffer, &vk_context, &mesh_buffers_registry, descriptor_sets[frame_index], pipeline_key, renderables, camera_index, window_width, window_height, cull_mode);
-                    }
-                }
+            if (gpu_driven_enabled) {
+                begin_render_pass(&vk_context, command_buffer, vk_context.early_render_pass,
+                                  vk_context.framebuffers[image_index], width, height, clear_values, std::size(clear_values),
+                                  VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+                execute_record_jobs(0, first_pass_job_count, true);
+                end_render_pass(&vk_context, command_buffer);
+
+                record_depth_pyramid_build(&depth_pyramid, &vk_context, command_buffer, frame_index, image_index, view_projection);
+                record_late_indirect_culling(&indirect_draw_context, &vk_context, command_buffer, frame_index, indirect_object_count);
+
+                begin_render_pass(&vk_context, command_buffer, vk_context.late_render_pass,
+                                  vk_context.framebuffers[image_index], width, height, nullptr, 0,
+                                  VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+                execute_record_jobs(first_pass_job_count, static_cast<uint32_t>(record_jobs.size()) - first_pass_job_count, false);
+                end_render_pass(&vk_context, command_buffer);
+            } else {
+                begin_render_pass(&vk_context, command_buffer, vk_context.render_pass,
+                                  vk_context.framebuffers[image_index], width, height, clear_values, std::size(clear_values),
+                                  VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+                execute_record_jobs(0, first_pass_job_count, true);
+                end_render_pass(&vk_context, command_buffer);
             }
-
-            end_render_pass(&vk_context, command_buffer);
         }
 
         end_command_buffer(&vk_context, command_buffer);
@@ -644,6 +1195,7 @@ int main() {
 
         frame_index = (frame_index + 1) % MAX_FRAMES_IN_FLIGHT;
     }
+    drain_coroutines(&coroutine_scheduler); // 未完成的协程可能还持有mesh buffers
     vkDeviceWaitIdle(vk_context.device);
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
         on_gpu_complete(&frame_contexts[i], &mesh_buffers_registry, &task_system, &vk_context);
@@ -655,7 +1207,10 @@ int main() {
     }
     registry.clear();
     shutdown_inputs(&inputs);
+    cleanup_pipeline_manager(&pipeline_manager);
     stop(&task_system);
+    cleanup_upload_queue(&vk_context); // 执行剩余的发布和销毁，必须在清理registry之前
+    cleanup_mesh_buffers_registry(&mesh_buffers_registry, &vk_context);
     for (uint32_t i = 0; i < vk_context.swapchain_image_count; ++i) {
         if (render_complete_semaphores[i] != VK_NULL_HANDLE) {
             semaphore_pool.release_semaphore(render_complete_semaphores[i]);
@@ -674,10 +1229,18 @@ int main() {
     }
     fences.clear();
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        vkDestroyBuffer(vk_context.device, camera_buffers[i], nullptr);
-        vkFreeMemory(vk_context.device, camera_buffer_memories[i], nullptr);
+        destroy_buffer_with_memory(&vk_context, camera_buffers[i], camera_buffer_allocations[i]);
+        destroy_buffer_with_memory(&vk_context, instance_buffers[i], instance_buffer_allocations[i]);
     }
+    cleanup_secondary_command_buffers(&secondary_command_buffers, &vk_context);
+    cleanup_depth_pyramid(&depth_pyramid, &vk_context);
+    cleanup_indirect_draw(&indirect_draw_context, &vk_context);
     vkFreeCommandBuffers(vk_context.device, vk_context.command_pool, MAX_FRAMES_IN_FLIGHT, command_buffers.data());
+    for (StaticDrawCache &static_draw_cache : static_draw_caches) {
+        if (static_draw_cache.command_buffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(vk_context.device, vk_context.command_pool, 1, &static_draw_cache.command_buffer);
+        }
+    }
     command_buffers.clear();
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
         vkFreeDescriptorSets(vk_context.device, descriptor_pools[i], 1, &descriptor_sets[i]);
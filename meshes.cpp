@@ -1,5 +1,8 @@
 #include "meshes.h"
+#include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <glm/ext/scalar_constants.hpp>
 
@@ -105,100 +108,345 @@ MeshData generate_quad_mesh_data(float width, float height) {
     return mesh;
 }
 
+static MeshBuffersEntry &get_mesh_buffers_entry(MeshBuffersRegistry *mesh_buffers_registry, uint32_t index) {
+    MeshBuffersEntry *page = mesh_buffers_registry->pages[index / MESH_BUFFERS_PAGE_SIZE].load(std::memory_order_acquire);
+    return page[index % MESH_BUFFERS_PAGE_SIZE];
+}
+
+static uint32_t get_state_generation(uint64_t state) {
+    return static_cast<uint32_t>(state >> 32);
+}
+
+static uint32_t get_state_ref_count(uint64_t state) {
+    return static_cast<uint32_t>(state & MESH_BUFFERS_REF_COUNT_MASK);
+}
+
+static uint64_t pack_task_handle(TaskHandle task_handle) {
+    return static_cast<uint64_t>(task_handle.generation) << 32 | task_handle.node_index;
+}
+
+static TaskHandle unpack_task_handle(uint64_t packed) {
+    return {static_cast<uint32_t>(packed), static_cast<uint32_t>(packed >> 32)};
+}
+
+// handle的下标越界（从未分配过）时返回nullptr，代数由调用者检查
+static MeshBuffersEntry *find_mesh_buffers_entry(MeshBuffersRegistry *mesh_buffers_registry,
+                                                 MeshBuffersHandle mesh_buffers_handle) {
+    if (mesh_buffers_handle.index >= mesh_buffers_registry->entry_count.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &get_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle.index);
+}
+
+// 引用计数非0且代数匹配（required_bits也都置位）时加1
+static bool try_increment_ref_count(MeshBuffersEntry *entry, uint32_t generation, uint64_t required_bits) {
+    uint64_t state = entry->state.load(std::memory_order_acquire);
+    while (get_state_generation(state) == generation && get_state_ref_count(state) != 0 &&
+           (state & required_bits) == required_bits) {
+        assert(get_state_ref_count(state) < MESH_BUFFERS_REF_COUNT_MASK);
+        if (entry->state.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t allocate_mesh_buffers_entry(MeshBuffersRegistry *mesh_buffers_registry) {
+    uint64_t head = mesh_buffers_registry->free_entry_head.load();
+    while (static_cast<uint32_t>(head) != 0) {
+        uint32_t index = static_cast<uint32_t>(head) - 1;
+        MeshBuffersEntry &entry = get_mesh_buffers_entry(mesh_buffers_registry, index);
+        uint32_t next = entry.next_free_entry_index.load(std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (mesh_buffers_registry->free_entry_head.compare_exchange_weak(head, (tag << 32) | next)) {
+            return index;
+        }
+    }
+
+    // no free entry, grow; pages are published before entry_count so lookups never see a missing page
+    uint32_t index = mesh_buffers_registry->entry_count.load();
+    while (true) {
+        uint32_t page_index = index / MESH_BUFFERS_PAGE_SIZE;
+        assert(page_index < MAX_MESH_BUFFERS_PAGES);
+        if (mesh_buffers_registry->pages[page_index].load(std::memory_order_acquire) == nullptr) {
+            MeshBuffersEntry *page = new MeshBuffersEntry[MESH_BUFFERS_PAGE_SIZE]();
+            for (uint32_t i = 0; i < MESH_BUFFERS_PAGE_SIZE; ++i) {
+                page[i].state.store(static_cast<uint64_t>(1) << 32, std::memory_order_relaxed); // generation 1
+            }
+            MeshBuffersEntry *expected = nullptr;
+            if (!mesh_buffers_registry->pages[page_index].compare_exchange_strong(expected, page)) {
+                delete[] page; // another thread allocated the page first
+            }
+        }
+        if (mesh_buffers_registry->entry_count.compare_exchange_weak(index, index + 1)) {
+            return index;
+        }
+    }
+}
+
+static void free_mesh_buffers_entry(MeshBuffersRegistry *mesh_buffers_registry, uint32_t index) {
+    MeshBuffersEntry &entry = get_mesh_buffers_entry(mesh_buffers_registry, index);
+    uint64_t head = mesh_buffers_registry->free_entry_head.load();
+    while (true) {
+        entry.next_free_entry_index.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (mesh_buffers_registry->free_entry_head.compare_exchange_weak(head, (tag << 32) | (index + 1))) {
+            return;
+        }
+    }
+}
+
+glm::vec4 compute_bounding_sphere(const std::vector<Vertex> &vertices) {
+    if (vertices.empty()) {
+        return glm::vec4(0.0f);
+    }
+    glm::vec3 min_position = vertices[0].position;
+    glm::vec3 max_position = vertices[0].position;
+    for (const Vertex &vertex: vertices) {
+        min_position = glm::min(min_position, vertex.position);
+        max_position = glm::max(max_position, vertex.position);
+    }
+    glm::vec3 center = (min_position + max_position) * 0.5f;
+    float radius_squared = 0.0f;
+    for (const Vertex &vertex: vertices) {
+        glm::vec3 offset = vertex.position - center;
+        radius_squared = std::max(radius_squared, glm::dot(offset, offset));
+    }
+    return glm::vec4(center, std::sqrt(radius_squared));
+}
+
+static void init_geometry_arena(GeometryArena *geometry_arena, VkContext *context) {
+    create_buffer_with_memory(context, sizeof(Vertex) * GEOMETRY_ARENA_VERTEX_CAPACITY,
+                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &geometry_arena->vertex_buffer,
+                              &geometry_arena->vertex_buffer_allocation);
+    create_buffer_with_memory(context, sizeof(uint32_t) * GEOMETRY_ARENA_INDEX_CAPACITY,
+                              VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &geometry_arena->index_buffer,
+                              &geometry_arena->index_buffer_allocation);
+    init_buddy_allocator(&geometry_arena->vertex_allocator, GEOMETRY_ARENA_VERTEX_CAPACITY, GEOMETRY_ARENA_MIN_ALLOCATION);
+    init_buddy_allocator(&geometry_arena->index_allocator, GEOMETRY_ARENA_INDEX_CAPACITY, GEOMETRY_ARENA_MIN_ALLOCATION);
+}
+
+void init_mesh_buffers_registry(MeshBuffersRegistry *mesh_buffers_registry, VkContext *context) {
+    init_geometry_arena(&mesh_buffers_registry->geometry_arenas[0], context);
+    mesh_buffers_registry->geometry_arena_count.store(1, std::memory_order_release);
+}
+
+void cleanup_mesh_buffers_registry(MeshBuffersRegistry *mesh_buffers_registry, VkContext *context) {
+    for (uint32_t i = 0; i < MAX_MESH_BUFFERS_PAGES; ++i) {
+        delete[] mesh_buffers_registry->pages[i].exchange(nullptr);
+    }
+    mesh_buffers_registry->entry_count.store(0);
+    mesh_buffers_registry->free_entry_head.store(0);
+
+    uint32_t geometry_arena_count = mesh_buffers_registry->geometry_arena_count.exchange(0);
+    for (uint32_t i = 0; i < geometry_arena_count; ++i) {
+        GeometryArena *geometry_arena = &mesh_buffers_registry->geometry_arenas[i];
+        assert(geometry_arena->vertex_allocator.allocation_count == 0 && geometry_arena->index_allocator.allocation_count == 0);
+        destroy_buffer_with_memory(context, geometry_arena->vertex_buffer, geometry_arena->vertex_buffer_allocation);
+        destroy_buffer_with_memory(context, geometry_arena->index_buffer, geometry_arena->index_buffer_allocation);
+    }
+}
+
+void bind_geometry_arena(MeshBuffersRegistry *mesh_buffers_registry, uint32_t geometry_arena_index,
+                         VkCommandBuffer command_buffer) {
+    GeometryArena *geometry_arena = &mesh_buffers_registry->geometry_arenas[geometry_arena_index];
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &geometry_arena->vertex_buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, geometry_arena->index_buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
 bool increment_mesh_buffers_ref_count(MeshBuffersRegistry *mesh_buffers_registry,
                                       MeshBuffersHandle mesh_buffers_handle) {
-    std::lock_guard<std::mutex> lock(mesh_buffers_registry->mutex);
-    MeshBuffersEntry &entry = mesh_buffers_registry->entries[mesh_buffers_handle];
-    if (entry.ref_count == 0) {
-        // empty entry
-        return false;
-    }
-    ++entry.ref_count;
-    return true;
+    MeshBuffersEntry *entry = find_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle);
+    return entry != nullptr && try_increment_ref_count(entry, mesh_buffers_handle.generation, 0);
+}
+
+bool acquire_uploaded_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, MeshBuffersHandle mesh_buffers_handle) {
+    MeshBuffersEntry *entry = find_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle);
+    return entry != nullptr &&
+           try_increment_ref_count(entry, mesh_buffers_handle.generation, MESH_BUFFERS_UPLOADED_BIT);
+}
+
+const MeshBuffers &get_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, MeshBuffersHandle mesh_buffers_handle) {
+    return get_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle.index).mesh_buffers;
 }
 
 void decrement_mesh_buffers_ref_count(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
                                       VkContext *context, MeshBuffersHandle mesh_buffers_handle) {
-    std::lock_guard<std::mutex> lock(mesh_buffers_registry->mutex);
-    MeshBuffersEntry &entry = mesh_buffers_registry->entries[mesh_buffers_handle];
-    if ((--entry.ref_count) == 0) {
-        MeshBuffers mesh_buffers = entry.mesh_buffers;
-        memset(&entry, 0, sizeof(MeshBuffersEntry)); // zero out the entry
-        // raise a task to destroy the mesh buffers
-        push_task(task_system, [context, mesh_buffers]() {
+    MeshBuffersEntry *entry = find_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle);
+    assert(entry != nullptr);
+    uint64_t state = entry->state.fetch_sub(1, std::memory_order_acq_rel);
+    assert(get_state_generation(state) == mesh_buffers_handle.generation && get_state_ref_count(state) > 0);
+    if (get_state_ref_count(state) != 1) {
+        return;
+    }
+    TaskHandle upload_task = unpack_task_handle(entry->upload_task.load(std::memory_order_acquire));
+    // raise a task to destroy the mesh buffers, after the upload task has queued its copies and publish.
+    // the actual destruction goes through the upload queue so it runs once those copies finished on the GPU;
+    // the entry only goes back to the free list at that point, so it can't be reused meanwhile
+    uint32_t index = mesh_buffers_handle.index;
+    uint32_t generation = mesh_buffers_handle.generation;
+    push_task(task_system, [mesh_buffers_registry, context, index, generation]() {
+        enqueue_upload_completion(context, [mesh_buffers_registry, index, generation]() {
+            MeshBuffersEntry &entry = get_mesh_buffers_entry(mesh_buffers_registry, index);
+            MeshBuffers mesh_buffers = entry.mesh_buffers;
+            entry.mesh_buffers = {};
+            // the ref count is zero so nobody can increment it anymore; bumping the generation invalidates outstanding handles
+            entry.state.store(static_cast<uint64_t>(generation + 1) << 32, std::memory_order_release);
+            free_mesh_buffers_entry(mesh_buffers_registry, index);
+            GeometryArena *geometry_arena = &mesh_buffers_registry->geometry_arenas[mesh_buffers.geometry_arena_index];
+            std::lock_guard<std::mutex> lock(geometry_arena->mutex);
             if (mesh_buffers.index_count > 0) {
-                vkDestroyBuffer(context->device, mesh_buffers.index_buffer, nullptr);
-                vkFreeMemory(context->device, mesh_buffers.index_buffer_memory, nullptr);
+                free_buddy_block(&geometry_arena->index_allocator, mesh_buffers.first_index);
             }
-            vkDestroyBuffer(context->device, mesh_buffers.vertex_buffer, nullptr);
-            vkFreeMemory(context->device, mesh_buffers.vertex_buffer_memory, nullptr);
+            free_buddy_block(&geometry_arena->vertex_allocator, mesh_buffers.first_vertex);
         });
+    }, TASK_PRIORITY_DESTROY, &upload_task, 1);
+}
+
+// 在一个arena中同时分配顶点和索引，任意一个放不下就都不分配
+static bool allocate_in_geometry_arena(GeometryArena *geometry_arena, uint32_t vertex_count, uint32_t index_count,
+                                       MeshBuffers *mesh_buffers) {
+    std::lock_guard<std::mutex> lock(geometry_arena->mutex);
+    uint64_t first_vertex = 0;
+    if (!allocate_buddy_block(&geometry_arena->vertex_allocator, vertex_count, 1, &first_vertex)) {
+        return false;
+    }
+    uint64_t first_index = 0;
+    if (index_count > 0 && !allocate_buddy_block(&geometry_arena->index_allocator, index_count, 1, &first_index)) {
+        free_buddy_block(&geometry_arena->vertex_allocator, first_vertex);
+        return false;
+    }
+    mesh_buffers->first_vertex = static_cast<uint32_t>(first_vertex);
+    mesh_buffers->first_index = static_cast<uint32_t>(first_index);
+    return true;
+}
+
+// 依次尝试已有的arena，都放不下时创建新的arena；达到MAX_GEOMETRY_ARENAS或mesh比一个arena还大时返回false
+static bool allocate_geometry(MeshBuffersRegistry *mesh_buffers_registry, VkContext *context, uint32_t vertex_count,
+                              uint32_t index_count, MeshBuffers *mesh_buffers) {
+    if (vertex_count > GEOMETRY_ARENA_VERTEX_CAPACITY || index_count > GEOMETRY_ARENA_INDEX_CAPACITY) {
+        return false;
+    }
+    uint32_t geometry_arena_count = mesh_buffers_registry->geometry_arena_count.load(std::memory_order_acquire);
+    uint32_t geometry_arena_index = 0;
+    for (; geometry_arena_index < geometry_arena_count; ++geometry_arena_index) {
+        if (allocate_in_geometry_arena(&mesh_buffers_registry->geometry_arenas[geometry_arena_index], vertex_count,
+                                       index_count, mesh_buffers)) {
+            mesh_buffers->geometry_arena_index = geometry_arena_index;
+            return true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mesh_buffers_registry->geometry_arenas_mutex);
+    // 等锁期间其他线程可能已经创建了新的arena，先试这些
+    geometry_arena_count = mesh_buffers_registry->geometry_arena_count.load(std::memory_order_relaxed);
+    for (; geometry_arena_index < geometry_arena_count; ++geometry_arena_index) {
+        if (allocate_in_geometry_arena(&mesh_buffers_registry->geometry_arenas[geometry_arena_index], vertex_count,
+                                       index_count, mesh_buffers)) {
+            mesh_buffers->geometry_arena_index = geometry_arena_index;
+            return true;
+        }
+    }
+    if (geometry_arena_count == MAX_GEOMETRY_ARENAS) {
+        return false;
+    }
+    GeometryArena *geometry_arena = &mesh_buffers_registry->geometry_arenas[geometry_arena_count];
+    init_geometry_arena(geometry_arena, context);
+    // 新arena是空的，mesh又不超过容量，在发布之前分配不会失败
+    allocate_in_geometry_arena(geometry_arena, vertex_count, index_count, mesh_buffers);
+    mesh_buffers->geometry_arena_index = geometry_arena_count;
+    mesh_buffers_registry->geometry_arena_count.store(geometry_arena_count + 1, std::memory_order_release);
+    return true;
+}
+
+// 拷贝在GPU上完成后由主线程调用。等待期间mesh可能已被释放、槽位被复用，代数不同就不再发布
+static void publish_mesh_buffers(MeshBuffersEntry *entry, uint32_t generation) {
+    uint64_t state = entry->state.load(std::memory_order_relaxed);
+    while (get_state_generation(state) == generation && (state & MESH_BUFFERS_UPLOADED_BIT) == 0) {
+        // publish: mesh_buffers written by the buffer tasks become visible to whoever acquires the uploaded bit
+        if (entry->state.compare_exchange_weak(state, state | MESH_BUFFERS_UPLOADED_BIT, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+            break;
+        }
     }
 }
 
 MeshBuffersHandle request_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
                                        VkContext *context, MeshData &&mesh_data) {
-    std::lock_guard<std::mutex> lock(mesh_buffers_registry->mutex);
-    for (uint32_t i = 0; i < MAX_MESH_BUFFERS; ++i) {
-        if (mesh_buffers_registry->entries[i].ref_count == 0) {
-            mesh_buffers_registry->entries[i].ref_count = 1;
-            mesh_buffers_registry->entries[i].uploaded = false;
-            // raise a task to create the mesh buffers
-            std::function task_body = [context, mesh_data = std::move(mesh_data)]() mutable -> MeshBuffers {
-                MeshBuffers mesh_buffers = {};
-                // 创建GPU缓冲区
-                create_buffer(context, sizeof(Vertex) * mesh_data.vertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &mesh_buffers.vertex_buffer);
-
-                VkMemoryRequirements vertex_buffer_memory_requirements;
-                vkGetBufferMemoryRequirements(context->device, mesh_buffers.vertex_buffer, &vertex_buffer_memory_requirements);
-                uint32_t vertex_buffer_memory_type_index = UINT32_MAX;
-                get_memory_type_index(context, vertex_buffer_memory_requirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertex_buffer_memory_type_index);
-                allocate_memory(context, vertex_buffer_memory_requirements.size, vertex_buffer_memory_type_index, &mesh_buffers.vertex_buffer_memory);
-                void *vertex_buffer_data = nullptr;
-                vkMapMemory(context->device, mesh_buffers.vertex_buffer_memory, 0, sizeof(Vertex) * mesh_data.vertices.size(), 0, &vertex_buffer_data);
-                memcpy(vertex_buffer_data, mesh_data.vertices.data(), sizeof(Vertex) * mesh_data.vertices.size());
-                vkUnmapMemory(context->device, mesh_buffers.vertex_buffer_memory);
-                vkBindBufferMemory(context->device, mesh_buffers.vertex_buffer, mesh_buffers.vertex_buffer_memory, 0);
-
-                mesh_buffers.vertex_count = static_cast<uint32_t>(mesh_data.vertices.size()); // 保存绘制元数据
-
-                if (!mesh_data.indices.empty()) {
-                    create_buffer(context, sizeof(uint32_t) * mesh_data.indices.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &mesh_buffers.index_buffer);
-
-                    VkMemoryRequirements index_buffer_memory_requirements;
-                    vkGetBufferMemoryRequirements(context->device, mesh_buffers.index_buffer, &index_buffer_memory_requirements);
-                    uint32_t index_buffer_memory_type_index = UINT32_MAX;
-                    get_memory_type_index(context, index_buffer_memory_requirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &index_buffer_memory_type_index);
-                    allocate_memory(context, index_buffer_memory_requirements.size, index_buffer_memory_type_index, &mesh_buffers.index_buffer_memory);
-                    void *index_buffer_data = nullptr;
-                    vkMapMemory(context->device, mesh_buffers.index_buffer_memory, 0, sizeof(uint32_t) * mesh_data.indices.size(), 0, &index_buffer_data);
-                    memcpy(index_buffer_data, mesh_data.indices.data(), sizeof(uint32_t) * mesh_data.indices.size());
-                    vkUnmapMemory(context->device, mesh_buffers.index_buffer_memory);
-                    vkBindBufferMemory(context->device, mesh_buffers.index_buffer, mesh_buffers.index_buffer_memory, 0);
-
-                    mesh_buffers.index_count = static_cast<uint32_t>(mesh_data.indices.size());
-                    mesh_buffers.index_type = VK_INDEX_TYPE_UINT32; // 默认使用uint32索引
-                }
-                mesh_buffers.primitive_topology = mesh_data.primitive_topology;
-                return mesh_buffers;
-            };
-            std::function task_callback = [mesh_buffers_registry, i](const MeshBuffers &mesh_buffers) mutable {
-                std::lock_guard<std::mutex> lock(mesh_buffers_registry->mutex);
-                mesh_buffers_registry->entries[i].mesh_buffers = mesh_buffers;
-                mesh_buffers_registry->entries[i].uploaded = true;
-            };
-            std::function task = [task_body = std::move(task_body), task_callback = std::move(task_callback)]() {
-                MeshBuffers mesh_buffers = task_body();
-                task_callback(mesh_buffers);
-            };
-            push_task(task_system, std::move(task));
-            return i;
-        }
+    assert(!mesh_data.vertices.empty());
+    // 绘制元数据和arena区间在提交时就已确定，上传任务只负责写入staging；放不下时还没有占用槽位，直接返回
+    MeshBuffers mesh_buffers = {};
+    mesh_buffers.vertex_count = static_cast<uint32_t>(mesh_data.vertices.size());
+    mesh_buffers.index_count = static_cast<uint32_t>(mesh_data.indices.size());
+    mesh_buffers.primitive_topology = mesh_data.primitive_topology;
+    if (!allocate_geometry(mesh_buffers_registry, context, mesh_buffers.vertex_count, mesh_buffers.index_count,
+                           &mesh_buffers)) {
+        printf("geometry arenas are full, dropping mesh with %u vertices and %u indices\n", mesh_buffers.vertex_count,
+               mesh_buffers.index_count);
+        return {};
     }
-    assert(false);
+    mesh_buffers.bounding_sphere = compute_bounding_sphere(mesh_data.vertices);
+
+    uint32_t index = allocate_mesh_buffers_entry(mesh_buffers_registry);
+    MeshBuffersEntry &entry = get_mesh_buffers_entry(mesh_buffers_registry, index);
+    entry.mesh_buffers = mesh_buffers;
+    entry.upload_task.store(pack_task_handle({}), std::memory_order_relaxed);
+    uint32_t generation = get_state_generation(entry.state.load(std::memory_order_relaxed));
+    entry.state.store(static_cast<uint64_t>(generation) << 32 | 1, std::memory_order_release);
+    MeshBuffersHandle mesh_buffers_handle = {index, generation};
+
+    // 上传拆成任务图：顶点与索引互不依赖、并行写入staging，全部入队后再登记发布，
+    // 发布在GPU拷贝完成后进行。在发布之前entry对其他线程不可见（uploaded为false）
+    TaskHandle buffer_tasks[2];
+    uint32_t buffer_task_count = 0;
+    GeometryArena *geometry_arena = &mesh_buffers_registry->geometry_arenas[mesh_buffers.geometry_arena_index];
+    buffer_tasks[buffer_task_count++] = push_task(task_system, [context, geometry_arena, first_vertex = mesh_buffers.first_vertex, vertices = std::move(mesh_data.vertices)]() {
+        enqueue_buffer_upload(context, geometry_arena->vertex_buffer, static_cast<VkDeviceSize>(first_vertex) * sizeof(Vertex),
+                              vertices.data(), vertices.size() * sizeof(Vertex));
+    }, TASK_PRIORITY_UPLOAD);
+    if (!mesh_data.indices.empty()) {
+        buffer_tasks[buffer_task_count++] = push_task(task_system, [context, geometry_arena, first_index = mesh_buffers.first_index, indices = std::move(mesh_data.indices)]() {
+            enqueue_buffer_upload(context, geometry_arena->index_buffer, static_cast<VkDeviceSize>(first_index) * sizeof(uint32_t),
+                                  indices.data(), indices.size() * sizeof(uint32_t));
+        }, TASK_PRIORITY_UPLOAD);
+    }
+    MeshBuffersEntry *published_entry = &entry;
+    TaskHandle upload_task = push_task(task_system, [context, published_entry, generation]() {
+        enqueue_upload_completion(context, [published_entry, generation]() {
+            publish_mesh_buffers(published_entry, generation);
+        });
+    }, TASK_PRIORITY_UPLOAD, buffer_tasks, buffer_task_count);
+
+    entry.upload_task.store(pack_task_handle(upload_task), std::memory_order_release);
+    return mesh_buffers_handle;
+}
+
+TaskHandle get_mesh_buffers_upload_task(MeshBuffersRegistry *mesh_buffers_registry,
+                                        MeshBuffersHandle mesh_buffers_handle) {
+    MeshBuffersEntry *entry = find_mesh_buffers_entry(mesh_buffers_registry, mesh_buffers_handle);
+    if (entry == nullptr || get_state_generation(entry->state.load(std::memory_order_acquire)) !=
+                            mesh_buffers_handle.generation) {
+        return {}; // stale handle, the upload is long done
+    }
+    return unpack_task_handle(entry->upload_task.load(std::memory_order_acquire));
+}
+
+Async<MeshBuffersHandle> upload_mesh(CoroutineScheduler *scheduler, MeshBuffersRegistry *mesh_buffers_registry,
+                                     VkContext *context, MeshData mesh_data) {
+    MeshBuffersHandle mesh_buffers_handle = request_mesh_buffers(mesh_buffers_registry, scheduler->task_system, context,
+                                                                 std::move(mesh_data));
+    co_await wait_task_async(scheduler, get_mesh_buffers_upload_task(mesh_buffers_registry, mesh_buffers_handle),
+                             TASK_PRIORITY_UPLOAD);
+    co_return mesh_buffers_handle;
 }
 
 void release_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system, VkContext *context,
                           MeshBuffersHandle mesh_buffers_handle) {
+    if (mesh_buffers_handle.index == UINT32_MAX) {
+        return; // request_mesh_buffers失败时返回的handle
+    }
     decrement_mesh_buffers_ref_count(mesh_buffers_registry, task_system, context, mesh_buffers_handle);
 }
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "coroutines.h"
 #include "tasks.h"
 #include "vk.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include <glm/glm.hpp>
 #include <vector>
 #include <vulkan/vulkan_core.h>
@@ -25,40 +29,103 @@ MeshData generate_ring_mesh_data(float radius, uint32_t segments);
 
 MeshData generate_quad_mesh_data(float width, float height);
 
-#define MAX_MESH_BUFFERS 10
+// 以AABB中心为球心的包围球（不是最小包围球，但足够紧且O(n)）
+glm::vec4 compute_bounding_sphere(const std::vector<Vertex> &vertices);
 
-struct MeshBuffers {
-    // GPU资源
-    VkBuffer vertex_buffer;
-    VkBuffer index_buffer;
-    VkDeviceMemory vertex_buffer_memory;
-    VkDeviceMemory index_buffer_memory;
+#define MESH_BUFFERS_PAGE_SIZE 1024 // 每页的entry数，页一旦分配地址就不再变化
+#define MAX_MESH_BUFFERS_PAGES 4096 // 最多MESH_BUFFERS_PAGE_SIZE * MAX_MESH_BUFFERS_PAGES个mesh
+#define GEOMETRY_ARENA_VERTEX_CAPACITY (1u << 21) // 顶点数，2的幂
+#define GEOMETRY_ARENA_INDEX_CAPACITY (1u << 22) // 索引数，2的幂
+#define GEOMETRY_ARENA_MIN_ALLOCATION 16 // 以顶点/索引为单位的最小分配，越小伙伴分配器的簿记越大
+#define MAX_GEOMETRY_ARENAS 8 // 已有的arena都放不下时再创建一个，不超过1 << DRAW_KEY_GEOMETRY_ARENA_BITS
 
-    // 绘制元数据（从Mesh创建时保存，用于绘制命令）
+// mesh在geometry arena中的位置和绘制元数据
+struct MeshBuffers {
+    uint32_t first_vertex; // vkCmdDraw的firstVertex，vkCmdDrawIndexed的vertexOffset（索引是mesh内的相对值）
+    uint32_t first_index; // vkCmdDrawIndexed的firstIndex
     uint32_t vertex_count; // 顶点数量，用于vkCmdDraw（非索引绘制）
-    uint32_t index_count; // 索引数量，用于vkCmdDrawIndexed
-    VkIndexType index_type;
+    uint32_t index_count; // 索引数量，用于vkCmdDrawIndexed，0表示非索引绘制
+    uint32_t geometry_arena_index; // 顶点和索引所在的arena，两者总在同一个arena中
     VkPrimitiveTopology primitive_topology;
+    glm::vec4 bounding_sphere; // 局部空间的包围球：xyz为球心，w为半径，用于视锥剔除
+};
+
+// 多个mesh共用的顶点/索引缓冲，mesh以偏移存放其中，绘制时只在arena变化时重新绑定。
+// 用伙伴分配器按顶点/索引为单位切分，偏移可以直接用作firstVertex/firstIndex
+struct GeometryArena {
+    std::mutex mutex;
+    VkBuffer vertex_buffer;
+    VkBuffer index_buffer; // uint32索引
+    GpuAllocation vertex_buffer_allocation;
+    GpuAllocation index_buffer_allocation;
+    BuddyAllocator vertex_allocator;
+    BuddyAllocator index_allocator;
 };
 
-typedef uint32_t MeshBuffersHandle;
+// 槽位下标 + 代数：槽位释放时代数递增，旧handle随之失效
+struct MeshBuffersHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
 
+    bool operator==(const MeshBuffersHandle &other) const {
+        return index == other.index && generation == other.generation;
+    }
+};
+
+struct MeshBuffersHandleHash {
+    size_t operator()(const MeshBuffersHandle &handle) const {
+        return std::hash<uint64_t>()(static_cast<uint64_t>(handle.generation) << 32 | handle.index);
+    }
+};
+
+#define MESH_BUFFERS_REF_COUNT_MASK 0x7FFFFFFFull
+#define MESH_BUFFERS_UPLOADED_BIT 0x80000000ull
+
+// state把代数、上传完成标记和引用计数打包进一个64位原子量，读写都无需加锁：
+// [0-30]  ref_count
+// [31]    uploaded：以release写入，读到置位（acquire）后即可读取mesh_buffers
+// [32-63] generation：从1开始，避免默认构造的handle命中
+// 代数和引用计数一起CAS，槽位被释放再复用时旧handle不会误增新mesh的引用计数
 struct MeshBuffersEntry {
     MeshBuffers mesh_buffers;
-    uint32_t ref_count;
-    bool uploaded;
+    std::atomic<uint64_t> state;
+    std::atomic<uint64_t> upload_task; // 上传在CPU侧完成（拷贝已入队）的TaskHandle：低32位为node_index，高32位为generation
+    std::atomic<uint32_t> next_free_entry_index; // 空闲链表中下一个槽位的下标+1，0表示链表结束
 };
 
+// 分页的slot map：entry按页分配、从不移动，空闲槽位用无锁链表管理，分配与释放都是O(1)
 struct MeshBuffersRegistry {
-    MeshBuffersEntry entries[MAX_MESH_BUFFERS];
-    std::mutex mutex;
+    std::atomic<MeshBuffersEntry *> pages[MAX_MESH_BUFFERS_PAGES];
+    std::atomic<uint32_t> entry_count; // 分配出去过的槽位数（高水位）
+    std::atomic<uint64_t> free_entry_head; // 空闲槽位栈顶：低32位为下标+1（0表示空），高32位为防ABA标签
+    GeometryArena geometry_arenas[MAX_GEOMETRY_ARENAS];
+    std::atomic<uint32_t> geometry_arena_count; // 创建完成后才递增，[0, count)内的arena可以无锁读取
+    std::mutex geometry_arenas_mutex; // 创建新arena时加锁
 };
 
+// 创建第一个geometry arena，在request_mesh_buffers之前调用
+void init_mesh_buffers_registry(MeshBuffersRegistry *mesh_buffers_registry, VkContext *context);
+// 释放所有页和geometry arena，调用前所有mesh buffers都必须已经销毁
+void cleanup_mesh_buffers_registry(MeshBuffersRegistry *mesh_buffers_registry, VkContext *context);
+// 绑定geometry arena的顶点和索引缓冲，之后按MeshBuffers中的偏移绘制
+void bind_geometry_arena(MeshBuffersRegistry *mesh_buffers_registry, uint32_t geometry_arena_index,
+                         VkCommandBuffer command_buffer);
 bool increment_mesh_buffers_ref_count(MeshBuffersRegistry *mesh_buffers_registry,
                                       MeshBuffersHandle mesh_buffers_handle);
+// 已上传则增加引用计数并返回true（调用者之后负责decrement），未上传或handle已失效返回false
+bool acquire_uploaded_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, MeshBuffersHandle mesh_buffers_handle);
+// 调用者必须持有引用且已上传
+const MeshBuffers &get_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, MeshBuffersHandle mesh_buffers_handle);
 void decrement_mesh_buffers_ref_count(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
                                       VkContext *context, MeshBuffersHandle mesh_buffers_handle);
+// 所有geometry arena都放不下时返回无效handle（index为UINT32_MAX），这个mesh不会被绘制，释放它也是安全的
 MeshBuffersHandle request_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system,
                                        VkContext *context, MeshData &&mesh_data);
+// 返回上传任务句柄，完成时拷贝已入队；GPU拷贝完成后才会置位uploaded
+TaskHandle get_mesh_buffers_upload_task(MeshBuffersRegistry *mesh_buffers_registry,
+                                        MeshBuffersHandle mesh_buffers_handle);
+// 协程版本：提交上传并等待拷贝入队，在worker线程上恢复；mesh在GPU拷贝完成后才会被绘制
+Async<MeshBuffersHandle> upload_mesh(CoroutineScheduler *scheduler, MeshBuffersRegistry *mesh_buffers_registry,
+                                     VkContext *context, MeshData mesh_data);
 void release_mesh_buffers(MeshBuffersRegistry *mesh_buffers_registry, TaskSystem *task_system, VkContext *context,
                           MeshBuffersHandle mesh_buffers_handle);
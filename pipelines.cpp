@@ -0,0 +1,307 @@
+#include "pipelines.h"
+#include "meshes.h"
+#include <cassert>
+#include <mutex>
+
+PipelineKey get_compiled_pipeline_key(const VkContext *context, PipelineKey pipeline_key) {
+    assert(is_pipeline_key_valid(pipeline_key));
+    VkPrimitiveTopology primitive_topology = static_cast<VkPrimitiveTopology>(pipeline_key.primitive_topology);
+    VkPolygonMode polygon_mode = static_cast<VkPolygonMode>(pipeline_key.polygon_mode);
+    bool depth_test_enabled = pipeline_key.depth_test != 0;
+    if (context->extended_dynamic_state_supported) {
+        depth_test_enabled = true;
+        if (context->dynamic_primitive_topology_unrestricted) {
+            primitive_topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // 线保持LINE polygon mode，对线没有影响
+        } else if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
+            primitive_topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST; // 同属线类别
+        }
+    }
+    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST && context->dynamic_polygon_mode_supported) {
+        polygon_mode = VK_POLYGON_MODE_FILL;
+    }
+    return PipelineKey(make_pipeline_state_bits(primitive_topology, polygon_mode, depth_test_enabled), pipeline_key.shader_hash);
+}
+
+// 在worker上执行：只读context，pipeline cache由驱动内部同步。pipeline_key是折叠之后的key
+static VkPipeline compile_pipeline(VkContext *context, PipelineKey pipeline_key, const ShaderProgram &shader_program) {
+    assert(is_pipeline_key_valid(pipeline_key));
+    VkPrimitiveTopology primitive_topology = static_cast<VkPrimitiveTopology>(pipeline_key.primitive_topology);
+    VkPolygonMode polygon_mode = static_cast<VkPolygonMode>(pipeline_key.polygon_mode);
+    bool depth_test_enabled = pipeline_key.depth_test != 0;
+
+    VkVertexInputBindingDescription vertex_input_binding_description = {};
+    vertex_input_binding_description.binding = 0;
+    vertex_input_binding_description.stride = sizeof(Vertex);
+    vertex_input_binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+    std::vector<VkVertexInputAttributeDescription> vertex_input_attribute_descriptions = {};
+    {
+        VkVertexInputAttributeDescription vertex_input_attribute_description = {};
+        vertex_input_attribute_description.binding = 0;
+        vertex_input_attribute_description.location = 0;
+        vertex_input_attribute_description.format = VK_FORMAT_R32G32B32_SFLOAT;
+        vertex_input_attribute_description.offset = offsetof(Vertex, position);
+
+        vertex_input_attribute_descriptions.push_back(vertex_input_attribute_description);
+    }
+
+    VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info = {};
+    vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input_state_create_info.vertexBindingDescriptionCount = 1;
+    vertex_input_state_create_info.pVertexBindingDescriptions = &vertex_input_binding_description;
+    vertex_input_state_create_info.vertexAttributeDescriptionCount = vertex_input_attribute_descriptions.size();
+    vertex_input_state_create_info.pVertexAttributeDescriptions = vertex_input_attribute_descriptions.data();
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_state_create_info = {};
+    input_assembly_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_state_create_info.topology = primitive_topology;
+    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
+        input_assembly_state_create_info.primitiveRestartEnable = VK_TRUE;
+    }
+
+    VkPipelineRasterizationStateCreateInfo rasterization_state_create_info = {};
+    rasterization_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization_state_create_info.polygonMode = polygon_mode;
+    rasterization_state_create_info.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterization_state_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterization_state_create_info.lineWidth = 1.0f;
+
+    VkPipelineColorBlendAttachmentState color_blend_attachment_state = {};
+    color_blend_attachment_state.colorWriteMask =
+            VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    color_blend_attachment_state.blendEnable = VK_FALSE;
+
+    VkPipelineColorBlendStateCreateInfo color_blend_state_create_info = {};
+    color_blend_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blend_state_create_info.attachmentCount = 1;
+    color_blend_state_create_info.pAttachments = &color_blend_attachment_state;
+
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_state_create_info = {};
+    depth_stencil_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_state_create_info.depthTestEnable = depth_test_enabled ? VK_TRUE : VK_FALSE;
+    depth_stencil_state_create_info.depthWriteEnable = depth_test_enabled ? VK_TRUE : VK_FALSE;
+    depth_stencil_state_create_info.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    VkPipelineViewportStateCreateInfo viewport_state_create_info = {};
+    viewport_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state_create_info.viewportCount = 1;
+    viewport_state_create_info.scissorCount = 1;
+
+    VkPipelineMultisampleStateCreateInfo multisample_state_create_info = {};
+    multisample_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample_state_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkSpecializationMapEntry specialization_map_entries[] = {
+        {0, offsetof(ShaderVariant, camera_index), sizeof(uint32_t)},
+    };
+    VkSpecializationInfo specialization_info = {};
+    specialization_info.mapEntryCount = std::size(specialization_map_entries);
+    specialization_info.pMapEntries = specialization_map_entries;
+    specialization_info.dataSize = sizeof(ShaderVariant);
+    specialization_info.pData = &shader_program.variant;
+
+    VkPipelineShaderStageCreateInfo shader_stage_create_infos[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_VERTEX_BIT,
+            .module = shader_program.vertex_shader_module,
+            .pName = "main",
+            .pSpecializationInfo = &specialization_info,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .module = shader_program.fragment_shader_module,
+            .pName = "main",
+        },
+    };
+
+    // 与apply_pipeline_dynamic_states一致
+    std::vector<VkDynamicState> dynamic_states = {};
+    dynamic_states.emplace_back(VK_DYNAMIC_STATE_VIEWPORT);
+    dynamic_states.emplace_back(VK_DYNAMIC_STATE_SCISSOR);
+    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST || context->extended_dynamic_state_supported) {
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_CULL_MODE);
+    }
+    if (context->extended_dynamic_state_supported) {
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE);
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE);
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY);
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE);
+    }
+    if (context->dynamic_polygon_mode_supported) {
+        dynamic_states.emplace_back(VK_DYNAMIC_STATE_POLYGON_MODE_EXT);
+    }
+
+    VkPipelineDynamicStateCreateInfo dynamic_state_create_info = {};
+    dynamic_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state_create_info.dynamicStateCount = dynamic_states.size();
+    dynamic_state_create_info.pDynamicStates = dynamic_states.data();
+
+    VkGraphicsPipelineCreateInfo pipeline_create_info = {};
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_create_info.stageCount = std::size(shader_stage_create_infos);
+    pipeline_create_info.pStages = shader_stage_create_infos;
+    pipeline_create_info.pVertexInputState = &vertex_input_state_create_info;
+    pipeline_create_info.pInputAssemblyState = &input_assembly_state_create_info;
+    pipeline_create_info.pViewportState = &viewport_state_create_info;
+    pipeline_create_info.pRasterizationState = &rasterization_state_create_info;
+    pipeline_create_info.pMultisampleState = &multisample_state_create_info;
+    pipeline_create_info.pDepthStencilState = &depth_stencil_state_create_info;
+    pipeline_create_info.pColorBlendState = &color_blend_state_create_info;
+    pipeline_create_info.pDynamicState = &dynamic_state_create_info;
+    pipeline_create_info.layout = context->pipeline_layout;
+    pipeline_create_info.renderPass = context->render_pass;
+
+    VkPipeline pipeline;
+    VkResult result = vkCreateGraphicsPipelines(context->device, context->pipeline_cache, 1, &pipeline_create_info,
+                                                nullptr, &pipeline);
+    assert(result == VK_SUCCESS);
+    return pipeline;
+}
+
+void init_pipeline_manager(PipelineManager *pipeline_manager, VkContext *context, TaskSystem *task_system) {
+    pipeline_manager->context = context;
+    pipeline_manager->task_system = task_system;
+    assert(PipelineKey(VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, true, 0).state_bits ==
+           make_pipeline_state_bits(VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, true));
+}
+
+void cleanup_pipeline_manager(PipelineManager *pipeline_manager) {
+    wait_for_pipelines(pipeline_manager);
+    VkDevice device = pipeline_manager->context->device;
+    for (std::unique_ptr<ShaderProgram> &shader_program: pipeline_manager->shader_programs) {
+        for (PipelineEntry &entry: shader_program->pipelines) {
+            if (entry.status.load(std::memory_order_acquire) == PIPELINE_STATUS_READY) {
+                vkDestroyPipeline(device, entry.pipeline, nullptr);
+            }
+        }
+    }
+    pipeline_manager->shader_programs.clear(); // shader module由context持有
+}
+
+uint32_t register_shader_program(PipelineManager *pipeline_manager, const char *vertex_shader_filepath,
+                                 const char *fragment_shader_filepath, const ShaderVariant &variant) {
+    uint64_t vertex_code_hash = 0;
+    uint64_t fragment_code_hash = 0;
+    VkShaderModule vertex_shader_module = get_shader_module(pipeline_manager->context, vertex_shader_filepath, &vertex_code_hash);
+    VkShaderModule fragment_shader_module = get_shader_module(pipeline_manager->context, fragment_shader_filepath, &fragment_code_hash);
+    uint64_t hash = vertex_code_hash * 31 ^ fragment_code_hash;
+    hash = hash * 31 ^ variant.camera_index;
+    uint32_t shader_hash = static_cast<uint32_t>(hash ^ hash >> 32);
+
+    for (const std::unique_ptr<ShaderProgram> &shader_program: pipeline_manager->shader_programs) {
+        if (shader_program->shader_hash == shader_hash) {
+            // 32位的hash冲突时需要换一种折叠方式
+            assert(shader_program->vertex_shader_module == vertex_shader_module &&
+                   shader_program->fragment_shader_module == fragment_shader_module &&
+                   shader_program->variant.camera_index == variant.camera_index);
+            return shader_hash;
+        }
+    }
+    auto shader_program = std::make_unique<ShaderProgram>();
+    shader_program->shader_hash = shader_hash;
+    shader_program->vertex_shader_module = vertex_shader_module;
+    shader_program->fragment_shader_module = fragment_shader_module;
+    shader_program->variant = variant;
+    for (PipelineEntry &entry: shader_program->pipelines) {
+        entry.status.store(PIPELINE_STATUS_NOT_REQUESTED, std::memory_order_relaxed);
+        entry.pipeline = VK_NULL_HANDLE;
+    }
+    pipeline_manager->shader_programs.push_back(std::move(shader_program));
+    return shader_hash;
+}
+
+// shader program通常只有几个，线性查找
+static ShaderProgram *find_shader_program(PipelineManager *pipeline_manager, uint32_t shader_hash) {
+    for (const std::unique_ptr<ShaderProgram> &shader_program: pipeline_manager->shader_programs) {
+        if (shader_program->shader_hash == shader_hash) {
+            return shader_program.get();
+        }
+    }
+    return nullptr;
+}
+
+static void request_pipeline(PipelineManager *pipeline_manager, ShaderProgram *shader_program, uint32_t state_bits) {
+    assert(state_bits < PIPELINE_STATE_COUNT && pipeline_state_table[state_bits]);
+    PipelineEntry *entry = &shader_program->pipelines[state_bits];
+    uint32_t status = PIPELINE_STATUS_NOT_REQUESTED;
+    if (!entry->status.compare_exchange_strong(status, PIPELINE_STATUS_COMPILING, std::memory_order_relaxed)) {
+        return; // 已经在编译或已就绪
+    }
+
+    VkContext *context = pipeline_manager->context;
+    PipelineKey pipeline_key(state_bits, shader_program->shader_hash);
+    assert(get_compiled_pipeline_key(context, pipeline_key) == pipeline_key);
+    TaskHandle task_handle = push_task(pipeline_manager->task_system, [context, shader_program, entry, pipeline_key]() {
+        entry->pipeline = compile_pipeline(context, pipeline_key, *shader_program);
+        entry->status.store(PIPELINE_STATUS_READY, std::memory_order_release);
+    }, TASK_PRIORITY_BACKGROUND);
+
+    std::lock_guard<std::mutex> lock(pipeline_manager->compile_task_handles_mutex);
+    // 顺便丢掉已经完成的任务句柄
+    std::vector<TaskHandle> &compile_task_handles = pipeline_manager->compile_task_handles;
+    std::erase_if(compile_task_handles, [pipeline_manager](TaskHandle task_handle) {
+        return is_task_complete(pipeline_manager->task_system, task_handle);
+    });
+    compile_task_handles.push_back(task_handle);
+}
+
+void request_pipeline(PipelineManager *pipeline_manager, PipelineKey pipeline_key) {
+    ShaderProgram *shader_program = find_shader_program(pipeline_manager, pipeline_key.shader_hash);
+    assert(shader_program != nullptr); // 先register_shader_program
+    request_pipeline(pipeline_manager, shader_program, get_compiled_pipeline_key(pipeline_manager->context, pipeline_key).state_bits);
+}
+
+void prewarm_pipelines(PipelineManager *pipeline_manager, uint32_t shader_hash) {
+    ShaderProgram *shader_program = find_shader_program(pipeline_manager, shader_hash);
+    assert(shader_program != nullptr);
+    // 扩展动态状态下多个组合折叠成同一个pipeline，只编译一次
+    for (uint32_t state_bits: pipeline_permutations) {
+        PipelineKey pipeline_key = get_compiled_pipeline_key(pipeline_manager->context, PipelineKey(state_bits, shader_hash));
+        request_pipeline(pipeline_manager, shader_program, pipeline_key.state_bits);
+    }
+}
+
+void wait_for_pipelines(PipelineManager *pipeline_manager) {
+    std::vector<TaskHandle> compile_task_handles;
+    {
+        std::lock_guard<std::mutex> lock(pipeline_manager->compile_task_handles_mutex);
+        compile_task_handles.swap(pipeline_manager->compile_task_handles);
+    }
+    for (TaskHandle task_handle: compile_task_handles) {
+        wait_task(pipeline_manager->task_system, task_handle);
+    }
+}
+
+static VkPipeline get_ready_pipeline(const ShaderProgram *shader_program, uint32_t state_bits) {
+    const PipelineEntry &entry = shader_program->pipelines[state_bits];
+    return entry.status.load(std::memory_order_acquire) == PIPELINE_STATUS_READY ? entry.pipeline : VK_NULL_HANDLE;
+}
+
+VkPipeline get_pipeline(PipelineManager *pipeline_manager, PipelineKey requested_pipeline_key, bool *fallback) {
+    PipelineKey pipeline_key = get_compiled_pipeline_key(pipeline_manager->context, requested_pipeline_key);
+    *fallback = false;
+    ShaderProgram *shader_program = find_shader_program(pipeline_manager, pipeline_key.shader_hash);
+    assert(shader_program != nullptr);
+    if (VkPipeline pipeline = get_ready_pipeline(shader_program, pipeline_key.state_bits); pipeline != VK_NULL_HANDLE) {
+        return pipeline;
+    }
+    request_pipeline(pipeline_manager, shader_program, pipeline_key.state_bits);
+
+    // 依次放宽深度测试、polygon mode；topology和shader不同的pipeline顶点输入不兼容，不能代替
+    *fallback = true;
+    PipelineKey depth_test_toggled = pipeline_key;
+    depth_test_toggled.depth_test ^= 1;
+    PipelineKey candidates[] = {depth_test_toggled, pipeline_key, depth_test_toggled};
+    candidates[1].polygon_mode = candidates[2].polygon_mode =
+            pipeline_key.polygon_mode == VK_POLYGON_MODE_FILL ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
+    for (PipelineKey candidate: candidates) {
+        if (!is_pipeline_key_valid(candidate)) { continue; }
+        candidate = get_compiled_pipeline_key(pipeline_manager->context, candidate);
+        if (VkPipeline pipeline = get_ready_pipeline(shader_program, candidate.state_bits); pipeline != VK_NULL_HANDLE) {
+            return pipeline;
+        }
+    }
+    return VK_NULL_HANDLE;
+}
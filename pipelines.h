@@ -0,0 +1,139 @@
+#pragma once
+
+#include "tasks.h"
+#include "vk.h"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define PIPELINE_STATE_BITS 8 // PipelineKey::state_bits用到的位数，和DRAW_KEY_PIPELINE_BITS一致
+#define PIPELINE_STATE_COUNT (1u << PIPELINE_STATE_BITS)
+#define SHADER_VARIANT_CAMERA_PER_INSTANCE UINT32_MAX // 与triangle.vert中CAMERA_INDEX的默认值一致
+
+// 与PipelineKey的位域布局一致（init_pipeline_manager中检查）
+constexpr uint32_t make_pipeline_state_bits(VkPrimitiveTopology primitive_topology, VkPolygonMode polygon_mode,
+                                            bool depth_test_enabled) {
+    return static_cast<uint32_t>(primitive_topology) | static_cast<uint32_t>(polygon_mode) << 5 |
+           (depth_test_enabled ? 1u : 0u) << 7;
+}
+
+// 线（line list/strip）只能用LINE polygon mode
+constexpr bool is_pipeline_state_valid(VkPrimitiveTopology primitive_topology, VkPolygonMode polygon_mode) {
+    switch (primitive_topology) {
+        case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST:
+            return polygon_mode == VK_POLYGON_MODE_FILL || polygon_mode == VK_POLYGON_MODE_LINE;
+        case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+        case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+            return polygon_mode == VK_POLYGON_MODE_LINE;
+        default:
+            return false;
+    }
+}
+
+// 一个状态组合，非法组合在编译期报错
+template<VkPrimitiveTopology PrimitiveTopology, VkPolygonMode PolygonMode, bool DepthTestEnabled>
+struct PipelinePermutation {
+    static_assert(is_pipeline_state_valid(PrimitiveTopology, PolygonMode), "invalid pipeline state combination");
+    static constexpr uint32_t state_bits = make_pipeline_state_bits(PrimitiveTopology, PolygonMode, DepthTestEnabled);
+};
+
+template<typename... Permutations>
+constexpr std::array<uint32_t, sizeof...(Permutations)> make_pipeline_permutations() {
+    return {Permutations::state_bits...};
+}
+
+// 所有shader program都预编译的状态组合，按这个顺序提交编译
+inline constexpr auto pipeline_permutations = make_pipeline_permutations<
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_FILL, true>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_FILL, false>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_LINE, true>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_LINE, false>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_LINE_LIST, VK_POLYGON_MODE_LINE, true>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_LINE_LIST, VK_POLYGON_MODE_LINE, false>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, true>,
+    PipelinePermutation<VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, false>>();
+
+// 按state_bits索引：是否在pipeline_permutations中
+inline constexpr std::array<bool, PIPELINE_STATE_COUNT> pipeline_state_table = [] {
+    std::array<bool, PIPELINE_STATE_COUNT> table = {};
+    for (uint32_t state_bits: pipeline_permutations) {
+        table[state_bits] = true;
+    }
+    return table;
+}();
+
+static_assert([] {
+    uint32_t count = 0;
+    for (bool valid: pipeline_state_table) { count += valid ? 1 : 0; }
+    return count == pipeline_permutations.size();
+}(), "duplicate pipeline permutation");
+
+enum PipelineStatus {
+    PIPELINE_STATUS_NOT_REQUESTED,
+    PIPELINE_STATUS_COMPILING,
+    PIPELINE_STATUS_READY,
+};
+
+// 编译任务在worker上写入pipeline后把status置为READY
+struct PipelineEntry {
+    std::atomic<uint32_t> status;
+    VkPipeline pipeline; // READY之后才能读
+};
+
+// 编译pipeline时通过specialization constant固定的shader参数，驱动可以据此去掉分支和用不到的读取。
+// 成员依次对应constant_id 0, 1, ...
+struct ShaderVariant {
+    uint32_t camera_index; // 所有实例都用这个相机，SHADER_VARIANT_CAMERA_PER_INSTANCE时读取InstanceData::camera_index
+};
+
+// 一组graphics shader及其变体，PipelineKey::shader_hash指向它；它的所有pipeline按state_bits平铺
+struct ShaderProgram {
+    uint32_t shader_hash;
+    VkShaderModule vertex_shader_module;
+    VkShaderModule fragment_shader_module;
+    ShaderVariant variant;
+    PipelineEntry pipelines[PIPELINE_STATE_COUNT];
+};
+
+// 按PipelineKey管理graphics pipeline：启动时在worker上并行编译所有状态组合，
+// 之后遇到还没编译的key在后台编译，编译完成之前用状态相近的已就绪pipeline代替
+struct PipelineManager {
+    VkContext *context;
+    TaskSystem *task_system;
+    std::vector<std::unique_ptr<ShaderProgram>> shader_programs; // 只在开始录制之前注册，之后只读，查找不需要加锁
+    std::mutex compile_task_handles_mutex;
+    std::vector<TaskHandle> compile_task_handles; // 未完成的编译任务
+};
+
+void init_pipeline_manager(PipelineManager *pipeline_manager, VkContext *context, TaskSystem *task_system);
+
+// 等待所有编译任务后销毁pipeline，在task system停止之前调用
+void cleanup_pipeline_manager(PipelineManager *pipeline_manager);
+
+// 只在主线程、开始录制之前调用，返回作为PipelineKey::shader_hash的值（由两个SPIR-V的内容和变体得到，重启后不变）。
+// 同一组shader的不同变体是不同的shader program
+uint32_t register_shader_program(PipelineManager *pipeline_manager, const char *vertex_shader_filepath,
+                                 const char *fragment_shader_filepath, const ShaderVariant &variant);
+
+inline bool is_pipeline_key_valid(PipelineKey pipeline_key) {
+    return pipeline_key.state_bits < PIPELINE_STATE_COUNT && pipeline_state_table[pipeline_key.state_bits];
+}
+
+// 实际编译的pipeline：设备支持扩展动态状态时，动态设置的状态折叠成固定值，多个key共用一个pipeline，
+// 录制时由apply_pipeline_dynamic_states按原来的key设置。不支持时原样返回，每种组合一个pipeline
+PipelineKey get_compiled_pipeline_key(const VkContext *context, PipelineKey pipeline_key);
+
+// 线程安全：key还没有编译过时提交一个后台编译任务
+void request_pipeline(PipelineManager *pipeline_manager, PipelineKey pipeline_key);
+
+// 为shader program提交pipeline_permutations中所有组合的编译任务，并行编译
+void prewarm_pipelines(PipelineManager *pipeline_manager, uint32_t shader_hash);
+
+// 等待此前提交的编译任务全部完成
+void wait_for_pipelines(PipelineManager *pipeline_manager);
+
+// 线程安全，不会阻塞等待编译：key已就绪时直接返回；否则请求编译，并返回同一shader和topology下
+// 深度测试或polygon mode不同的已就绪pipeline（*fallback置为true）；都没有时返回VK_NULL_HANDLE
+VkPipeline get_pipeline(PipelineManager *pipeline_manager, PipelineKey pipeline_key, bool *fallback);
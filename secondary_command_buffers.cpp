@@ -0,0 +1,92 @@
+#include "secondary_command_buffers.h"
+#include <cassert>
+
+static void begin_secondary(VkCommandBuffer command_buffer, VkRenderPass render_pass, VkFramebuffer framebuffer,
+                            VkCommandBufferUsageFlags usage_flags) {
+    VkCommandBufferInheritanceInfo command_buffer_inheritance_info = {};
+    command_buffer_inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    command_buffer_inheritance_info.renderPass = render_pass;
+    command_buffer_inheritance_info.subpass = 0;
+    command_buffer_inheritance_info.framebuffer = framebuffer;
+
+    VkCommandBufferBeginInfo command_buffer_begin_info = {};
+    command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    command_buffer_begin_info.flags = usage_flags | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    command_buffer_begin_info.pInheritanceInfo = &command_buffer_inheritance_info;
+    VkResult result = vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info);
+    assert(result == VK_SUCCESS);
+}
+
+void init_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context,
+                                    uint32_t frame_count, uint32_t worker_count) {
+    secondary_command_buffers->worker_count = worker_count;
+    secondary_command_buffers->pools = std::vector<SecondaryCommandPool>(frame_count * worker_count);
+    for (SecondaryCommandPool &pool: secondary_command_buffers->pools) {
+        VkCommandPoolCreateInfo command_pool_create_info = {};
+        command_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        command_pool_create_info.queueFamilyIndex = context->queue_family_index;
+        VkResult result = vkCreateCommandPool(context->device, &command_pool_create_info, nullptr,
+                                              &pool.command_pool);
+        assert(result == VK_SUCCESS);
+        pool.used_count = 0;
+    }
+}
+
+void cleanup_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context) {
+    for (SecondaryCommandPool &pool: secondary_command_buffers->pools) {
+        // 销毁pool会一并释放从它分配的command buffer
+        vkDestroyCommandPool(context->device, pool.command_pool, nullptr);
+    }
+    secondary_command_buffers->pools.clear();
+}
+
+void reset_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context,
+                                     uint32_t frame_index) {
+    for (uint32_t i = 0; i < secondary_command_buffers->worker_count; ++i) {
+        SecondaryCommandPool &pool = secondary_command_buffers->pools[frame_index * secondary_command_buffers->worker_count + i];
+        if (pool.used_count == 0) {
+            continue;
+        }
+        VkResult result = vkResetCommandPool(context->device, pool.command_pool, 0);
+        assert(result == VK_SUCCESS);
+        pool.used_count = 0;
+    }
+}
+
+VkCommandBuffer begin_secondary_command_buffer(SecondaryCommandBuffers *secondary_command_buffers,
+                                               VkContext *context, uint32_t frame_index, uint32_t worker_index,
+                                               VkRenderPass render_pass, VkFramebuffer framebuffer) {
+    assert(worker_index < secondary_command_buffers->worker_count);
+    SecondaryCommandPool &pool = secondary_command_buffers->pools[frame_index * secondary_command_buffers->worker_count + worker_index];
+    if (pool.used_count == pool.command_buffers.size()) {
+        VkCommandBufferAllocateInfo command_buffer_allocate_info = {};
+        command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        command_buffer_allocate_info.commandPool = pool.command_pool;
+        command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        command_buffer_allocate_info.commandBufferCount = 1;
+        VkCommandBuffer command_buffer;
+        VkResult result = vkAllocateCommandBuffers(context->device, &command_buffer_allocate_info, &command_buffer);
+        assert(result == VK_SUCCESS);
+        pool.command_buffers.push_back(command_buffer);
+    }
+    VkCommandBuffer command_buffer = pool.command_buffers[pool.used_count++];
+    begin_secondary(command_buffer, render_pass, framebuffer, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    return command_buffer;
+}
+
+VkCommandBuffer allocate_reusable_secondary_command_buffer(VkContext *context) {
+    VkCommandBufferAllocateInfo command_buffer_allocate_info = {};
+    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_allocate_info.commandPool = context->command_pool;
+    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    command_buffer_allocate_info.commandBufferCount = 1;
+    VkCommandBuffer command_buffer;
+    VkResult result = vkAllocateCommandBuffers(context->device, &command_buffer_allocate_info, &command_buffer);
+    assert(result == VK_SUCCESS);
+    return command_buffer;
+}
+
+void begin_reusable_secondary_command_buffer(VkContext *context, VkCommandBuffer command_buffer, VkRenderPass render_pass) {
+    begin_secondary(command_buffer, render_pass, VK_NULL_HANDLE, 0);
+}
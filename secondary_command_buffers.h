@@ -0,0 +1,38 @@
+#pragma once
+
+#include "vk.h"
+#include <vector>
+
+// 一个worker在一帧内使用的command pool，已分配的secondary command buffer在reset后复用
+struct alignas(64) SecondaryCommandPool {
+    VkCommandPool command_pool;
+    std::vector<VkCommandBuffer> command_buffers;
+    uint32_t used_count;
+};
+
+// 每帧每个worker一个command pool：worker只访问自己的pool，录制时不需要加锁；该帧的fence等到之后整体reset
+struct SecondaryCommandBuffers {
+    uint32_t worker_count;
+    std::vector<SecondaryCommandPool> pools; // [frame_index * worker_count + worker_index]
+};
+
+void init_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context,
+                                    uint32_t frame_count, uint32_t worker_count);
+
+void cleanup_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context);
+
+// 在该帧的fence等到之后、分发录制任务之前调用
+void reset_secondary_command_buffers(SecondaryCommandBuffers *secondary_command_buffers, VkContext *context,
+                                     uint32_t frame_index);
+
+// 在worker线程上调用，返回已begin、继承render_pass的secondary command buffer，录制完由调用方end
+VkCommandBuffer begin_secondary_command_buffer(SecondaryCommandBuffers *secondary_command_buffers,
+                                               VkContext *context, uint32_t frame_index, uint32_t worker_index,
+                                               VkRenderPass render_pass, VkFramebuffer framebuffer);
+
+// 从context的command pool分配一个可以重复提交的secondary command buffer，只在主线程上使用
+VkCommandBuffer allocate_reusable_secondary_command_buffer(VkContext *context);
+
+// 开始录制可重复提交的secondary command buffer：不指定framebuffer，可以在任一兼容的render pass中执行。
+// 重新begin会隐式reset，调用方需保证之前的提交已经完成
+void begin_reusable_secondary_command_buffer(VkContext *context, VkCommandBuffer command_buffer, VkRenderPass render_pass);
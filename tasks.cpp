@@ -1,50 +1,506 @@
 #include "tasks.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 
-void start(TaskSystem *task_system) {
-    // start a thread to listen to the task queue and execute the tasks
-    task_system->worker_thread = std::thread([task_system]() {
-        while (true) {
-            std::function<void()> task;
-            {
-                // wait for a task to be available
-               std::unique_lock<std::mutex> lock(task_system->tasks_mutex);
-               task_system->tasks_condition_variable.wait(lock, [task_system]() {
-                   return task_system->request_stop || !task_system->tasks.empty();
-               });
-               if (task_system->request_stop && task_system->tasks.empty()) {
-                   break; // all tasks are executed
-               }
-               task = task_system->tasks.front();
-               task_system->tasks.pop();
+static thread_local TaskSystem *current_task_system = nullptr;
+static thread_local uint32_t current_worker_index = UINT32_MAX;
+static thread_local uint32_t scheduled_node_count = 0;
+
+void init_task_queue(TaskQueue *task_queue, size_t capacity) {
+    assert(capacity >= 2 && (capacity & (capacity - 1)) == 0); // capacity must be a power of two
+    task_queue->cells = std::make_unique<TaskQueueCell[]>(capacity);
+    task_queue->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; ++i) {
+        task_queue->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    task_queue->enqueue_position.store(0, std::memory_order_relaxed);
+    task_queue->dequeue_position.store(0, std::memory_order_relaxed);
+}
+
+bool try_push_task_queue(TaskQueue *task_queue, uint32_t node_index) {
+    size_t position = task_queue->enqueue_position.load(std::memory_order_relaxed);
+    while (true) {
+        TaskQueueCell &cell = task_queue->cells[position & task_queue->mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) position;
+        if (diff == 0) {
+            // the cell is free, try to claim it
+            if (task_queue->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.node_index = node_index;
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
             }
-            // execute the task
-            task();
+        } else if (diff < 0) {
+            return false; // the queue is full
+        } else {
+            position = task_queue->enqueue_position.load(std::memory_order_relaxed);
         }
-    });
+    }
 }
 
-void stop(TaskSystem *task_system) {
-    // wait all tasks to be executed
+bool try_pop_task_queue(TaskQueue *task_queue, uint32_t *node_index) {
+    size_t position = task_queue->dequeue_position.load(std::memory_order_relaxed);
+    while (true) {
+        TaskQueueCell &cell = task_queue->cells[position & task_queue->mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) (position + 1);
+        if (diff == 0) {
+            // the cell is filled, try to claim it
+            if (task_queue->dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                *node_index = cell.node_index;
+                cell.sequence.store(position + task_queue->mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // the queue is empty
+        } else {
+            position = task_queue->dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static uint64_t get_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool pop_node(TaskWorker *worker, TaskPriority priority, uint32_t *node_index) {
+    std::lock_guard<std::mutex> lock(worker->node_indices_mutex);
+    std::deque<uint32_t> &node_indices = worker->node_indices[priority];
+    if (node_indices.empty()) {
+        return false;
+    }
+    *node_index = node_indices.back(); // 自己的队列从尾部取
+    node_indices.pop_back();
+    return true;
+}
+
+static bool steal_node(TaskSystem *task_system, uint32_t worker_index, TaskPriority priority, uint32_t *node_index) {
+    uint32_t worker_count = static_cast<uint32_t>(task_system->workers.size());
+    for (uint32_t i = 1; i < worker_count; ++i) {
+        TaskWorker *victim = task_system->workers[(worker_index + i) % worker_count].get();
+        std::lock_guard<std::mutex> lock(victim->node_indices_mutex);
+        std::deque<uint32_t> &node_indices = victim->node_indices[priority];
+        if (!node_indices.empty()) {
+            *node_index = node_indices.front(); // 从其他worker的队列头部窃取
+            node_indices.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+// 按优先级从高到低查找：每个lane依次尝试自己的队列、提交队列、窃取
+static bool find_node(TaskSystem *task_system, uint32_t worker_index, uint32_t *node_index) {
+    TaskWorker *worker = task_system->workers[worker_index].get();
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        TaskPriority priority = static_cast<TaskPriority>(i);
+        // queue_depth在入队之前递增，为0说明这个lane肯定没有任务，跳过以免空闲时反复加锁窃取
+        if (task_system->lane_counters[priority].queue_depth.load() <= 0) {
+            continue;
+        }
+        if (pop_node(worker, priority, node_index) ||
+            try_pop_task_queue(&task_system->submission_queues[priority], node_index) ||
+            steal_node(task_system, worker_index, priority, node_index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 从sleeping_worker_count中认领一个睡眠的worker；认领成功的一方负责唤醒它
+static bool claim_sleeping_worker(TaskSystem *task_system) {
+    uint32_t sleeping_worker_count = task_system->sleeping_worker_count.load();
+    while (sleeping_worker_count > 0) {
+        if (task_system->sleeping_worker_count.compare_exchange_weak(sleeping_worker_count, sleeping_worker_count - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void wake_workers(TaskSystem *task_system) {
+    // pairs with the sleeping_worker_count increment in run_worker: either we see the sleeper, or it sees the task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (claim_sleeping_worker(task_system)) {
+        task_system->wake_epoch.fetch_add(1);
+        task_system->wake_epoch.notify_one();
+    }
+}
+
+// 将依赖已全部满足的节点放入其优先级对应的队列
+static void schedule_node(TaskSystem *task_system, uint32_t node_index) {
+    TaskNode &node = task_system->nodes[node_index];
+    TaskPriority priority = node.priority;
+    bool sampled = (++scheduled_node_count & (TASK_WAIT_TIME_SAMPLE_INTERVAL - 1)) == 0;
+    node.ready_time_ns = sampled ? get_time_ns() : 0;
+    task_system->lane_counters[priority].queue_depth.fetch_add(1);
+    uint32_t worker_index = get_current_worker_index(task_system);
+    if (worker_index == UINT32_MAX) {
+        // not a worker thread, submit through the lock-free queue
+        if (try_push_task_queue(&task_system->submission_queues[priority], node_index)) {
+            wake_workers(task_system);
+            return;
+        }
+        // the submission queue is full, spill into a worker deque
+        worker_index = task_system->next_worker_index.fetch_add(1) % task_system->workers.size();
+    }
     {
-        std::lock_guard<std::mutex> lock(task_system->tasks_mutex);
-        if (task_system->request_stop) {
+        TaskWorker *worker = task_system->workers[worker_index].get();
+        std::lock_guard<std::mutex> lock(worker->node_indices_mutex);
+        worker->node_indices[priority].push_back(node_index);
+    }
+    wake_workers(task_system);
+}
+
+static void release_node(TaskSystem *task_system, uint32_t node_index) {
+    TaskNode &node = task_system->nodes[node_index];
+    uint64_t head = task_system->free_node_head.load();
+    while (true) {
+        node.next_free_node_index.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (task_system->free_node_head.compare_exchange_weak(head, (tag << 32) | node_index)) {
+            task_system->free_node_count.fetch_add(1);
+            // pairs with the node_waiter_count increment in acquire_node: either we see the waiter, or it sees the count
+            if (task_system->node_waiter_count.load() > 0) {
+                task_system->free_node_count.notify_all();
+            }
             return;
         }
-        task_system->request_stop = true;
     }
-    task_system->tasks_condition_variable.notify_all();
-    if (task_system->worker_thread.joinable()) {
-        task_system->worker_thread.join(); // wait for the worker thread to finish
+}
+
+static bool try_acquire_node(TaskSystem *task_system, int32_t reserve, uint32_t *node_index) {
+    if (task_system->free_node_count.load() <= reserve) {
+        return false;
+    }
+    uint64_t head = task_system->free_node_head.load();
+    while (static_cast<uint32_t>(head) != INVALID_TASK_NODE_INDEX) {
+        uint32_t index = static_cast<uint32_t>(head);
+        uint32_t next = task_system->nodes[index].next_free_node_index.load(std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (task_system->free_node_head.compare_exchange_weak(head, (tag << 32) | next)) {
+            task_system->free_node_count.fetch_sub(1);
+            *node_index = index;
+            return true;
+        }
     }
+    return false;
 }
 
-void push_task(TaskSystem *task_system, std::function<void()> &&task) {
-    {
-        std::lock_guard<std::mutex> lock(task_system->tasks_mutex);
-        if (task_system->request_stop) {
+static void release_continuation_block(TaskSystem *task_system, uint32_t block_index) {
+    TaskContinuationBlock &block = task_system->continuation_blocks[block_index];
+    uint64_t head = task_system->free_continuation_block_head.load();
+    while (true) {
+        block.next_free_block_index.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (task_system->free_continuation_block_head.compare_exchange_weak(head, (tag << 32) | block_index)) {
             return;
         }
-        task_system->tasks.emplace(std::move(task));
     }
-    task_system->tasks_condition_variable.notify_one();
+}
+
+static bool try_acquire_continuation_block(TaskSystem *task_system, uint32_t *block_index) {
+    uint64_t head = task_system->free_continuation_block_head.load();
+    while (static_cast<uint32_t>(head) != INVALID_TASK_CONTINUATION_BLOCK_INDEX) {
+        uint32_t index = static_cast<uint32_t>(head);
+        uint32_t next = task_system->continuation_blocks[index].next_free_block_index.load(std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        if (task_system->free_continuation_block_head.compare_exchange_weak(head, (tag << 32) | next)) {
+            *block_index = index;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 依赖完成：递减后继的依赖计数，减到0则调度
+static void release_continuation(TaskSystem *task_system, uint32_t node_index) {
+    if (task_system->nodes[node_index].dependency_count.fetch_sub(1) == 1) {
+        schedule_node(task_system, node_index);
+    }
+}
+
+static void run_node(TaskSystem *task_system, uint32_t node_index) {
+    TaskNode &node = task_system->nodes[node_index];
+    TaskLaneCounters &lane_counters = task_system->lane_counters[node.priority];
+    lane_counters.queue_depth.fetch_sub(1);
+    lane_counters.executed_count.fetch_add(1, std::memory_order_relaxed);
+    if (node.ready_time_ns != 0) {
+        uint64_t wait_ns = get_time_ns() - node.ready_time_ns;
+        lane_counters.sampled_count.fetch_add(1, std::memory_order_relaxed);
+        lane_counters.total_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+        uint64_t max_wait_ns = lane_counters.max_wait_ns.load(std::memory_order_relaxed);
+        while (wait_ns > max_wait_ns &&
+               !lane_counters.max_wait_ns.compare_exchange_weak(max_wait_ns, wait_ns, std::memory_order_relaxed)) {}
+    }
+
+    // execute the task
+    node.task();
+    node.task.reset();
+
+    // 完成：递增generation使旧句柄失效，并取出后继任务；之后不会再有后继加入，溢出块可以在锁外遍历
+    uint32_t continuation_count;
+    uint32_t continuations[MAX_TASK_CONTINUATIONS];
+    uint32_t continuation_block_index;
+    while (node.continuations_lock.test_and_set(std::memory_order_acquire)) {}
+    continuation_count = node.continuation_count;
+    std::copy_n(node.continuations, continuation_count, continuations);
+    continuation_block_index = node.continuation_block_index;
+    node.continuation_count = 0;
+    node.continuation_block_index = INVALID_TASK_CONTINUATION_BLOCK_INDEX;
+    node.generation.fetch_add(1, std::memory_order_release);
+    node.continuations_lock.clear(std::memory_order_release);
+    node.generation.notify_all();
+    release_node(task_system, node_index);
+
+    for (uint32_t i = 0; i < continuation_count; ++i) {
+        release_continuation(task_system, continuations[i]);
+    }
+    while (continuation_block_index != INVALID_TASK_CONTINUATION_BLOCK_INDEX) {
+        TaskContinuationBlock &block = task_system->continuation_blocks[continuation_block_index];
+        for (uint32_t i = 0; i < block.continuation_count; ++i) {
+            release_continuation(task_system, block.continuations[i]);
+        }
+        uint32_t next_block_index = block.next_block_index;
+        release_continuation_block(task_system, continuation_block_index);
+        continuation_block_index = next_block_index;
+    }
+}
+
+// 节点池耗尽时（极少发生）等待其他任务完成；worker线程直接帮忙执行，外部线程睡眠直到有节点归还。
+// 外部线程不能动用为worker保留的节点，否则执行中的任务可能因提交后续任务拿不到节点而全部卡住
+static uint32_t acquire_node(TaskSystem *task_system) {
+    uint32_t worker_index = get_current_worker_index(task_system);
+    uint32_t node_index;
+    if (worker_index != UINT32_MAX) {
+        while (!try_acquire_node(task_system, 0, &node_index)) {
+            uint32_t other_node_index;
+            if (find_node(task_system, worker_index, &other_node_index)) {
+                run_node(task_system, other_node_index);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        return node_index;
+    }
+    if (try_acquire_node(task_system, TASK_NODE_WORKER_RESERVE, &node_index)) {
+        return node_index;
+    }
+    task_system->node_waiter_count.fetch_add(1);
+    while (true) {
+        int32_t free_node_count = task_system->free_node_count.load();
+        if (free_node_count > TASK_NODE_WORKER_RESERVE) {
+            if (try_acquire_node(task_system, TASK_NODE_WORKER_RESERVE, &node_index)) {
+                break;
+            }
+            continue; // another thread took it
+        }
+        task_system->free_node_count.wait(free_node_count);
+    }
+    task_system->node_waiter_count.fetch_sub(1);
+    return node_index;
+}
+
+// 溢出块池耗尽时同acquire_node：worker帮忙执行任务，外部线程等待其他任务完成归还
+static uint32_t acquire_continuation_block(TaskSystem *task_system) {
+    uint32_t worker_index = get_current_worker_index(task_system);
+    uint32_t block_index;
+    while (!try_acquire_continuation_block(task_system, &block_index)) {
+        uint32_t other_node_index;
+        if (worker_index != UINT32_MAX && find_node(task_system, worker_index, &other_node_index)) {
+            run_node(task_system, other_node_index);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    return block_index;
+}
+
+// 将node_index注册为dependency的后继；dependency已完成则返回false。
+// 内联数组满了之后放进溢出块，后继数没有上限；新块在锁外申请，因为申请时可能要帮忙执行任务
+static bool add_continuation(TaskSystem *task_system, TaskHandle dependency, uint32_t node_index) {
+    if (dependency.node_index == INVALID_TASK_NODE_INDEX) {
+        return false;
+    }
+    TaskNode &node = task_system->nodes[dependency.node_index];
+    uint32_t spare_block_index = INVALID_TASK_CONTINUATION_BLOCK_INDEX;
+    bool added = false;
+    while (true) {
+        while (node.continuations_lock.test_and_set(std::memory_order_acquire)) {}
+        if (node.generation.load(std::memory_order_relaxed) != dependency.generation) {
+            break; // the dependency has already completed
+        }
+        if (node.continuation_count < MAX_TASK_CONTINUATIONS) {
+            node.continuations[node.continuation_count++] = node_index;
+            added = true;
+            break;
+        }
+        uint32_t block_index = node.continuation_block_index;
+        if (block_index != INVALID_TASK_CONTINUATION_BLOCK_INDEX &&
+            task_system->continuation_blocks[block_index].continuation_count < TASK_CONTINUATION_BLOCK_SIZE) {
+            TaskContinuationBlock &block = task_system->continuation_blocks[block_index];
+            block.continuations[block.continuation_count++] = node_index;
+            added = true;
+            break;
+        }
+        if (spare_block_index != INVALID_TASK_CONTINUATION_BLOCK_INDEX) {
+            // link a new block in front of the full one
+            TaskContinuationBlock &block = task_system->continuation_blocks[spare_block_index];
+            block.continuation_count = 1;
+            block.continuations[0] = node_index;
+            block.next_block_index = block_index;
+            node.continuation_block_index = spare_block_index;
+            spare_block_index = INVALID_TASK_CONTINUATION_BLOCK_INDEX;
+            added = true;
+            break;
+        }
+        node.continuations_lock.clear(std::memory_order_release);
+        spare_block_index = acquire_continuation_block(task_system);
+    }
+    node.continuations_lock.clear(std::memory_order_release);
+    if (spare_block_index != INVALID_TASK_CONTINUATION_BLOCK_INDEX) {
+        release_continuation_block(task_system, spare_block_index); // not needed after all
+    }
+    return added;
+}
+
+static void run_worker(TaskSystem *task_system, uint32_t worker_index) {
+    current_task_system = task_system;
+    current_worker_index = worker_index;
+    while (true) {
+        uint32_t node_index;
+        if (find_node(task_system, worker_index, &node_index)) {
+            run_node(task_system, node_index);
+            continue;
+        }
+        if (task_system->request_stop) {
+            break; // all tasks are executed
+        }
+        // announce that we are about to sleep, then look once more so a concurrent push can't be missed
+        task_system->sleeping_worker_count.fetch_add(1);
+        uint32_t wake_epoch = task_system->wake_epoch.load();
+        if (find_node(task_system, worker_index, &node_index)) {
+            claim_sleeping_worker(task_system); // withdraw, unless a pusher already claimed us
+            run_node(task_system, node_index);
+            continue;
+        }
+        if (!task_system->request_stop) {
+            // wait for a task to be available; whoever wakes us has already removed us from the sleeping count
+            task_system->wake_epoch.wait(wake_epoch);
+        }
+    }
+}
+
+void start(TaskSystem *task_system) {
+    uint32_t worker_count = task_system->worker_count;
+    if (worker_count == 0) {
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    task_system->nodes = std::make_unique<TaskNode[]>(MAX_TASK_NODES);
+    task_system->free_node_head.store(INVALID_TASK_NODE_INDEX);
+    for (uint32_t i = MAX_TASK_NODES; i > 0; --i) {
+        task_system->nodes[i - 1].continuation_block_index = INVALID_TASK_CONTINUATION_BLOCK_INDEX;
+        release_node(task_system, i - 1);
+    }
+    task_system->continuation_blocks = std::make_unique<TaskContinuationBlock[]>(MAX_TASK_CONTINUATION_BLOCKS);
+    task_system->free_continuation_block_head.store(INVALID_TASK_CONTINUATION_BLOCK_INDEX);
+    for (uint32_t i = MAX_TASK_CONTINUATION_BLOCKS; i > 0; --i) {
+        release_continuation_block(task_system, i - 1);
+    }
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        init_task_queue(&task_system->submission_queues[i], TASK_QUEUE_CAPACITY);
+    }
+    task_system->workers.resize(worker_count);
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        task_system->workers[i] = std::make_unique<TaskWorker>();
+    }
+    // start the threads only after all workers exist, since any of them may be stolen from
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        task_system->workers[i]->thread = std::thread(run_worker, task_system, i);
+    }
+}
+
+void stop(TaskSystem *task_system) {
+    // wait all tasks to be executed
+    if (task_system->request_stop.exchange(true)) {
+        return;
+    }
+    task_system->wake_epoch.fetch_add(1);
+    task_system->wake_epoch.notify_all();
+    for (auto &worker: task_system->workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join(); // wait for the worker thread to finish
+        }
+    }
+    task_system->workers.clear();
+}
+
+TaskHandle push_task(TaskSystem *task_system, Task &&task, TaskPriority priority, const TaskHandle *dependencies,
+                     uint32_t dependency_count) {
+    if (get_current_worker_index(task_system) == UINT32_MAX && task_system->request_stop) {
+        return {}; // tasks pushed by running tasks are still accepted so that stop() can drain them
+    }
+    uint32_t node_index = acquire_node(task_system);
+    TaskNode &node = task_system->nodes[node_index];
+    node.task = std::move(task);
+    node.priority = priority;
+    TaskHandle task_handle = {node_index, node.generation.load(std::memory_order_relaxed)};
+
+    // 提交期间多持有一个计数，避免依赖在注册过程中完成导致提前调度
+    node.dependency_count.store(1, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < dependency_count; ++i) {
+        node.dependency_count.fetch_add(1);
+        if (!add_continuation(task_system, dependencies[i], node_index)) {
+            node.dependency_count.fetch_sub(1); // the dependency has already completed
+        }
+    }
+    if (node.dependency_count.fetch_sub(1) == 1) {
+        schedule_node(task_system, node_index);
+    }
+    return task_handle;
+}
+
+bool is_task_complete(TaskSystem *task_system, TaskHandle task_handle) {
+    if (task_handle.node_index == INVALID_TASK_NODE_INDEX) {
+        return true;
+    }
+    return task_system->nodes[task_handle.node_index].generation.load(std::memory_order_acquire) !=
+           task_handle.generation;
+}
+
+void wait_task(TaskSystem *task_system, TaskHandle task_handle) {
+    if (task_handle.node_index == INVALID_TASK_NODE_INDEX) {
+        return;
+    }
+    TaskNode &node = task_system->nodes[task_handle.node_index];
+    uint32_t worker_index = get_current_worker_index(task_system);
+    while (node.generation.load(std::memory_order_acquire) == task_handle.generation) {
+        uint32_t node_index;
+        if (worker_index == UINT32_MAX) {
+            node.generation.wait(task_handle.generation, std::memory_order_acquire);
+        } else if (find_node(task_system, worker_index, &node_index)) {
+            run_node(task_system, node_index); // help instead of blocking the worker
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void collect_task_lane_statistics(TaskSystem *task_system, TaskLaneStatistics statistics[TASK_PRIORITY_COUNT]) {
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        TaskLaneCounters &lane_counters = task_system->lane_counters[i];
+        uint64_t sampled_count = lane_counters.sampled_count.exchange(0, std::memory_order_relaxed);
+        uint64_t total_wait_ns = lane_counters.total_wait_ns.exchange(0, std::memory_order_relaxed);
+        uint64_t max_wait_ns = lane_counters.max_wait_ns.exchange(0, std::memory_order_relaxed);
+        statistics[i].queue_depth = lane_counters.queue_depth.load(std::memory_order_relaxed);
+        statistics[i].executed_count = lane_counters.executed_count.exchange(0, std::memory_order_relaxed);
+        statistics[i].average_wait_ms = sampled_count > 0 ? total_wait_ns / 1e6 / sampled_count : 0.0;
+        statistics[i].max_wait_ms = max_wait_ns / 1e6;
+    }
+}
+
+uint32_t get_current_worker_index(TaskSystem *task_system) {
+    return current_task_system == task_system ? current_worker_index : UINT32_MAX;
 }
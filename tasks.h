@@ -1,20 +1,210 @@
 #pragma once
 
-#include <condition_variable>
-#include <functional>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define TASK_INLINE_STORAGE_SIZE 112 // 捕获数据内联存储大小，Task整体为128字节
+#define TASK_QUEUE_CAPACITY 4096 // 提交队列容量，必须是2的幂
+#define MAX_TASK_NODES 16384 // 同时存在（已提交未完成）的任务节点数上限
+#define TASK_NODE_WORKER_RESERVE 4096 // 为worker线程保留的节点数，保证执行中的任务总能提交后续任务
+#define MAX_TASK_CONTINUATIONS 16 // 每个任务节点内联存放的后继任务数，更多的后继放进从块池取出的链表
+#define TASK_CONTINUATION_BLOCK_SIZE 16 // 每个溢出块存放的后继任务数
+#define MAX_TASK_CONTINUATION_BLOCKS 4096 // 溢出块池大小，耗尽时等待其他任务完成归还
+#define TASK_WAIT_TIME_SAMPLE_INTERVAL 16 // 每调度多少个任务采样一次等待时间（读时钟不便宜），必须是2的幂
+
+// 优先级（数值越小越优先）：worker总是先取高优先级lane的任务，低优先级任务只在空闲时执行
+enum TaskPriority {
+    TASK_PRIORITY_CRITICAL, // 当前帧依赖的工作
+    TASK_PRIORITY_UPLOAD, // 资源上传
+    TASK_PRIORITY_BACKGROUND, // 默认
+    TASK_PRIORITY_DESTROY, // 资源释放，晚一些执行也没关系
+    TASK_PRIORITY_COUNT,
+};
+
+struct TaskVTable {
+    void (*invoke)(void *storage);
+    void (*move)(void *dst, void *src); // 从src移动构造到dst，并析构src
+    void (*destroy)(void *storage);
+};
+
+template<typename F>
+struct TaskVTableFor {
+    static void invoke(void *storage) { (*static_cast<F *>(storage))(); }
+
+    static void move(void *dst, void *src) {
+        new(dst) F(std::move(*static_cast<F *>(src)));
+        static_cast<F *>(src)->~F();
+    }
+
+    static void destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+
+    static constexpr TaskVTable vtable = {invoke, move, destroy};
+};
+
+// 不分配堆内存的任务：捕获数据直接存放在内联缓冲区中（类似std::function的小对象优化，但没有堆回退）
+struct Task {
+    alignas(16) unsigned char storage[TASK_INLINE_STORAGE_SIZE];
+    const TaskVTable *vtable = nullptr;
+
+    Task() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F &&f) {
+        using Fn = std::decay_t<F>;
+        static_assert(sizeof(Fn) <= TASK_INLINE_STORAGE_SIZE, "task captures exceed TASK_INLINE_STORAGE_SIZE");
+        static_assert(alignof(Fn) <= 16, "task captures are over-aligned");
+        new(storage) Fn(std::forward<F>(f));
+        vtable = &TaskVTableFor<Fn>::vtable;
+    }
+
+    Task(Task &&other) noexcept : vtable(other.vtable) {
+        if (vtable) {
+            vtable->move(storage, other.storage);
+            other.vtable = nullptr;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            vtable = other.vtable;
+            if (vtable) {
+                vtable->move(storage, other.storage);
+                other.vtable = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    void reset() {
+        if (vtable) {
+            vtable->destroy(storage);
+            vtable = nullptr;
+        }
+    }
+
+    explicit operator bool() const { return vtable != nullptr; }
+
+    void operator()() { vtable->invoke(storage); }
+};
+
+// 任务图节点：任务完成时generation递增，持有旧generation的TaskHandle即视为已完成
+struct TaskNode {
+    Task task;
+    std::atomic<uint32_t> generation;
+    std::atomic<int32_t> dependency_count; // 未完成的依赖数（提交期间额外+1防止提前调度）
+    std::atomic_flag continuations_lock;
+    uint32_t continuation_count;
+    uint32_t continuations[MAX_TASK_CONTINUATIONS]; // 依赖本任务的节点下标
+    uint32_t continuation_block_index; // 溢出后继所在块链表的头（最近加入的块），INVALID_TASK_CONTINUATION_BLOCK_INDEX表示没有
+    std::atomic<uint32_t> next_free_node_index;
+    TaskPriority priority;
+    uint64_t ready_time_ns; // 依赖满足、进入队列的时间，用于统计等待时间；0表示未采样
+};
+
+#define INVALID_TASK_NODE_INDEX UINT32_MAX
+#define INVALID_TASK_CONTINUATION_BLOCK_INDEX UINT32_MAX
+
+// 后继数超过MAX_TASK_CONTINUATIONS时使用的溢出块，挂在依赖节点上，节点完成时归还
+struct TaskContinuationBlock {
+    uint32_t continuation_count;
+    uint32_t continuations[TASK_CONTINUATION_BLOCK_SIZE];
+    uint32_t next_block_index; // 同一节点的下一个溢出块
+    std::atomic<uint32_t> next_free_block_index;
+};
+
+struct TaskHandle {
+    uint32_t node_index = INVALID_TASK_NODE_INDEX; // 无效句柄视为已完成
+    uint32_t generation = 0;
+};
+
+// 有界MPMC无锁环形队列（Dmitry Vyukov），传递任务节点下标，提交线程不加锁也不分配内存
+struct TaskQueueCell {
+    std::atomic<size_t> sequence;
+    uint32_t node_index;
+};
+
+struct TaskQueue {
+    std::unique_ptr<TaskQueueCell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) std::atomic<size_t> dequeue_position;
+};
+
+void init_task_queue(TaskQueue *task_queue, size_t capacity);
+bool try_push_task_queue(TaskQueue *task_queue, uint32_t node_index);
+bool try_pop_task_queue(TaskQueue *task_queue, uint32_t *node_index);
+
+// 每个worker拥有自己的双端队列：自己从尾部取（LIFO，缓存友好），其他worker从头部窃取（FIFO）
+struct TaskWorker {
+    std::thread thread;
+    std::deque<uint32_t> node_indices[TASK_PRIORITY_COUNT];
+    std::mutex node_indices_mutex;
+};
+
+struct alignas(64) TaskLaneCounters {
+    std::atomic<int32_t> queue_depth; // 已就绪（依赖已满足）尚未开始执行的任务数
+    std::atomic<uint64_t> executed_count;
+    std::atomic<uint64_t> sampled_count;
+    std::atomic<uint64_t> total_wait_ns; // 采样任务从就绪到开始执行的等待时间
+    std::atomic<uint64_t> max_wait_ns;
+};
+
+struct TaskLaneStatistics {
+    int32_t queue_depth;
+    uint64_t executed_count;
+    double average_wait_ms;
+    double max_wait_ms; // 等待时间是采样统计的
+};
 
 struct TaskSystem {
-    std::thread worker_thread;
-    std::queue<std::function<void()>> tasks;
-    std::mutex tasks_mutex;
-    std::condition_variable tasks_condition_variable;
-    bool request_stop;
+    uint32_t worker_count; // 0表示使用std::thread::hardware_concurrency()
+    std::vector<std::unique_ptr<TaskWorker>> workers;
+    std::unique_ptr<TaskNode[]> nodes;
+    std::atomic<uint64_t> free_node_head; // 空闲节点栈顶：低32位为下标，高32位为防ABA标签
+    std::atomic<int32_t> free_node_count;
+    std::atomic<uint32_t> node_waiter_count; // 等节点的外部线程数，非0时release_node才notify free_node_count
+    std::unique_ptr<TaskContinuationBlock[]> continuation_blocks;
+    std::atomic<uint64_t> free_continuation_block_head; // 同free_node_head
+    TaskQueue submission_queues[TASK_PRIORITY_COUNT]; // 非worker线程（如渲染线程）提交的任务
+    std::atomic<uint32_t> next_worker_index; // 提交队列满时轮询分配worker
+    std::atomic<uint32_t> wake_epoch; // 每次提交任务递增，空闲worker在其上等待
+    std::atomic<uint32_t> sleeping_worker_count;
+    std::atomic<bool> request_stop;
+    TaskLaneCounters lane_counters[TASK_PRIORITY_COUNT];
 };
 
 void start(TaskSystem *task_system);
 void stop(TaskSystem *task_system);
 
-void push_task(TaskSystem *task_system, std::function<void()> &&task);
+// 提交任务；dependencies中的任务全部完成后才会执行（已完成或无效的句柄会被忽略）。
+// 不分配内存也不加锁，但有背压：外部线程（如渲染线程）在已提交未完成的任务超过
+// MAX_TASK_NODES - TASK_NODE_WORKER_RESERVE（12288）个时会阻塞，直到有任务完成归还节点（睡眠等待，不空转）；
+// worker线程在节点池耗尽时帮忙执行任务。溢出后继块池耗尽时同理
+TaskHandle push_task(TaskSystem *task_system, Task &&task, TaskPriority priority = TASK_PRIORITY_BACKGROUND,
+                     const TaskHandle *dependencies = nullptr, uint32_t dependency_count = 0);
+
+bool is_task_complete(TaskSystem *task_system, TaskHandle task_handle);
+
+// 等待任务完成；在worker线程上调用时会执行其他任务而不是阻塞
+void wait_task(TaskSystem *task_system, TaskHandle task_handle);
+
+// 读取各lane的统计：queue_depth为当前值，其余为上次调用以来的累计值（读取后清零）
+void collect_task_lane_statistics(TaskSystem *task_system, TaskLaneStatistics statistics[TASK_PRIORITY_COUNT]);
+
+// 当前线程是否为task system的worker，是则返回其下标，否则返回UINT32_MAX
+uint32_t get_current_worker_index(TaskSystem *task_system);
@@ -0,0 +1,142 @@
+#include "tasks.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <vector>
+
+// 提交+执行一个任务的平均耗时（ns/task），对比旧的单线程std::function实现
+
+#define BENCH_TASK_COUNT 1000000
+#define BENCH_ROUNDS 5
+#define BENCH_CHUNK_SIZE 4096 // 分批提交，每批等执行完再提交下一批，保证不触发节点池的背压（非worker线程最多12288个）
+
+// 旧实现：单个worker线程 + 互斥锁保护的std::queue<std::function<void()>>
+struct LegacyTaskSystem {
+    std::thread worker_thread;
+    std::queue<std::function<void()>> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_condition_variable;
+    bool request_stop;
+};
+
+static void start(LegacyTaskSystem *task_system) {
+    task_system->worker_thread = std::thread([task_system]() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(task_system->tasks_mutex);
+                task_system->tasks_condition_variable.wait(lock, [task_system]() {
+                    return task_system->request_stop || !task_system->tasks.empty();
+                });
+                if (task_system->request_stop && task_system->tasks.empty()) {
+                    break;
+                }
+                task = task_system->tasks.front();
+                task_system->tasks.pop();
+            }
+            task();
+        }
+    });
+}
+
+static void stop(LegacyTaskSystem *task_system) {
+    {
+        std::lock_guard<std::mutex> lock(task_system->tasks_mutex);
+        task_system->request_stop = true;
+    }
+    task_system->tasks_condition_variable.notify_all();
+    task_system->worker_thread.join();
+}
+
+static void push_task(LegacyTaskSystem *task_system, std::function<void()> &&task) {
+    {
+        std::lock_guard<std::mutex> lock(task_system->tasks_mutex);
+        task_system->tasks.emplace(std::move(task));
+    }
+    task_system->tasks_condition_variable.notify_one();
+}
+
+// 模拟request_mesh_buffers的捕获：一个指针加上被move进来的MeshData（两个vector和一个枚举）
+struct BenchPayload {
+    void *context;
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    uint32_t primitive_topology;
+};
+
+struct BenchResult {
+    double push_ns_per_task;
+    double total_ns_per_task;
+};
+
+template<typename TaskSystemType>
+static BenchResult run_bench(TaskSystemType *task_system) {
+    std::atomic<uint32_t> executed_count = 0;
+    std::chrono::steady_clock::duration push_duration = {};
+    auto begin = std::chrono::steady_clock::now();
+    for (uint32_t chunk_begin = 0; chunk_begin < BENCH_TASK_COUNT; chunk_begin += BENCH_CHUNK_SIZE) {
+        uint32_t chunk_end = std::min<uint32_t>(chunk_begin + BENCH_CHUNK_SIZE, BENCH_TASK_COUNT);
+        auto chunk_push_begin = std::chrono::steady_clock::now();
+        for (uint32_t i = chunk_begin; i < chunk_end; ++i) {
+            BenchPayload payload = {};
+            payload.primitive_topology = i;
+            push_task(task_system, [payload = std::move(payload), &executed_count]() {
+                (void) payload;
+                executed_count.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        push_duration += std::chrono::steady_clock::now() - chunk_push_begin;
+        while (executed_count.load(std::memory_order_acquire) < chunk_end) {
+            std::this_thread::yield();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    BenchResult result = {};
+    result.push_ns_per_task = std::chrono::duration<double, std::nano>(push_duration).count() / BENCH_TASK_COUNT;
+    result.total_ns_per_task = std::chrono::duration<double, std::nano>(end - begin).count() / BENCH_TASK_COUNT;
+    return result;
+}
+
+template<typename TaskSystemType>
+static void report(const char *name, TaskSystemType *task_system) {
+    BenchResult best = {1e30, 1e30};
+    for (uint32_t round = 0; round < BENCH_ROUNDS; ++round) {
+        BenchResult result = run_bench(task_system);
+        best.push_ns_per_task = std::min(best.push_ns_per_task, result.push_ns_per_task);
+        best.total_ns_per_task = std::min(best.total_ns_per_task, result.total_ns_per_task);
+    }
+    printf("%-28s push: %8.1f ns/task  push+execute: %8.1f ns/task\n", name, best.push_ns_per_task,
+           best.total_ns_per_task);
+}
+
+int main() {
+    printf("%d tasks in chunks of %d, best of %d rounds\n", BENCH_TASK_COUNT, BENCH_CHUNK_SIZE, BENCH_ROUNDS);
+    {
+        LegacyTaskSystem task_system = {};
+        start(&task_system);
+        report("legacy (std::function)", &task_system);
+        stop(&task_system);
+    }
+    size_t default_worker_count = 0;
+    {
+        TaskSystem task_system = {};
+        start(&task_system);
+        default_worker_count = task_system.workers.size();
+        char name[64];
+        snprintf(name, sizeof(name), "TaskSystem (%zu workers)", default_worker_count);
+        report(name, &task_system);
+        stop(&task_system);
+    }
+    // 默认只有一个worker时和上面是同一配置
+    if (default_worker_count != 1) {
+        TaskSystem task_system = {};
+        task_system.worker_count = 1;
+        start(&task_system);
+        report("TaskSystem (1 worker)", &task_system);
+        stop(&task_system);
+    }
+    return 0;
+}
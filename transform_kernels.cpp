@@ -0,0 +1,226 @@
+#include "transform_kernels.h"
+#include <cassert>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TRANSFORM_KERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2版本单独按AVX2编译，其余代码仍是基础指令集，运行时检测通过才会调用
+#if defined(__GNUC__)
+#define TRANSFORM_KERNEL_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TRANSFORM_KERNEL_TARGET_AVX2
+#endif
+
+void clear_transform_arrays(TransformArrays *transform_arrays) {
+    transform_arrays->position_x.clear();
+    transform_arrays->position_y.clear();
+    transform_arrays->position_z.clear();
+    transform_arrays->orientation_x.clear();
+    transform_arrays->orientation_y.clear();
+    transform_arrays->orientation_z.clear();
+    transform_arrays->orientation_w.clear();
+    transform_arrays->scale_x.clear();
+    transform_arrays->scale_y.clear();
+    transform_arrays->scale_z.clear();
+    transform_arrays->count = 0;
+}
+
+uint32_t add_transform(TransformArrays *transform_arrays, const glm::vec3 &position, const glm::quat &orientation,
+                       const glm::vec3 &scale) {
+    transform_arrays->position_x.push_back(position.x);
+    transform_arrays->position_y.push_back(position.y);
+    transform_arrays->position_z.push_back(position.z);
+    transform_arrays->orientation_x.push_back(orientation.x);
+    transform_arrays->orientation_y.push_back(orientation.y);
+    transform_arrays->orientation_z.push_back(orientation.z);
+    transform_arrays->orientation_w.push_back(orientation.w);
+    transform_arrays->scale_x.push_back(scale.x);
+    transform_arrays->scale_y.push_back(scale.y);
+    transform_arrays->scale_z.push_back(scale.z);
+    return transform_arrays->count++;
+}
+
+#if defined(TRANSFORM_KERNELS_X86)
+static bool detect_avx2() {
+#if defined(_MSC_VER)
+    int registers[4];
+    __cpuid(registers, 1);
+    bool osxsave = (registers[2] & (1 << 27)) != 0;
+    bool avx = (registers[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(registers, 7, 0);
+    return (registers[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+TransformKernel get_best_transform_kernel() {
+#if defined(TRANSFORM_KERNELS_X86)
+    static const TransformKernel best_kernel = detect_avx2() ? TRANSFORM_KERNEL_AVX2 : TRANSFORM_KERNEL_SSE2;
+    return best_kernel;
+#else
+    return TRANSFORM_KERNEL_SCALAR;
+#endif
+}
+
+bool is_transform_kernel_supported(TransformKernel kernel) {
+    return kernel <= get_best_transform_kernel();
+}
+
+// 与glm::mat3_cast相同的四元数展开，旋转矩阵的每一列乘以对应轴的缩放
+static void compute_transform_matrices_scalar(const TransformArrays *transform_arrays, uint32_t begin, uint32_t end,
+                                              glm::mat4 *matrices) {
+    for (uint32_t i = begin; i < end; ++i) {
+        float x = transform_arrays->orientation_x[i];
+        float y = transform_arrays->orientation_y[i];
+        float z = transform_arrays->orientation_z[i];
+        float w = transform_arrays->orientation_w[i];
+        float xx = x * x, yy = y * y, zz = z * z;
+        float xy = x * y, xz = x * z, yz = y * z;
+        float wx = w * x, wy = w * y, wz = w * z;
+        float sx = transform_arrays->scale_x[i];
+        float sy = transform_arrays->scale_y[i];
+        float sz = transform_arrays->scale_z[i];
+        matrices[i - begin] = glm::mat4(
+            glm::vec4((1.0f - 2.0f * (yy + zz)) * sx, 2.0f * (xy + wz) * sx, 2.0f * (xz - wy) * sx, 0.0f),
+            glm::vec4(2.0f * (xy - wz) * sy, (1.0f - 2.0f * (xx + zz)) * sy, 2.0f * (yz + wx) * sy, 0.0f),
+            glm::vec4(2.0f * (xz + wy) * sz, 2.0f * (yz - wx) * sz, (1.0f - 2.0f * (xx + yy)) * sz, 0.0f),
+            glm::vec4(transform_arrays->position_x[i], transform_arrays->position_y[i], transform_arrays->position_z[i], 1.0f)
+        );
+    }
+}
+
+#if defined(TRANSFORM_KERNELS_X86)
+// SIMD算出的是各实体同一分量（SoA），在寄存器内转置成每个实体矩阵的一列（行0~3），直接写入列主序的glm::mat4
+static void store_transform_matrix_columns_sse2(__m128 row0, __m128 row1, __m128 row2, __m128 row3, glm::mat4 *matrices,
+                                                int column) {
+    _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+    _mm_storeu_ps(&matrices[0][column][0], row0);
+    _mm_storeu_ps(&matrices[1][column][0], row1);
+    _mm_storeu_ps(&matrices[2][column][0], row2);
+    _mm_storeu_ps(&matrices[3][column][0], row3);
+}
+
+static uint32_t compute_transform_matrices_sse2(const TransformArrays *transform_arrays, uint32_t begin, uint32_t end,
+                                                glm::mat4 *matrices) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(&transform_arrays->orientation_x[i]);
+        __m128 y = _mm_loadu_ps(&transform_arrays->orientation_y[i]);
+        __m128 z = _mm_loadu_ps(&transform_arrays->orientation_z[i]);
+        __m128 w = _mm_loadu_ps(&transform_arrays->orientation_w[i]);
+        __m128 sx = _mm_loadu_ps(&transform_arrays->scale_x[i]);
+        __m128 sy = _mm_loadu_ps(&transform_arrays->scale_y[i]);
+        __m128 sz = _mm_loadu_ps(&transform_arrays->scale_z[i]);
+        __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+        __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+        __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+        glm::mat4 *output = matrices + (i - begin);
+        store_transform_matrix_columns_sse2(_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx),
+                                            _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx),
+                                            _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx),
+                                            zero, output, 0);
+        store_transform_matrix_columns_sse2(_mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy),
+                                            _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy),
+                                            _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy),
+                                            zero, output, 1);
+        store_transform_matrix_columns_sse2(_mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz),
+                                            _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz),
+                                            _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz),
+                                            zero, output, 2);
+        store_transform_matrix_columns_sse2(_mm_loadu_ps(&transform_arrays->position_x[i]),
+                                            _mm_loadu_ps(&transform_arrays->position_y[i]),
+                                            _mm_loadu_ps(&transform_arrays->position_z[i]),
+                                            one, output, 3);
+    }
+    return i;
+}
+
+// 与SSE2版本相同，只是两个128位lane各转置4个实体：低半部分是实体0~3，高半部分是实体4~7
+TRANSFORM_KERNEL_TARGET_AVX2
+static void store_transform_matrix_columns_avx2(__m256 row0, __m256 row1, __m256 row2, __m256 row3, glm::mat4 *matrices,
+                                                int column) {
+    __m256 t0 = _mm256_unpacklo_ps(row0, row1);
+    __m256 t1 = _mm256_unpackhi_ps(row0, row1);
+    __m256 t2 = _mm256_unpacklo_ps(row2, row3);
+    __m256 t3 = _mm256_unpackhi_ps(row2, row3);
+    __m256 v0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 v1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 v2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 v3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm_storeu_ps(&matrices[0][column][0], _mm256_castps256_ps128(v0));
+    _mm_storeu_ps(&matrices[1][column][0], _mm256_castps256_ps128(v1));
+    _mm_storeu_ps(&matrices[2][column][0], _mm256_castps256_ps128(v2));
+    _mm_storeu_ps(&matrices[3][column][0], _mm256_castps256_ps128(v3));
+    _mm_storeu_ps(&matrices[4][column][0], _mm256_extractf128_ps(v0, 1));
+    _mm_storeu_ps(&matrices[5][column][0], _mm256_extractf128_ps(v1, 1));
+    _mm_storeu_ps(&matrices[6][column][0], _mm256_extractf128_ps(v2, 1));
+    _mm_storeu_ps(&matrices[7][column][0], _mm256_extractf128_ps(v3, 1));
+}
+
+TRANSFORM_KERNEL_TARGET_AVX2
+static uint32_t compute_transform_matrices_avx2(const TransformArrays *transform_arrays, uint32_t begin, uint32_t end,
+                                                glm::mat4 *matrices) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 x = _mm256_loadu_ps(&transform_arrays->orientation_x[i]);
+        __m256 y = _mm256_loadu_ps(&transform_arrays->orientation_y[i]);
+        __m256 z = _mm256_loadu_ps(&transform_arrays->orientation_z[i]);
+        __m256 w = _mm256_loadu_ps(&transform_arrays->orientation_w[i]);
+        __m256 sx = _mm256_loadu_ps(&transform_arrays->scale_x[i]);
+        __m256 sy = _mm256_loadu_ps(&transform_arrays->scale_y[i]);
+        __m256 sz = _mm256_loadu_ps(&transform_arrays->scale_z[i]);
+        __m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+        __m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+        __m256 wx = _mm256_mul_ps(w, x), wy = _mm256_mul_ps(w, y), wz = _mm256_mul_ps(w, z);
+        glm::mat4 *output = matrices + (i - begin);
+        store_transform_matrix_columns_avx2(_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), sx),
+                                            _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx),
+                                            _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx),
+                                            zero, output, 0);
+        store_transform_matrix_columns_avx2(_mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy),
+                                            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))), sy),
+                                            _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy),
+                                            zero, output, 1);
+        store_transform_matrix_columns_avx2(_mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz),
+                                            _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz),
+                                            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), sz),
+                                            zero, output, 2);
+        store_transform_matrix_columns_avx2(_mm256_loadu_ps(&transform_arrays->position_x[i]),
+                                            _mm256_loadu_ps(&transform_arrays->position_y[i]),
+                                            _mm256_loadu_ps(&transform_arrays->position_z[i]),
+                                            one, output, 3);
+    }
+    return i;
+}
+#endif
+
+void compute_transform_matrices(const TransformArrays *transform_arrays, uint32_t begin, uint32_t end,
+                                glm::mat4 *matrices, TransformKernel kernel) {
+    assert(end <= transform_arrays->count && is_transform_kernel_supported(kernel));
+    uint32_t i = begin;
+#if defined(TRANSFORM_KERNELS_X86)
+    if (kernel == TRANSFORM_KERNEL_AVX2) {
+        i = compute_transform_matrices_avx2(transform_arrays, i, end, matrices);
+    } else if (kernel == TRANSFORM_KERNEL_SSE2) {
+        i = compute_transform_matrices_sse2(transform_arrays, i, end, matrices);
+    }
+#endif
+    compute_transform_matrices_scalar(transform_arrays, i, end, matrices + (i - begin));
+}
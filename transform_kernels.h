@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <vector>
+
+// 一批变换按分量分开存放（SoA），SIMD一次读取连续的多个实体
+struct TransformArrays {
+    std::vector<float> position_x;
+    std::vector<float> position_y;
+    std::vector<float> position_z;
+    std::vector<float> orientation_x;
+    std::vector<float> orientation_y;
+    std::vector<float> orientation_z;
+    std::vector<float> orientation_w;
+    std::vector<float> scale_x;
+    std::vector<float> scale_y;
+    std::vector<float> scale_z;
+    uint32_t count;
+};
+
+enum TransformKernel {
+    TRANSFORM_KERNEL_SCALAR,
+    TRANSFORM_KERNEL_SSE2, // 一次4个实体
+    TRANSFORM_KERNEL_AVX2, // 一次8个实体
+    TRANSFORM_KERNEL_COUNT,
+};
+
+void clear_transform_arrays(TransformArrays *transform_arrays);
+
+// 返回变换的下标
+uint32_t add_transform(TransformArrays *transform_arrays, const glm::vec3 &position, const glm::quat &orientation,
+                       const glm::vec3 &scale);
+
+// 第一次调用时检测CPU（AVX2还要求操作系统保存ymm寄存器），返回可用的最快实现
+TransformKernel get_best_transform_kernel();
+
+bool is_transform_kernel_supported(TransformKernel kernel);
+
+// matrices[i - begin] = translate(position) * mat4_cast(orientation) * scale(scale)，i ∈ [begin, end)。
+// orientation须为单位四元数；不足一批的尾部用标量计算
+void compute_transform_matrices(const TransformArrays *transform_arrays, uint32_t begin, uint32_t end,
+                                glm::mat4 *matrices, TransformKernel kernel);
@@ -0,0 +1,189 @@
+#include "transforms.h"
+#include <algorithm>
+#include <cassert>
+
+static void mark_transform_dirty(entt::registry &registry, entt::entity entity) {
+    registry.emplace_or_replace<DirtyTransform>(entity);
+    // 并行更新时只写入已有的WorldMatrix，不改变storage的结构
+    if (!registry.all_of<WorldMatrix>(entity)) {
+        registry.emplace<WorldMatrix>(entity, glm::mat4(1.0f));
+    }
+}
+
+static void unlink_from_parent(entt::registry *registry, entt::entity entity, Hierarchy *hierarchy) {
+    if (hierarchy->parent == entt::null) {
+        return;
+    }
+    Hierarchy &parent_hierarchy = registry->get<Hierarchy>(hierarchy->parent);
+    if (parent_hierarchy.first_child == entity) {
+        parent_hierarchy.first_child = hierarchy->next_sibling;
+    } else {
+        entt::entity sibling = parent_hierarchy.first_child;
+        while (true) {
+            Hierarchy &sibling_hierarchy = registry->get<Hierarchy>(sibling);
+            if (sibling_hierarchy.next_sibling == entity) {
+                sibling_hierarchy.next_sibling = hierarchy->next_sibling;
+                break;
+            }
+            sibling = sibling_hierarchy.next_sibling;
+        }
+    }
+    hierarchy->parent = entt::null;
+    hierarchy->next_sibling = entt::null;
+}
+
+// 销毁节点时从父节点摘下，子节点变为根节点（局部变换即世界变换）
+static void on_hierarchy_destroy(entt::registry &registry, entt::entity entity) {
+    Hierarchy &hierarchy = registry.get<Hierarchy>(entity);
+    unlink_from_parent(&registry, entity, &hierarchy);
+    entt::entity child = hierarchy.first_child;
+    while (child != entt::null) {
+        Hierarchy &child_hierarchy = registry.get<Hierarchy>(child);
+        entt::entity next_sibling = child_hierarchy.next_sibling;
+        child_hierarchy.parent = entt::null;
+        child_hierarchy.next_sibling = entt::null;
+        registry.emplace_or_replace<DirtyTransform>(child);
+        child = next_sibling;
+    }
+    hierarchy.first_child = entt::null;
+}
+
+void connect_transform_tracking(entt::registry *registry) {
+    registry->on_construct<Transform>().connect<&mark_transform_dirty>();
+    registry->on_update<Transform>().connect<&mark_transform_dirty>();
+    registry->on_construct<Transform2D>().connect<&mark_transform_dirty>();
+    registry->on_update<Transform2D>().connect<&mark_transform_dirty>();
+    registry->on_destroy<Hierarchy>().connect<&on_hierarchy_destroy>();
+}
+
+void set_parent(entt::registry *registry, entt::entity entity, entt::entity parent) {
+    assert(entity != parent && registry->all_of<Transform>(entity));
+    // 先确保两边都有Hierarchy，emplace可能让storage重新分配，之后再取引用
+    registry->get_or_emplace<Hierarchy>(entity);
+    if (parent != entt::null) {
+        assert(registry->all_of<Transform>(parent));
+        registry->get_or_emplace<Hierarchy>(parent);
+    }
+
+    Hierarchy &hierarchy = registry->get<Hierarchy>(entity);
+    unlink_from_parent(registry, entity, &hierarchy);
+    if (parent != entt::null) {
+        // 不能挂到自己的子树下
+        for (entt::entity ancestor = parent; ancestor != entt::null; ancestor = registry->get<Hierarchy>(ancestor).parent) {
+            assert(ancestor != entity);
+        }
+        Hierarchy &parent_hierarchy = registry->get<Hierarchy>(parent);
+        hierarchy.parent = parent;
+        hierarchy.next_sibling = parent_hierarchy.first_child;
+        parent_hierarchy.first_child = entity;
+    }
+    registry->patch<Transform>(entity); // 触发on_update，标记为脏
+}
+
+// 祖先也是脏的节点会随祖先的子树一起更新，不需要作为子树根
+static bool has_dirty_ancestor(const entt::registry *registry, entt::entity entity) {
+    const Hierarchy *hierarchy = registry->try_get<Hierarchy>(entity);
+    while (hierarchy != nullptr && hierarchy->parent != entt::null) {
+        if (registry->all_of<DirtyTransform>(hierarchy->parent)) {
+            return true;
+        }
+        hierarchy = registry->try_get<Hierarchy>(hierarchy->parent);
+    }
+    return false;
+}
+
+// 可以在worker上执行：只读registry，只写[begin, end)中节点已有的WorldMatrix，父节点已在上一层或之前算好
+static void compute_world_matrices(const entt::registry *registry, entt::storage<WorldMatrix> *world_matrix_storage,
+                                   WorldMatrixUpdate *world_matrix_update, uint32_t begin, uint32_t end) {
+    if (begin == end) {
+        return;
+    }
+    glm::mat4 *world_matrices = world_matrix_update->world_matrices.data();
+    compute_transform_matrices(&world_matrix_update->local_transforms, begin, end, world_matrices + begin,
+                               get_best_transform_kernel());
+    for (uint32_t i = begin; i < end; ++i) {
+        entt::entity entity = world_matrix_update->entities[i];
+        uint32_t parent_index = world_matrix_update->parent_indices[i];
+        if (parent_index != UINT32_MAX) {
+            world_matrices[i] = world_matrices[parent_index] * world_matrices[i];
+        } else {
+            // 子树根的父节点不脏，它的WorldMatrix已经是最新的
+            const Hierarchy *hierarchy = registry->try_get<Hierarchy>(entity);
+            if (hierarchy != nullptr && hierarchy->parent != entt::null) {
+                world_matrices[i] = world_matrix_storage->get(hierarchy->parent).matrix * world_matrices[i];
+            }
+        }
+        world_matrix_storage->get(entity).matrix = world_matrices[i];
+    }
+}
+
+bool update_world_matrices(entt::registry *registry, TaskSystem *task_system, WorldMatrixUpdate *world_matrix_update) {
+    world_matrix_update->entities.clear();
+    world_matrix_update->parent_indices.clear();
+    world_matrix_update->level_offsets.clear();
+    clear_transform_arrays(&world_matrix_update->local_transforms);
+
+    for (auto view = registry->view<DirtyTransform, Transform>(); auto entity: view) {
+        if (has_dirty_ancestor(registry, entity)) { continue; }
+        const Transform &transform = view.get<Transform>(entity);
+        world_matrix_update->entities.push_back(entity);
+        world_matrix_update->parent_indices.push_back(UINT32_MAX);
+        add_transform(&world_matrix_update->local_transforms, transform.position, transform.orientation, transform.scale);
+    }
+    // Transform2D没有层级，和3D的子树根一起放在第一层
+    for (auto view = registry->view<DirtyTransform, Transform2D>(); auto entity: view) {
+        const Transform2D &transform = view.get<Transform2D>(entity);
+        world_matrix_update->entities.push_back(entity);
+        world_matrix_update->parent_indices.push_back(UINT32_MAX);
+        add_transform(&world_matrix_update->local_transforms, transform.position, glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+                      glm::vec3(transform.scale, 1.0f));
+    }
+
+    // 从所有子树根开始广度优先展开，一层的子节点追加在这一层之后
+    uint32_t level_begin = 0;
+    while (level_begin < world_matrix_update->entities.size()) {
+        uint32_t level_end = static_cast<uint32_t>(world_matrix_update->entities.size());
+        world_matrix_update->level_offsets.push_back(level_begin);
+        for (uint32_t i = level_begin; i < level_end; ++i) {
+            const Hierarchy *hierarchy = registry->try_get<Hierarchy>(world_matrix_update->entities[i]);
+            if (hierarchy == nullptr) { continue; }
+            for (entt::entity child = hierarchy->first_child; child != entt::null; child = registry->get<Hierarchy>(child).next_sibling) {
+                const Transform &transform = registry->get<Transform>(child);
+                world_matrix_update->entities.push_back(child);
+                world_matrix_update->parent_indices.push_back(i);
+                add_transform(&world_matrix_update->local_transforms, transform.position, transform.orientation, transform.scale);
+            }
+        }
+        level_begin = level_end;
+    }
+    uint32_t node_count = static_cast<uint32_t>(world_matrix_update->entities.size());
+    world_matrix_update->level_offsets.push_back(node_count);
+    world_matrix_update->world_matrices.resize(node_count);
+
+    // 逐层计算，同一层的节点互不依赖；调用线程计算第一段，其余每段一个任务
+    entt::storage<WorldMatrix> *world_matrix_storage = &registry->storage<WorldMatrix>();
+    for (uint32_t level = 0; level + 1 < world_matrix_update->level_offsets.size(); ++level) {
+        uint32_t begin = world_matrix_update->level_offsets[level];
+        uint32_t end = world_matrix_update->level_offsets[level + 1];
+        world_matrix_update->task_handles.clear();
+        for (uint32_t task_begin = begin + WORLD_MATRIX_TASK_BATCH_SIZE; task_begin < end; task_begin += WORLD_MATRIX_TASK_BATCH_SIZE) {
+            uint32_t task_end = std::min(task_begin + WORLD_MATRIX_TASK_BATCH_SIZE, end);
+            world_matrix_update->task_handles.push_back(push_task(task_system, [registry, world_matrix_storage, world_matrix_update, task_begin, task_end]() {
+                compute_world_matrices(registry, world_matrix_storage, world_matrix_update, task_begin, task_end);
+            }, TASK_PRIORITY_CRITICAL));
+        }
+        compute_world_matrices(registry, world_matrix_storage, world_matrix_update, begin, std::min(begin + WORLD_MATRIX_TASK_BATCH_SIZE, end));
+        for (TaskHandle task_handle: world_matrix_update->task_handles) {
+            wait_task(task_system, task_handle);
+        }
+    }
+
+    registry->clear<DirtyTransform>();
+
+    for (entt::entity entity: world_matrix_update->entities) {
+        if (registry->all_of<Static>(entity)) {
+            return true;
+        }
+    }
+    return false;
+}
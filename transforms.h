@@ -0,0 +1,50 @@
+#pragma once
+
+#include "ecs.h"
+#include "tasks.h"
+#include "transform_kernels.h"
+#include <entt/entt.hpp>
+#include <glm/glm.hpp>
+#include <vector>
+
+#define WORLD_MATRIX_TASK_BATCH_SIZE 4096 // 同一层的脏节点多于这个数时拆成多个任务并行计算
+
+// Transform/Transform2D的世界矩阵缓存，只在它们变化之后重新计算；渲染、拾取和剔除都读取这里
+struct WorldMatrix {
+    glm::mat4 matrix;
+};
+
+// Transform/Transform2D新增或通过registry.patch/replace修改之后加上，update_world_matrices之后移除
+struct DirtyTransform {
+};
+
+// 父子层级：子节点的Transform是相对父节点的局部变换，世界矩阵 = 父节点世界矩阵 * 局部矩阵。
+// 同一父节点的子节点串成单链表，只通过set_parent修改
+struct Hierarchy {
+    entt::entity parent = entt::null;
+    entt::entity first_child = entt::null;
+    entt::entity next_sibling = entt::null;
+};
+
+// 跨帧复用的传播工作区：所有脏子树按广度优先展开，同一层的节点连续存放，父节点总在子节点之前
+struct WorldMatrixUpdate {
+    std::vector<entt::entity> entities;
+    std::vector<uint32_t> parent_indices; // 父节点在entities中的下标，子树根为UINT32_MAX
+    TransformArrays local_transforms; // 与entities一一对应，Transform2D按单位旋转、z缩放为1存放
+    std::vector<glm::mat4> world_matrices; // 与entities一一对应，先批量算出局部矩阵，再乘以父节点的世界矩阵
+    std::vector<uint32_t> level_offsets; // 每一层在entities中的起点，最后一个元素是总数
+    std::vector<TaskHandle> task_handles;
+};
+
+// 连接Transform/Transform2D/Hierarchy的信号，在创建实体之前调用。
+// 直接通过registry.get修改的Transform不会被追踪，必须使用patch/replace
+void connect_transform_tracking(entt::registry *registry);
+
+// 把entity挂到parent下（parent为entt::null时解除父子关系），entity的子树会在下一次更新时重新计算
+void set_parent(entt::registry *registry, entt::entity entity, entt::entity parent);
+
+// 每帧在收集绘制之前调用，只重新计算带DirtyTransform的实体和它们的子树。
+// 逐层计算，节点多的层拆给task system的worker并行处理，调用线程也参与计算；局部矩阵用SIMD批量计算。
+// 返回是否重新计算了Static实体的世界矩阵：子节点随父节点移动或父节点销毁时，它自己的组件没有变化，
+// 组件信号不会通知静态场景，调用者据此让静态场景失效
+bool update_world_matrices(entt::registry *registry, TaskSystem *task_system, WorldMatrixUpdate *world_matrix_update);
@@ -0,0 +1,180 @@
+#include "transform_kernels.h"
+#include "transforms.h"
+#include <chrono>
+#include <cstdio>
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+#include <vector>
+
+// 批量计算变换矩阵的吞吐量（实体/ms），对比原来逐个实体translate * mat4_cast * scale的做法；
+// 以及层级传播：100k节点的树上update_world_matrices的耗时，结果和朴素递归计算对比
+
+#define BENCH_ENTITY_COUNT 100000
+#define BENCH_ROUNDS 20
+#define BENCH_HIERARCHY_BRANCHING 4 // 层级测试中每个节点的子节点数，100k节点约9层
+#define BENCH_HIERARCHY_DIRTY_PERCENT 1 // 每轮修改的节点比例
+
+struct BenchTransform {
+    glm::vec3 position;
+    glm::quat orientation;
+    glm::vec3 scale;
+};
+
+// 原来collection pass中逐个实体的计算
+static glm::mat4 compute_transform_matrix_per_entity(const BenchTransform &transform) {
+    glm::mat4 translation = glm::translate(glm::mat4(1.0f), transform.position);
+    glm::mat4 rotation = glm::mat4_cast(transform.orientation);
+    glm::mat4 scale = glm::scale(glm::mat4(1.0f), transform.scale);
+    return translation * rotation * scale;
+}
+
+static float max_difference(const std::vector<glm::mat4> &a, const std::vector<glm::mat4> &b) {
+    float difference = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (int column = 0; column < 4; ++column) {
+            for (int row = 0; row < 4; ++row) {
+                difference = std::max(difference, std::abs(a[i][column][row] - b[i][column][row]));
+            }
+        }
+    }
+    return difference;
+}
+
+// 朴素的参考实现：沿父节点递归，不复用任何中间结果
+static glm::mat4 compute_world_matrix_recursive(const entt::registry &registry, entt::entity entity) {
+    const Transform &transform = registry.get<Transform>(entity);
+    glm::mat4 local = compute_transform_matrix_per_entity({transform.position, transform.orientation, transform.scale});
+    const Hierarchy *hierarchy = registry.try_get<Hierarchy>(entity);
+    if (hierarchy == nullptr || hierarchy->parent == entt::null) {
+        return local;
+    }
+    return compute_world_matrix_recursive(registry, hierarchy->parent) * local;
+}
+
+template<typename Function>
+static double measure_ms(Function &&function) {
+    double best_ms = 1e30;
+    for (uint32_t round = 0; round < BENCH_ROUNDS; ++round) {
+        best_ms = std::min(best_ms, function());
+    }
+    return best_ms;
+}
+
+// prepare在计时之外修改Transform，之后计时一次update_world_matrices
+template<typename Function>
+static void report_hierarchy(const char *name, entt::registry *registry, TaskSystem *task_system,
+                             WorldMatrixUpdate *world_matrix_update, Function &&prepare) {
+    double best_ms = measure_ms([&]() {
+        prepare();
+        auto begin = std::chrono::steady_clock::now();
+        update_world_matrices(registry, task_system, world_matrix_update);
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - begin).count();
+    });
+    float difference = 0.0f;
+    for (auto view = registry->view<Transform, WorldMatrix>(); auto entity: view) {
+        glm::mat4 reference = compute_world_matrix_recursive(*registry, entity);
+        const glm::mat4 &matrix = view.get<WorldMatrix>(entity).matrix;
+        for (int column = 0; column < 4; ++column) {
+            for (int row = 0; row < 4; ++row) {
+                difference = std::max(difference, std::abs(matrix[column][row] - reference[column][row]));
+            }
+        }
+    }
+    printf("%-28s %10.3f ms  (%zu nodes recomputed, max difference %g)\n", name, best_ms,
+           world_matrix_update->entities.size(), difference);
+}
+
+static void bench_hierarchy(std::mt19937 &random) {
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    entt::registry registry;
+    connect_transform_tracking(&registry);
+    TaskSystem task_system = {};
+    start(&task_system);
+    WorldMatrixUpdate world_matrix_update = {};
+
+    // 完全BENCH_HIERARCHY_BRANCHING叉树，节点i的父节点是(i - 1) / BENCH_HIERARCHY_BRANCHING；
+    // 局部变换接近单位变换，避免多层累乘后数值过大，误差失去意义
+    std::vector<entt::entity> entities(BENCH_ENTITY_COUNT);
+    for (uint32_t i = 0; i < BENCH_ENTITY_COUNT; ++i) {
+        entities[i] = registry.create();
+        Transform &transform = registry.emplace<Transform>(entities[i]);
+        transform.position = glm::vec3(distribution(random), distribution(random), distribution(random));
+        transform.orientation = glm::normalize(glm::quat(distribution(random), distribution(random), distribution(random), distribution(random)));
+        transform.scale = glm::vec3(distribution(random), distribution(random), distribution(random)) * 0.1f + glm::vec3(1.0f);
+        if (i > 0) {
+            set_parent(&registry, entities[i], entities[(i - 1) / BENCH_HIERARCHY_BRANCHING]);
+        }
+    }
+    update_world_matrices(&registry, &task_system, &world_matrix_update);
+
+    printf("%d-node hierarchy (%d children per node, %zu workers), best of %d rounds\n", BENCH_ENTITY_COUNT,
+           BENCH_HIERARCHY_BRANCHING, task_system.workers.size(), BENCH_ROUNDS);
+    // 只修改根节点：整棵树都要重新计算
+    report_hierarchy("hierarchy, root dirty", &registry, &task_system, &world_matrix_update, [&]() {
+        registry.patch<Transform>(entities[0], [&](Transform &transform) {
+            transform.position.x = distribution(random);
+        });
+    });
+    std::uniform_int_distribution<uint32_t> entity_distribution(0, BENCH_ENTITY_COUNT - 1);
+    char name[64];
+    snprintf(name, sizeof(name), "hierarchy, %d%% dirty", BENCH_HIERARCHY_DIRTY_PERCENT);
+    report_hierarchy(name, &registry, &task_system, &world_matrix_update, [&]() {
+        for (uint32_t i = 0; i < BENCH_ENTITY_COUNT * BENCH_HIERARCHY_DIRTY_PERCENT / 100; ++i) {
+            registry.patch<Transform>(entities[entity_distribution(random)], [&](Transform &transform) {
+                transform.position = glm::vec3(distribution(random), distribution(random), distribution(random));
+            });
+        }
+    });
+    stop(&task_system);
+}
+
+template<typename Function>
+static double measure_entities_per_ms(Function &&function) {
+    double best_ms = measure_ms([&]() {
+        auto begin = std::chrono::steady_clock::now();
+        function();
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - begin).count();
+    });
+    return BENCH_ENTITY_COUNT / best_ms;
+}
+
+int main() {
+    std::mt19937 random(12345);
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    std::vector<BenchTransform> transforms(BENCH_ENTITY_COUNT);
+    TransformArrays transform_arrays = {};
+    for (BenchTransform &transform: transforms) {
+        transform.position = glm::vec3(distribution(random), distribution(random), distribution(random)) * 100.0f;
+        transform.orientation = glm::normalize(glm::quat(distribution(random), distribution(random), distribution(random), distribution(random)));
+        transform.scale = glm::vec3(distribution(random), distribution(random), distribution(random)) + glm::vec3(1.5f);
+        add_transform(&transform_arrays, transform.position, transform.orientation, transform.scale);
+    }
+
+    printf("%d entities, best of %d rounds\n", BENCH_ENTITY_COUNT, BENCH_ROUNDS);
+    std::vector<glm::mat4> reference_matrices(BENCH_ENTITY_COUNT);
+    double per_entity = measure_entities_per_ms([&]() {
+        for (uint32_t i = 0; i < BENCH_ENTITY_COUNT; ++i) {
+            reference_matrices[i] = compute_transform_matrix_per_entity(transforms[i]);
+        }
+    });
+    printf("%-28s %10.0f entities/ms\n", "per entity (glm)", per_entity);
+
+    const char *kernel_names[TRANSFORM_KERNEL_COUNT] = {"batch scalar", "batch SSE2", "batch AVX2"};
+    std::vector<glm::mat4> matrices(BENCH_ENTITY_COUNT);
+    for (uint32_t kernel = 0; kernel < TRANSFORM_KERNEL_COUNT; ++kernel) {
+        if (!is_transform_kernel_supported(static_cast<TransformKernel>(kernel))) {
+            printf("%-28s not supported\n", kernel_names[kernel]);
+            continue;
+        }
+        double batch = measure_entities_per_ms([&]() {
+            compute_transform_matrices(&transform_arrays, 0, BENCH_ENTITY_COUNT, matrices.data(), static_cast<TransformKernel>(kernel));
+        });
+        printf("%-28s %10.0f entities/ms  (%.2fx, max difference %g)\n", kernel_names[kernel], batch,
+               batch / per_entity, max_difference(reference_matrices, matrices));
+    }
+
+    bench_hierarchy(random);
+    return 0;
+}
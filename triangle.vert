@@ -3,16 +3,24 @@
 
 layout (location = 0) in vec3 position;
 
+// 编译pipeline时通过specialization constant固定（见ShaderVariant），默认值表示从实例数据中读取
+layout (constant_id = 0) const uint CAMERA_INDEX = 0xFFFFFFFFu;
+
 layout (set = 0, binding = 0, std140) uniform CameraUBO {
     mat4 view;
     mat4 projection;
 } cameras[2];
 
-layout (push_constant) uniform InstanceConstants {
+struct InstanceData {
     mat4 model;
     vec3 color;
     uint camera_index;
-} instance;
+};
+
+// 每帧的实例数据，gl_InstanceIndex已包含firstInstance
+layout (set = 0, binding = 1, std430) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
 
 layout (location = 0) out VS_OUT {
     vec3 color;
@@ -20,6 +28,8 @@ layout (location = 0) out VS_OUT {
 
 void main() {
     // debugPrintfEXT("vertex index: %d", gl_VertexIndex);
-    gl_Position = cameras[instance.camera_index].projection * cameras[instance.camera_index].view * instance.model * vec4(position, 1.0);
+    InstanceData instance = instances[gl_InstanceIndex];
+    uint camera_index = CAMERA_INDEX == 0xFFFFFFFFu ? instance.camera_index : CAMERA_INDEX;
+    gl_Position = cameras[camera_index].projection * cameras[camera_index].view * instance.model * vec4(position, 1.0);
     vs_out.color = instance.color;
 }
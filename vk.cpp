@@ -1,6 +1,7 @@
 #include "vk.h"
 #include "file.h"
-#include "meshes.h"
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -10,6 +11,22 @@
 #define LOAD_INSTANCE_PROC_ADDR(instance, name) (PFN_ ## name) vkGetInstanceProcAddr(instance, #name);
 #define LOAD_DEVICE_PROC_ADDR(device, name) (PFN_ ## name) vkGetDeviceProcAddr(device, #name);
 
+#define PIPELINE_CACHE_FILE_MAGIC 0x43505643u // "CVPC"
+#define PIPELINE_CACHE_FILE_VERSION 1
+
+// 磁盘上pipeline cache文件的头，后面紧跟vkGetPipelineCacheData的数据。
+// 换了GPU或驱动之后驱动的数据不能用，整个文件丢弃重新生成
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+    uint64_t data_hash; // 检测写了一半或损坏的文件
+};
+
 VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
                                               VkDebugUtilsMessageTypeFlagsEXT message_type,
                                               const VkDebugUtilsMessengerCallbackDataEXT *callback_data,
@@ -179,6 +196,7 @@ static void pick_physical_device(VkContext *context) {
 static void create_device(VkContext *context) {
     std::vector<const char *> device_extensions;
     std::vector<const char *> device_layers;
+    bool extended_dynamic_state3_available = false;
 
     {
         // enumerate device extensions
@@ -191,6 +209,9 @@ static void create_device(VkContext *context) {
                 device_extensions.push_back("VK_KHR_portability_subset");
             } else if (strcmp(extension.extensionName, "VK_KHR_shader_non_semantic_info") == 0) {
                 device_extensions.push_back("VK_KHR_shader_non_semantic_info");
+            } else if (strcmp(extension.extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME) == 0) {
+                device_extensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+                extended_dynamic_state3_available = true;
             }
         }
     }
@@ -210,23 +231,77 @@ static void create_device(VkContext *context) {
     queue_create_info.queueCount = 1;
     queue_create_info.pQueuePriorities = &queue_priority;
 
-    VkPhysicalDeviceFeatures device_features = {};
-    device_features.fillModeNonSolid = VK_TRUE;
+    // GPU驱动的间接绘制需要的特性，不支持时退化（见indirect_draw.cpp）
+    VkPhysicalDeviceVulkan12Features supported_vulkan12_features = {};
+    supported_vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceExtendedDynamicState3FeaturesEXT supported_extended_dynamic_state3_features = {};
+    supported_extended_dynamic_state3_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+    if (extended_dynamic_state3_available) {
+        supported_vulkan12_features.pNext = &supported_extended_dynamic_state3_features;
+    }
+    VkPhysicalDeviceFeatures2 supported_features = {};
+    supported_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features.pNext = &supported_vulkan12_features;
+    vkGetPhysicalDeviceFeatures2(context->physical_device, &supported_features);
+    context->multi_draw_indirect_supported = supported_features.features.multiDrawIndirect;
+    context->draw_indirect_first_instance_supported = supported_features.features.drawIndirectFirstInstance;
+    context->draw_indirect_count_supported = supported_vulkan12_features.drawIndirectCount;
+
+    // 扩展动态状态（深度测试/写入、topology、primitive restart）在1.3中是核心功能，不需要特性位
+    VkPhysicalDeviceExtendedDynamicState3PropertiesEXT extended_dynamic_state3_properties = {};
+    extended_dynamic_state3_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_PROPERTIES_EXT;
+    VkPhysicalDeviceProperties2 device_properties2 = {};
+    device_properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    if (extended_dynamic_state3_available) {
+        device_properties2.pNext = &extended_dynamic_state3_properties;
+    }
+    vkGetPhysicalDeviceProperties2(context->physical_device, &device_properties2);
+    const VkPhysicalDeviceProperties &device_properties = device_properties2.properties;
+    context->timestamps_supported = device_properties.limits.timestampComputeAndGraphics;
+    context->timestamp_period = device_properties.limits.timestampPeriod;
+    context->extended_dynamic_state_supported = device_properties.apiVersion >= VK_API_VERSION_1_3;
+    context->dynamic_polygon_mode_supported = context->extended_dynamic_state_supported &&
+                                              supported_extended_dynamic_state3_features.extendedDynamicState3PolygonMode;
+    context->dynamic_primitive_topology_unrestricted = context->extended_dynamic_state_supported &&
+                                                       extended_dynamic_state3_properties.dynamicPrimitiveTopologyUnrestricted;
+
+    VkPhysicalDeviceExtendedDynamicState3FeaturesEXT extended_dynamic_state3_features = {};
+    extended_dynamic_state3_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+    extended_dynamic_state3_features.extendedDynamicState3PolygonMode = context->dynamic_polygon_mode_supported;
+
+    VkPhysicalDeviceVulkan12Features vulkan12_features = {};
+    vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12_features.drawIndirectCount = context->draw_indirect_count_supported;
+    if (extended_dynamic_state3_available) {
+        vulkan12_features.pNext = &extended_dynamic_state3_features;
+    }
+
+    VkPhysicalDeviceFeatures2 device_features = {};
+    device_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    device_features.pNext = &vulkan12_features;
+    device_features.features.fillModeNonSolid = VK_TRUE;
+    device_features.features.multiDrawIndirect = context->multi_draw_indirect_supported;
+    device_features.features.drawIndirectFirstInstance = context->draw_indirect_first_instance_supported;
 
     VkDeviceCreateInfo device_create_info = {};
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_create_info.pNext = &device_features;
     device_create_info.queueCreateInfoCount = 1;
     device_create_info.pQueueCreateInfos = &queue_create_info;
     device_create_info.enabledExtensionCount = device_extensions.size();
     device_create_info.ppEnabledExtensionNames = device_extensions.data();
     device_create_info.enabledLayerCount = device_layers.size();
     device_create_info.ppEnabledLayerNames = device_layers.data();
-    device_create_info.pEnabledFeatures = &device_features;
 
     VkResult result = vkCreateDevice(context->physical_device, &device_create_info, nullptr, &context->device);
     assert(result == VK_SUCCESS);
 
     vkGetDeviceQueue(context->device, context->queue_family_index, 0, &context->queue);
+
+    context->vkCmdSetPolygonModeEXT = nullptr;
+    if (context->dynamic_polygon_mode_supported) {
+        context->vkCmdSetPolygonModeEXT = LOAD_DEVICE_PROC_ADDR(context->device, vkCmdSetPolygonModeEXT);
+    }
 }
 
 static void create_swapchain(VkContext *context, uint32_t width, uint32_t height) {
@@ -314,25 +389,32 @@ static void create_command_pool(VkContext *context) {
     assert(result == VK_SUCCESS);
 }
 
-static void create_render_pass(VkContext *context) {
+static void create_render_pass(VkContext *context, VkAttachmentLoadOp load_op, VkImageLayout color_initial_layout,
+                               VkImageLayout color_final_layout, VkAttachmentStoreOp depth_store_op,
+                               VkRenderPass *render_pass) {
+    // LOAD时附件来自上一个render pass，初始layout即上一个的最终layout
+    VkImageLayout depth_initial_layout = load_op == VK_ATTACHMENT_LOAD_OP_LOAD
+                                             ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                                             : VK_IMAGE_LAYOUT_UNDEFINED;
+
     VkAttachmentDescription color_attachment = {};
     color_attachment.format = context->surface_format;
     color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.loadOp = load_op;
     color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    color_attachment.initialLayout = color_initial_layout;
+    color_attachment.finalLayout = color_final_layout;
 
     VkAttachmentDescription depth_attachment = {};
     depth_attachment.format = context->depth_image_format;
     depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.loadOp = load_op;
+    depth_attachment.storeOp = depth_store_op;
     depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.initialLayout = depth_initial_layout;
     depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     VkAttachmentDescription attachments[2] = {color_attachment, depth_attachment};
@@ -351,13 +433,31 @@ static void create_render_pass(VkContext *context) {
     subpass.pColorAttachments = &color_attachment_ref;
     subpass.pDepthStencilAttachment = &depth_attachment_ref;
 
+    // 等待上一个render pass对附件的写入
+    VkSubpassDependency subpass_dependency = {};
+    subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependency.dstSubpass = 0;
+    subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                      VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpass_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    subpass_dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
     VkRenderPassCreateInfo render_pass_create_info = {};
     render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     render_pass_create_info.attachmentCount = std::size(attachments);
     render_pass_create_info.pAttachments = attachments;
     render_pass_create_info.subpassCount = 1;
     render_pass_create_info.pSubpasses = &subpass;
-    VkResult result = vkCreateRenderPass(context->device, &render_pass_create_info, nullptr, &context->render_pass);
+    if (load_op == VK_ATTACHMENT_LOAD_OP_LOAD) {
+        render_pass_create_info.dependencyCount = 1;
+        render_pass_create_info.pDependencies = &subpass_dependency;
+    }
+    VkResult result = vkCreateRenderPass(context->device, &render_pass_create_info, nullptr, render_pass);
     assert(result == VK_SUCCESS);
 }
 
@@ -365,7 +465,7 @@ static void create_framebuffers(VkContext *context, uint32_t width, uint32_t hei
     {
         // create depth images
         context->depth_images.resize(context->swapchain_image_count);
-        context->depth_image_memories.resize(context->swapchain_image_count);
+        context->depth_image_allocations.resize(context->swapchain_image_count);
         context->depth_image_views.resize(context->swapchain_image_count);
         for (size_t i = 0; i < context->swapchain_image_count; ++i) {
             VkImageCreateInfo image_create_info = {};
@@ -377,19 +477,14 @@ static void create_framebuffers(VkContext *context, uint32_t width, uint32_t hei
             image_create_info.arrayLayers = 1;
             image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
             image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-            image_create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+            image_create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT; // 采样用于构建Hi-Z
             image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
             image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
             VkResult result = vkCreateImage(context->device, &image_create_info, nullptr, &context->depth_images[i]);
             assert(result == VK_SUCCESS);
 
-            VkMemoryRequirements memory_requirements;
-            vkGetImageMemoryRequirements(context->device, context->depth_images[i], &memory_requirements);
-            uint32_t memory_type_index = UINT32_MAX;
-            get_memory_type_index(context, memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                  &memory_type_index);
-            allocate_memory(context, memory_requirements.size, memory_type_index, &context->depth_image_memories[i]);
-            vkBindImageMemory(context->device, context->depth_images[i], context->depth_image_memories[i], 0);
+            allocate_image_memory(context, context->depth_images[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  &context->depth_image_allocations[i]);
 
             VkImageViewCreateInfo image_view_create_info = {};
             image_view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -434,6 +529,7 @@ static void create_framebuffers(VkContext *context, uint32_t width, uint32_t hei
 static void create_descriptor_set_layout(VkContext *context) {
     VkDescriptorSetLayoutBinding descriptor_set_layout_bindings[] = {
         {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2, VK_SHADER_STAGE_VERTEX_BIT, nullptr}, // camera array with 2 cameras
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr}, // per-frame instance data
     };
 
     VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {};
@@ -445,158 +541,160 @@ static void create_descriptor_set_layout(VkContext *context) {
     assert(result == VK_SUCCESS);
 }
 
-static void create_pipeline_layout(VkContext *context, size_t push_constant_size) {
-    VkPushConstantRange push_constant_range = {};
-    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    push_constant_range.offset = 0;
-    push_constant_range.size = push_constant_size;
-
+static void create_pipeline_layout(VkContext *context) {
     VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
     pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipeline_layout_create_info.setLayoutCount = 1;
     pipeline_layout_create_info.pSetLayouts = &context->descriptor_set_layout;
-    pipeline_layout_create_info.pushConstantRangeCount = 1;
-    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
     VkResult result = vkCreatePipelineLayout(context->device, &pipeline_layout_create_info, nullptr,
                                              &context->pipeline_layout);
     assert(result == VK_SUCCESS);
 }
 
-static void create_shader_module(VkContext *context, const char *filepath, VkShaderModule *shader_module) {
+// FNV-1a
+static uint64_t hash_bytes(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool is_pipeline_cache_data_valid(const VkPhysicalDeviceProperties &device_properties, const std::vector<char> &file_data) {
+    PipelineCacheFileHeader file_header;
+    if (file_data.size() < sizeof(file_header)) {
+        return false;
+    }
+    memcpy(&file_header, file_data.data(), sizeof(file_header));
+    if (file_header.magic != PIPELINE_CACHE_FILE_MAGIC || file_header.version != PIPELINE_CACHE_FILE_VERSION ||
+        file_header.vendor_id != device_properties.vendorID || file_header.device_id != device_properties.deviceID ||
+        file_header.driver_version != device_properties.driverVersion ||
+        memcmp(file_header.pipeline_cache_uuid, device_properties.pipelineCacheUUID, VK_UUID_SIZE) != 0 ||
+        file_header.data_size != file_data.size() - sizeof(file_header)) {
+        return false;
+    }
+    const char *data = file_data.data() + sizeof(file_header);
+    if (hash_bytes(data, file_header.data_size) != file_header.data_hash) {
+        return false;
+    }
+
+    // 驱动数据自己的头也要和当前设备一致，否则vkCreatePipelineCache可能直接忽略甚至出错
+    VkPipelineCacheHeaderVersionOne cache_header;
+    if (file_header.data_size < sizeof(cache_header)) {
+        return false;
+    }
+    memcpy(&cache_header, data, sizeof(cache_header));
+    return cache_header.headerSize >= sizeof(cache_header) &&
+           cache_header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           cache_header.vendorID == device_properties.vendorID && cache_header.deviceID == device_properties.deviceID &&
+           memcmp(cache_header.pipelineCacheUUID, device_properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+static void create_pipeline_cache(VkContext *context) {
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(context->physical_device, &device_properties);
+
+    std::vector<char> file_data;
+    if (file_exists(PIPELINE_CACHE_FILEPATH)) {
+        file_data = read_binary_file(PIPELINE_CACHE_FILEPATH);
+        if (!is_pipeline_cache_data_valid(device_properties, file_data)) {
+            printf("discarding stale pipeline cache %s\n", PIPELINE_CACHE_FILEPATH);
+            file_data.clear();
+        }
+    }
+
+    VkPipelineCacheCreateInfo pipeline_cache_create_info = {};
+    pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (!file_data.empty()) {
+        pipeline_cache_create_info.initialDataSize = file_data.size() - sizeof(PipelineCacheFileHeader);
+        pipeline_cache_create_info.pInitialData = file_data.data() + sizeof(PipelineCacheFileHeader);
+    }
+    VkResult result = vkCreatePipelineCache(context->device, &pipeline_cache_create_info, nullptr,
+                                            &context->pipeline_cache);
+    if (result != VK_SUCCESS && !file_data.empty()) {
+        // 驱动拒绝了旧数据，用空cache重来
+        pipeline_cache_create_info.initialDataSize = 0;
+        pipeline_cache_create_info.pInitialData = nullptr;
+        result = vkCreatePipelineCache(context->device, &pipeline_cache_create_info, nullptr, &context->pipeline_cache);
+    }
+    assert(result == VK_SUCCESS);
+}
+
+void save_pipeline_cache(VkContext *context) {
+    size_t data_size = 0;
+    VkResult result = vkGetPipelineCacheData(context->device, context->pipeline_cache, &data_size, nullptr);
+    assert(result == VK_SUCCESS);
+    std::vector<char> file_data(sizeof(PipelineCacheFileHeader) + data_size);
+    result = vkGetPipelineCacheData(context->device, context->pipeline_cache, &data_size,
+                                    file_data.data() + sizeof(PipelineCacheFileHeader));
+    assert(result == VK_SUCCESS);
+    file_data.resize(sizeof(PipelineCacheFileHeader) + data_size);
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(context->physical_device, &device_properties);
+    PipelineCacheFileHeader file_header = {};
+    file_header.magic = PIPELINE_CACHE_FILE_MAGIC;
+    file_header.version = PIPELINE_CACHE_FILE_VERSION;
+    file_header.vendor_id = device_properties.vendorID;
+    file_header.device_id = device_properties.deviceID;
+    file_header.driver_version = device_properties.driverVersion;
+    memcpy(file_header.pipeline_cache_uuid, device_properties.pipelineCacheUUID, VK_UUID_SIZE);
+    file_header.data_size = data_size;
+    file_header.data_hash = hash_bytes(file_data.data() + sizeof(PipelineCacheFileHeader), data_size);
+    memcpy(file_data.data(), &file_header, sizeof(file_header));
+
+    if (!write_binary_file(PIPELINE_CACHE_FILEPATH, file_data.data(), file_data.size())) {
+        printf("failed to write pipeline cache %s\n", PIPELINE_CACHE_FILEPATH);
+    }
+}
+
+VkShaderModule get_shader_module(VkContext *context, const char *filepath, uint64_t *code_hash_out) {
     const auto code = read_binary_file(filepath);
+    uint64_t code_hash = hash_bytes(code.data(), code.size());
+    if (code_hash_out != nullptr) {
+        *code_hash_out = code_hash;
+    }
+    auto it = context->shader_modules.find(code_hash);
+    if (it != context->shader_modules.end()) {
+        return it->second;
+    }
 
     VkShaderModuleCreateInfo shader_module_create_info = {};
     shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     shader_module_create_info.codeSize = code.size();
     shader_module_create_info.pCode = (const uint32_t *) code.data();
-    VkResult result = vkCreateShaderModule(context->device, &shader_module_create_info, nullptr, shader_module);
+    VkShaderModule shader_module;
+    VkResult result = vkCreateShaderModule(context->device, &shader_module_create_info, nullptr, &shader_module);
     assert(result == VK_SUCCESS);
+    context->shader_modules[code_hash] = shader_module;
+    return shader_module;
 }
 
-static void create_pipeline(VkContext *context, VkPrimitiveTopology primitive_topology, VkPolygonMode polygon_mode, bool depth_test_enabled) {
-    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_LIST ||
-        primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
-        assert(polygon_mode == VK_POLYGON_MODE_LINE); // polygon mode must be line for line list or line strip topology
-    }
-
-    VkVertexInputBindingDescription vertex_input_binding_description = {};
-    vertex_input_binding_description.binding = 0;
-    vertex_input_binding_description.stride = sizeof(Vertex);
-    vertex_input_binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-    std::vector<VkVertexInputAttributeDescription> vertex_input_attribute_descriptions = {};
-    {
-        VkVertexInputAttributeDescription vertex_input_attribute_description = {};
-        vertex_input_attribute_description.binding = 0;
-        vertex_input_attribute_description.location = 0;
-        vertex_input_attribute_description.format = VK_FORMAT_R32G32B32_SFLOAT;
-        vertex_input_attribute_description.offset = offsetof(Vertex, position);
-
-        vertex_input_attribute_descriptions.push_back(vertex_input_attribute_description);
-    }
-
-    VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info = {};
-    vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_state_create_info.vertexBindingDescriptionCount = 1;
-    vertex_input_state_create_info.pVertexBindingDescriptions = &vertex_input_binding_description;
-    vertex_input_state_create_info.vertexAttributeDescriptionCount = vertex_input_attribute_descriptions.size();
-    vertex_input_state_create_info.pVertexAttributeDescriptions = vertex_input_attribute_descriptions.data();
-
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_state_create_info = {};
-    input_assembly_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly_state_create_info.topology = primitive_topology;
-    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP) {
-        input_assembly_state_create_info.primitiveRestartEnable = VK_TRUE;
-    }
-
-    VkPipelineRasterizationStateCreateInfo rasterization_state_create_info = {};
-    rasterization_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterization_state_create_info.polygonMode = polygon_mode;
-    rasterization_state_create_info.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterization_state_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterization_state_create_info.lineWidth = 1.0f;
-
-    VkPipelineColorBlendAttachmentState color_blend_attachment_state = {};
-    color_blend_attachment_state.colorWriteMask =
-            VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    color_blend_attachment_state.blendEnable = VK_FALSE;
-
-    VkPipelineColorBlendStateCreateInfo color_blend_state_create_info = {};
-    color_blend_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    color_blend_state_create_info.attachmentCount = 1;
-    color_blend_state_create_info.pAttachments = &color_blend_attachment_state;
-
-    VkPipelineDepthStencilStateCreateInfo depth_stencil_state_create_info = {};
-    depth_stencil_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil_state_create_info.depthTestEnable = depth_test_enabled ? VK_TRUE : VK_FALSE;
-    depth_stencil_state_create_info.depthWriteEnable = depth_test_enabled ? VK_TRUE : VK_FALSE;
-    depth_stencil_state_create_info.depthCompareOp = VK_COMPARE_OP_LESS;
-
-    VkPipelineViewportStateCreateInfo viewport_state_create_info = {};
-    viewport_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state_create_info.viewportCount = 1;
-    viewport_state_create_info.scissorCount = 1;
-
-    VkPipelineMultisampleStateCreateInfo multisample_state_create_info = {};
-    multisample_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisample_state_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
-    VkShaderModule vertex_shader_module = VK_NULL_HANDLE;
-    VkShaderModule fragment_shader_module = VK_NULL_HANDLE;
-    create_shader_module(context, "triangle.vert.spv", &vertex_shader_module);
-    create_shader_module(context, "triangle.frag.spv", &fragment_shader_module);
-
-    VkPipelineShaderStageCreateInfo shader_stage_create_infos[] = {
-        {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-            .stage = VK_SHADER_STAGE_VERTEX_BIT,
-            .module = vertex_shader_module,
-            .pName = "main",
-        },
-        {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-            .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-            .module = fragment_shader_module,
-            .pName = "main",
-        },
-    };
-
-    std::vector<VkDynamicState> dynamic_states = {};
-    dynamic_states.emplace_back(VK_DYNAMIC_STATE_VIEWPORT);
-    dynamic_states.emplace_back(VK_DYNAMIC_STATE_SCISSOR);
-    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
-        dynamic_states.emplace_back(VK_DYNAMIC_STATE_CULL_MODE);
-    }
-
-    VkPipelineDynamicStateCreateInfo dynamic_state_create_info = {};
-    dynamic_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_state_create_info.dynamicStateCount = dynamic_states.size();
-    dynamic_state_create_info.pDynamicStates = dynamic_states.data();
-
-    VkGraphicsPipelineCreateInfo pipeline_create_info = {};
-    pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_create_info.stageCount = std::size(shader_stage_create_infos);
-    pipeline_create_info.pStages = shader_stage_create_infos;
-    pipeline_create_info.pVertexInputState = &vertex_input_state_create_info;
-    pipeline_create_info.pInputAssemblyState = &input_assembly_state_create_info;
-    pipeline_create_info.pViewportState = &viewport_state_create_info;
-    pipeline_create_info.pRasterizationState = &rasterization_state_create_info;
-    pipeline_create_info.pMultisampleState = &multisample_state_create_info;
-    pipeline_create_info.pDepthStencilState = &depth_stencil_state_create_info;
-    pipeline_create_info.pColorBlendState = &color_blend_state_create_info;
-    pipeline_create_info.pDynamicState = &dynamic_state_create_info;
-    pipeline_create_info.layout = context->pipeline_layout;
-    pipeline_create_info.renderPass = context->render_pass;
-
-    VkPipeline pipeline;
-    VkResult result = vkCreateGraphicsPipelines(context->device, nullptr, 1, &pipeline_create_info, nullptr, &pipeline);
-    assert(result == VK_SUCCESS);
+static void init_gpu_allocator(VkContext *context) {
+    vkGetPhysicalDeviceMemoryProperties(context->physical_device, &context->gpu_allocator.memory_properties);
+}
 
-    PipelineKey pipeline_key(primitive_topology, polygon_mode, depth_test_enabled);
-    context->pipelines[pipeline_key] = pipeline;
+static void free_gpu_memory_block(VkContext *context, GpuMemoryBlock *block) {
+    if (block->mapped_data) {
+        vkUnmapMemory(context->device, block->memory);
+    }
+    vkFreeMemory(context->device, block->memory, nullptr);
+}
 
-    vkDestroyShaderModule(context->device, vertex_shader_module, nullptr);
-    vkDestroyShaderModule(context->device, fragment_shader_module, nullptr);
+static void cleanup_gpu_allocator(VkContext *context) {
+    for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; ++i) {
+        for (GpuMemoryPool &pool: context->gpu_allocator.pools[i]) {
+            for (std::unique_ptr<GpuMemoryBlock> &block: pool.blocks) {
+                if (block) {
+                    assert(block->buddy_allocator.allocation_count == 0); // 有资源没有释放
+                    free_gpu_memory_block(context, block.get());
+                }
+            }
+            pool.blocks.clear();
+        }
+    }
 }
 
 void init_vk(VkContext *context, GLFWwindow *window, uint32_t width, uint32_t height) {
@@ -604,26 +702,30 @@ void init_vk(VkContext *context, GLFWwindow *window, uint32_t width, uint32_t he
     create_surface(context, window);
     pick_physical_device(context);
     create_device(context);
+    init_gpu_allocator(context);
     create_swapchain(context, width, height);
     context->depth_image_format = VK_FORMAT_D16_UNORM;
-    create_render_pass(context);
+    create_render_pass(context, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                       VK_ATTACHMENT_STORE_OP_DONT_CARE, &context->render_pass);
+    create_render_pass(context, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_IMAGE_LAYOUT_UNDEFINED,
+                       VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_ATTACHMENT_STORE_OP_STORE,
+                       &context->early_render_pass);
+    create_render_pass(context, VK_ATTACHMENT_LOAD_OP_LOAD, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                       VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_ATTACHMENT_STORE_OP_DONT_CARE, &context->late_render_pass);
     create_framebuffers(context, width, height);
     create_command_pool(context);
     create_descriptor_set_layout(context);
-    create_pipeline_layout(context, sizeof(InstanceConstants));
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_FILL, true);
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_FILL, false);
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_LINE, true);
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_POLYGON_MODE_LINE, false);
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_LINE_LIST, VK_POLYGON_MODE_LINE, true);
-    create_pipeline(context, VK_PRIMITIVE_TOPOLOGY_LINE_STRIP, VK_POLYGON_MODE_LINE, true);
+    create_pipeline_layout(context);
+    create_pipeline_cache(context);
 }
 
 void cleanup_vk(VkContext *context) {
-    for (auto &[_, pipeline]: context->pipelines) {
-        vkDestroyPipeline(context->device, pipeline, nullptr);
+    for (auto &[_, shader_module]: context->shader_modules) {
+        vkDestroyShaderModule(context->device, shader_module, nullptr);
     }
-    context->pipelines.clear();
+    context->shader_modules.clear();
+    save_pipeline_cache(context);
+    vkDestroyPipelineCache(context->device, context->pipeline_cache, nullptr);
     vkDestroyPipelineLayout(context->device, context->pipeline_layout, nullptr);
     vkDestroyDescriptorSetLayout(context->device, context->descriptor_set_layout, nullptr);
     vkDestroyCommandPool(context->device, context->command_pool, nullptr);
@@ -633,12 +735,14 @@ void cleanup_vk(VkContext *context) {
     context->framebuffers.clear();
     for (size_t i = 0; i < context->depth_image_views.size(); ++i) {
         vkDestroyImageView(context->device, context->depth_image_views[i], nullptr);
-        vkFreeMemory(context->device, context->depth_image_memories[i], nullptr);
         vkDestroyImage(context->device, context->depth_images[i], nullptr);
+        free_gpu_memory(context, context->depth_image_allocations[i]);
     }
     context->depth_image_views.clear();
-    context->depth_image_memories.clear();
+    context->depth_image_allocations.clear();
     context->depth_images.clear();
+    vkDestroyRenderPass(context->device, context->late_render_pass, nullptr);
+    vkDestroyRenderPass(context->device, context->early_render_pass, nullptr);
     vkDestroyRenderPass(context->device, context->render_pass, nullptr);
     for (uint32_t i = 0; i < context->swapchain_image_views.size(); ++i) {
         vkDestroyImageView(context->device, context->swapchain_image_views[i], nullptr);
@@ -646,6 +750,7 @@ void cleanup_vk(VkContext *context) {
     context->swapchain_image_views.clear();
     context->swapchain_images.clear();
     vkDestroySwapchainKHR(context->device, context->swapchain, nullptr);
+    cleanup_gpu_allocator(context);
     vkDestroyDevice(context->device, nullptr);
     vkDestroySurfaceKHR(context->instance, context->surface, nullptr);
     auto vkDestroyDebugUtilsMessengerEXT = LOAD_INSTANCE_PROC_ADDR(context->instance, vkDestroyDebugUtilsMessengerEXT);
@@ -691,7 +796,8 @@ void present(VkContext *context, VkSemaphore wait_semaphore, uint32_t image_inde
 }
 
 void begin_render_pass(VkContext *context, VkCommandBuffer command_buffer, VkRenderPass render_pass,
-                       VkFramebuffer framebuffer, uint32_t width, uint32_t height, VkClearValue *clear_values, size_t clear_value_count) {
+                       VkFramebuffer framebuffer, uint32_t width, uint32_t height, VkClearValue *clear_values, size_t clear_value_count,
+                       VkSubpassContents subpass_contents) {
     VkRenderPassBeginInfo render_pass_begin_info = {};
     render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_begin_info.renderPass = render_pass;
@@ -700,7 +806,7 @@ void begin_render_pass(VkContext *context, VkCommandBuffer command_buffer, VkRen
     render_pass_begin_info.renderArea.extent.height = height;
     render_pass_begin_info.clearValueCount = clear_value_count;
     render_pass_begin_info.pClearValues = clear_values;
-    vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, subpass_contents);
 }
 
 void end_render_pass(VkContext *context, VkCommandBuffer command_buffer) {
@@ -732,13 +838,13 @@ void create_buffer(VkContext *context, VkDeviceSize size, VkBufferUsageFlags usa
 
 void get_memory_type_index(VkContext *context, const VkMemoryRequirements &memory_requirements,
                            VkMemoryPropertyFlags memory_property_flags, uint32_t *memory_type_index) {
-    VkPhysicalDeviceMemoryProperties memory_properties;
-    vkGetPhysicalDeviceMemoryProperties(context->physical_device, &memory_properties);
+    const VkPhysicalDeviceMemoryProperties &memory_properties = context->gpu_allocator.memory_properties;
 
     *memory_type_index = UINT32_MAX;
     for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        // 要求的属性必须全部满足
         if ((memory_requirements.memoryTypeBits & (1 << i)) &&
-            memory_properties.memoryTypes[i].propertyFlags & memory_property_flags) {
+            (memory_properties.memoryTypes[i].propertyFlags & memory_property_flags) == memory_property_flags) {
             *memory_type_index = i;
             break;
         }
@@ -746,16 +852,146 @@ void get_memory_type_index(VkContext *context, const VkMemoryRequirements &memor
     assert(*memory_type_index != UINT32_MAX);
 }
 
-void allocate_memory(VkContext *context, VkDeviceSize size, uint32_t memory_type_index, VkDeviceMemory *memory) {
-    VkMemoryAllocateInfo memory_allocate_info = {};
-    memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memory_allocate_info.allocationSize = size;
-    memory_allocate_info.memoryTypeIndex = memory_type_index;
+void allocate_gpu_memory(VkContext *context, const VkMemoryRequirements &memory_requirements,
+                         VkMemoryPropertyFlags memory_property_flags, bool linear, GpuAllocation *allocation) {
+    uint32_t memory_type_index = UINT32_MAX;
+    get_memory_type_index(context, memory_requirements, memory_property_flags, &memory_type_index);
+    uint32_t pool_index = linear ? 0 : 1;
+    GpuAllocator *gpu_allocator = &context->gpu_allocator;
+    GpuMemoryPool *pool = &gpu_allocator->pools[memory_type_index][pool_index];
+
+    std::lock_guard<std::mutex> lock(gpu_allocator->mutex);
+    uint64_t offset = 0;
+    uint32_t block_index = 0;
+    uint32_t empty_slot_index = UINT32_MAX;
+    for (; block_index < pool->blocks.size(); ++block_index) {
+        GpuMemoryBlock *block = pool->blocks[block_index].get();
+        if (!block) {
+            empty_slot_index = std::min(empty_slot_index, block_index);
+            continue;
+        }
+        if (allocate_buddy_block(&block->buddy_allocator, memory_requirements.size, memory_requirements.alignment,
+                                 &offset)) {
+            break;
+        }
+    }
+
+    if (block_index == pool->blocks.size()) {
+        // 现有的块都放不下，向驱动申请新块
+        VkDeviceSize block_size = std::max<VkDeviceSize>(
+            GPU_MEMORY_BLOCK_SIZE, std::bit_ceil(std::max(memory_requirements.size, memory_requirements.alignment)));
+        auto block = std::make_unique<GpuMemoryBlock>();
+
+        VkMemoryAllocateInfo memory_allocate_info = {};
+        memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memory_allocate_info.allocationSize = block_size;
+        memory_allocate_info.memoryTypeIndex = memory_type_index;
+        VkResult result = vkAllocateMemory(context->device, &memory_allocate_info, nullptr, &block->memory);
+        assert(result == VK_SUCCESS);
+
+        block->mapped_data = nullptr;
+        if (gpu_allocator->memory_properties.memoryTypes[memory_type_index].propertyFlags &
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            result = vkMapMemory(context->device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped_data);
+            assert(result == VK_SUCCESS);
+        }
+
+        init_buddy_allocator(&block->buddy_allocator, block_size, GPU_MEMORY_MIN_ALLOCATION_SIZE);
+        bool allocated = allocate_buddy_block(&block->buddy_allocator, memory_requirements.size,
+                                              memory_requirements.alignment, &offset);
+        assert(allocated);
+
+        if (empty_slot_index != UINT32_MAX) {
+            block_index = empty_slot_index;
+            pool->blocks[block_index] = std::move(block);
+        } else {
+            pool->blocks.emplace_back(std::move(block));
+        }
+    }
+
+    GpuMemoryBlock *block = pool->blocks[block_index].get();
+    allocation->memory = block->memory;
+    allocation->offset = offset;
+    allocation->size = memory_requirements.size;
+    allocation->mapped_data = block->mapped_data ? static_cast<char *>(block->mapped_data) + offset : nullptr;
+    allocation->memory_type_index = memory_type_index;
+    allocation->pool_index = pool_index;
+    allocation->block_index = block_index;
+}
+
+void free_gpu_memory(VkContext *context, const GpuAllocation &allocation) {
+    GpuAllocator *gpu_allocator = &context->gpu_allocator;
+    GpuMemoryPool *pool = &gpu_allocator->pools[allocation.memory_type_index][allocation.pool_index];
+
+    std::lock_guard<std::mutex> lock(gpu_allocator->mutex);
+    std::unique_ptr<GpuMemoryBlock> &block = pool->blocks[allocation.block_index];
+    assert(block && block->memory == allocation.memory);
+    free_buddy_block(&block->buddy_allocator, allocation.offset);
+    // 第一个块常驻，其余块空了就还给驱动，避免一次大分配之后一直占着内存
+    if (block->buddy_allocator.allocation_count == 0 && allocation.block_index > 0) {
+        free_gpu_memory_block(context, block.get());
+        block.reset();
+    }
+}
+
+void create_buffer_with_memory(VkContext *context, VkDeviceSize size, VkBufferUsageFlags usage,
+                               VkMemoryPropertyFlags memory_property_flags, VkBuffer *buffer, GpuAllocation *allocation) {
+    create_buffer(context, size, usage, buffer);
+
+    VkMemoryRequirements memory_requirements;
+    vkGetBufferMemoryRequirements(context->device, *buffer, &memory_requirements);
+    allocate_gpu_memory(context, memory_requirements, memory_property_flags, true, allocation);
+    VkResult result = vkBindBufferMemory(context->device, *buffer, allocation->memory, allocation->offset);
+    assert(result == VK_SUCCESS);
+}
+
+void destroy_buffer_with_memory(VkContext *context, VkBuffer buffer, const GpuAllocation &allocation) {
+    vkDestroyBuffer(context->device, buffer, nullptr);
+    free_gpu_memory(context, allocation);
+}
 
-    VkResult result = vkAllocateMemory(context->device, &memory_allocate_info, nullptr, memory);
+void allocate_image_memory(VkContext *context, VkImage image, VkMemoryPropertyFlags memory_property_flags,
+                           GpuAllocation *allocation) {
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(context->device, image, &memory_requirements);
+    allocate_gpu_memory(context, memory_requirements, memory_property_flags, false, allocation);
+    VkResult result = vkBindImageMemory(context->device, image, allocation->memory, allocation->offset);
     assert(result == VK_SUCCESS);
 }
 
+GpuAllocatorStatistics get_gpu_allocator_statistics(VkContext *context) {
+    GpuAllocatorStatistics statistics = {};
+    GpuAllocator *gpu_allocator = &context->gpu_allocator;
+    std::lock_guard<std::mutex> lock(gpu_allocator->mutex);
+    for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; ++i) {
+        for (const GpuMemoryPool &pool: gpu_allocator->pools[i]) {
+            for (const std::unique_ptr<GpuMemoryBlock> &block: pool.blocks) {
+                if (!block) {
+                    continue;
+                }
+                BuddyAllocatorStatistics block_statistics = get_buddy_allocator_statistics(&block->buddy_allocator);
+                ++statistics.block_count;
+                statistics.allocation_count += block_statistics.allocation_count;
+                statistics.reserved_size += block_statistics.size;
+                statistics.allocated_size += block_statistics.allocated_size;
+                statistics.requested_size += block_statistics.requested_size;
+                statistics.free_size += block_statistics.free_size;
+                statistics.largest_free_block_size = std::max(statistics.largest_free_block_size,
+                                                              block_statistics.largest_free_block_size);
+            }
+        }
+    }
+    if (statistics.allocated_size > 0) {
+        statistics.internal_fragmentation = 1.0f - static_cast<float>(statistics.requested_size) /
+                                                   static_cast<float>(statistics.allocated_size);
+    }
+    if (statistics.free_size > 0) {
+        statistics.external_fragmentation = 1.0f - static_cast<float>(statistics.largest_free_block_size) /
+                                                   static_cast<float>(statistics.free_size);
+    }
+    return statistics;
+}
+
 void set_viewport(VkCommandBuffer command_buffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
     VkViewport viewport = {};
     viewport.x = (float) x;
@@ -787,14 +1023,166 @@ void allocate_descriptor_set(VkContext *context, VkDescriptorPool descriptor_poo
     assert(result == VK_SUCCESS);
 }
 
-VkPipeline get_pipeline(VkContext *context, PipelineKey pipeline_key) {
-    if (const auto it = context->pipelines.find(pipeline_key); it != context->pipelines.end()) { return it->second; }
-    assert(false);
-}
-
 void apply_pipeline_dynamic_states(VkContext *context, VkCommandBuffer command_buffer, PipelineKey pipeline_key,
                                    VkCullModeFlags cull_mode) {
-    if (pipeline_key.primitive_topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
+    VkPrimitiveTopology primitive_topology = static_cast<VkPrimitiveTopology>(pipeline_key.primitive_topology);
+    // 扩展动态状态下线也可能用三角形的pipeline，cull mode对线没有影响
+    if (primitive_topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST || context->extended_dynamic_state_supported) {
         vkCmdSetCullMode(command_buffer, cull_mode);
     }
+    if (context->extended_dynamic_state_supported) {
+        vkCmdSetDepthTestEnable(command_buffer, pipeline_key.depth_test ? VK_TRUE : VK_FALSE);
+        vkCmdSetDepthWriteEnable(command_buffer, pipeline_key.depth_test ? VK_TRUE : VK_FALSE);
+        vkCmdSetPrimitiveTopology(command_buffer, primitive_topology);
+        vkCmdSetPrimitiveRestartEnable(command_buffer, primitive_topology == VK_PRIMITIVE_TOPOLOGY_LINE_STRIP ? VK_TRUE : VK_FALSE);
+    }
+    if (context->dynamic_polygon_mode_supported) {
+        context->vkCmdSetPolygonModeEXT(command_buffer, static_cast<VkPolygonMode>(pipeline_key.polygon_mode));
+    }
+}
+
+void init_upload_queue(VkContext *context, uint32_t frame_count) {
+    UploadQueue *upload_queue = &context->upload_queue;
+    create_buffer_with_memory(context, STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              &upload_queue->staging_buffer, &upload_queue->staging_allocation);
+    upload_queue->staging_ring_head = 0;
+    upload_queue->staging_ring_tail = 0;
+    upload_queue->pending_batch = {};
+    upload_queue->in_flight_batches.clear();
+    upload_queue->in_flight_batches.resize(frame_count);
+}
+
+static void finish_upload_batch(VkContext *context, UploadBatch *upload_batch) {
+    for (auto &[buffer, allocation]: upload_batch->temporary_staging_buffers) {
+        destroy_buffer_with_memory(context, buffer, allocation);
+    }
+    for (std::function<void()> &completion: upload_batch->completions) {
+        completion();
+    }
+    *upload_batch = {};
+}
+
+void cleanup_upload_queue(VkContext *context) {
+    UploadQueue *upload_queue = &context->upload_queue;
+    // completion可能再入队（比如销毁任务），直到两边都清空
+    while (true) {
+        UploadBatch upload_batch;
+        {
+            std::lock_guard<std::mutex> lock(upload_queue->mutex);
+            for (UploadBatch &in_flight_batch: upload_queue->in_flight_batches) {
+                std::move(in_flight_batch.completions.begin(), in_flight_batch.completions.end(),
+                          std::back_inserter(upload_batch.completions));
+                std::move(in_flight_batch.temporary_staging_buffers.begin(),
+                          in_flight_batch.temporary_staging_buffers.end(),
+                          std::back_inserter(upload_batch.temporary_staging_buffers));
+                in_flight_batch = {};
+            }
+            std::move(upload_queue->pending_batch.completions.begin(), upload_queue->pending_batch.completions.end(),
+                      std::back_inserter(upload_batch.completions));
+            std::move(upload_queue->pending_batch.temporary_staging_buffers.begin(),
+                      upload_queue->pending_batch.temporary_staging_buffers.end(),
+                      std::back_inserter(upload_batch.temporary_staging_buffers));
+            upload_queue->pending_batch = {};
+        }
+        if (upload_batch.completions.empty() && upload_batch.temporary_staging_buffers.empty()) {
+            break;
+        }
+        finish_upload_batch(context, &upload_batch);
+    }
+    upload_queue->in_flight_batches.clear();
+    destroy_buffer_with_memory(context, upload_queue->staging_buffer, upload_queue->staging_allocation);
+}
+
+// 在ring中预留size字节，空间不够（GPU还没读完）返回false；预留的区间不跨越ring末尾
+static bool reserve_staging_ring(UploadQueue *upload_queue, VkDeviceSize size, VkDeviceSize *staging_offset) {
+    uint64_t head = (upload_queue->staging_ring_head + STAGING_RING_ALIGNMENT - 1) & ~(STAGING_RING_ALIGNMENT - 1ull);
+    uint64_t offset = head % STAGING_RING_SIZE;
+    if (offset + size > STAGING_RING_SIZE) {
+        head += STAGING_RING_SIZE - offset;
+        offset = 0;
+    }
+    if (head + size - upload_queue->staging_ring_tail > STAGING_RING_SIZE) {
+        return false;
+    }
+    upload_queue->staging_ring_head = head + size;
+    *staging_offset = offset;
+    return true;
+}
+
+void enqueue_buffer_upload(VkContext *context, VkBuffer dst_buffer, VkDeviceSize dst_offset, const void *data,
+                           VkDeviceSize size) {
+    UploadQueue *upload_queue = &context->upload_queue;
+    {
+        // 预留、写入、入队必须在同一次加锁内完成：否则record_uploads可能记下包含这段区间的ring_end，
+        // 这一帧完成后区间就被回收，而它的拷贝还没录制
+        std::lock_guard<std::mutex> lock(upload_queue->mutex);
+        VkDeviceSize staging_offset = 0;
+        if (reserve_staging_ring(upload_queue, size, &staging_offset)) {
+            memcpy(static_cast<char *>(upload_queue->staging_allocation.mapped_data) + staging_offset, data, size);
+            upload_queue->pending_batch.uploads.push_back({
+                upload_queue->staging_buffer, staging_offset, dst_buffer, dst_offset, size
+            });
+            return;
+        }
+    }
+
+    // ring满了或者数据比ring还大，不等GPU，临时建一个staging buffer
+    VkBuffer staging_buffer;
+    GpuAllocation staging_allocation;
+    create_buffer_with_memory(context, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              &staging_buffer, &staging_allocation);
+    memcpy(staging_allocation.mapped_data, data, size);
+    std::lock_guard<std::mutex> lock(upload_queue->mutex);
+    upload_queue->pending_batch.uploads.push_back({staging_buffer, 0, dst_buffer, dst_offset, size});
+    upload_queue->pending_batch.temporary_staging_buffers.emplace_back(staging_buffer, staging_allocation);
+}
+
+void enqueue_upload_completion(VkContext *context, std::function<void()> &&completion) {
+    std::lock_guard<std::mutex> lock(context->upload_queue.mutex);
+    context->upload_queue.pending_batch.completions.push_back(std::move(completion));
+}
+
+void record_uploads(VkContext *context, VkCommandBuffer command_buffer, uint32_t frame_index) {
+    UploadQueue *upload_queue = &context->upload_queue;
+    UploadBatch &upload_batch = upload_queue->in_flight_batches[frame_index];
+    assert(upload_batch.uploads.empty() && upload_batch.completions.empty()); // complete_uploads必须先调用
+    {
+        std::lock_guard<std::mutex> lock(upload_queue->mutex);
+        std::swap(upload_batch, upload_queue->pending_batch);
+        upload_batch.staging_ring_end = upload_queue->staging_ring_head;
+    }
+    if (upload_batch.uploads.empty()) {
+        return;
+    }
+
+    // 一帧内所有上传合并进同一个command buffer和同一次submit，不单独提交
+    for (const BufferUpload &upload: upload_batch.uploads) {
+        VkBufferCopy buffer_copy = {};
+        buffer_copy.srcOffset = upload.staging_offset;
+        buffer_copy.dstOffset = upload.dst_offset;
+        buffer_copy.size = upload.size;
+        vkCmdCopyBuffer(command_buffer, upload.staging_buffer, upload.dst_buffer, 1, &buffer_copy);
+    }
+    // 只有一个queue family，不需要所有权转移，一个全局barrier让拷贝结果对顶点输入可见
+    VkMemoryBarrier memory_barrier = {};
+    memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                         1, &memory_barrier, 0, nullptr, 0, nullptr);
+    upload_batch.uploads.clear();
+}
+
+void complete_uploads(VkContext *context, uint32_t frame_index) {
+    UploadQueue *upload_queue = &context->upload_queue;
+    UploadBatch upload_batch = std::move(upload_queue->in_flight_batches[frame_index]);
+    upload_queue->in_flight_batches[frame_index] = {};
+    if (upload_batch.staging_ring_end != 0) {
+        std::lock_guard<std::mutex> lock(upload_queue->mutex);
+        // 帧按顺序完成，tail只会前进
+        upload_queue->staging_ring_tail = std::max(upload_queue->staging_ring_tail, upload_batch.staging_ring_end);
+    }
+    finish_upload_batch(context, &upload_batch);
 }
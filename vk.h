@@ -4,8 +4,19 @@
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
+#include "buddy_allocator.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#define GPU_MEMORY_BLOCK_SIZE (64ull << 20) // 每个VkDeviceMemory的大小，超过的分配单独建一个足够大的块
+#define GPU_MEMORY_MIN_ALLOCATION_SIZE 256 // 不小于nonCoherentAtomSize和UBO/SSBO的offset对齐
+#define STAGING_RING_SIZE (16ull << 20) // 上传用的staging ring，放不下的上传临时创建一个staging buffer
+#define STAGING_RING_ALIGNMENT 16
+#define PIPELINE_CACHE_FILEPATH "pipeline_cache.bin" // 相对工作目录，和.spv文件放在一起
+
 struct PipelineKey {
     // 位域布局（总共64位）：
     // [0-4]   primitive_topology (5 bits)
@@ -20,15 +31,19 @@ struct PipelineKey {
         uint32_t state_bits; // 低32位状态
     };
 
-    uint32_t shader_hash; // 高32位：shader hash
+    uint32_t shader_hash; // 高32位：shader hash，见register_shader_program
 
-    PipelineKey(VkPrimitiveTopology topology, VkPolygonMode mode, bool depth_test_enabled)
-        : state_bits(0), shader_hash(0) {
+    PipelineKey(VkPrimitiveTopology topology, VkPolygonMode mode, bool depth_test_enabled, uint32_t shader_program_hash)
+        : state_bits(0), shader_hash(shader_program_hash) {
         primitive_topology = static_cast<uint32_t>(topology);
         polygon_mode = static_cast<uint32_t>(mode);
         depth_test = depth_test_enabled ? 1 : 0;
     }
 
+    PipelineKey(uint32_t pipeline_state_bits, uint32_t shader_program_hash)
+        : state_bits(pipeline_state_bits), shader_hash(shader_program_hash) {
+    }
+
     bool operator==(const PipelineKey &other) const {
         return state_bits == other.state_bits && shader_hash == other.shader_hash;
     }
@@ -43,12 +58,80 @@ struct PipelineKeyHash {
     }
 };
 
-struct InstanceConstants {
+// 与triangle.vert中InstanceBuffer的std430布局一致
+struct InstanceData {
     glm::mat4 model;
     glm::vec3 color;
     uint32_t camera_index;
 };
 
+// 一次vkAllocateMemory得到的大块内存，用伙伴分配器切分
+struct GpuMemoryBlock {
+    VkDeviceMemory memory;
+    void *mapped_data; // host visible的内存持久映射，否则为nullptr
+    BuddyAllocator buddy_allocator;
+};
+
+// 同一memory type下linear（buffer）和optimal（image）资源分开放，避免处理bufferImageGranularity
+struct GpuMemoryPool {
+    std::vector<std::unique_ptr<GpuMemoryBlock>> blocks;
+};
+
+struct GpuAllocator {
+    std::mutex mutex; // worker线程上传mesh时也会分配
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    GpuMemoryPool pools[VK_MAX_MEMORY_TYPES][2]; // [memory_type_index][linear ? 0 : 1]
+};
+
+struct GpuAllocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void *mapped_data; // 已加上offset，非host visible时为nullptr
+    uint32_t memory_type_index;
+    uint32_t pool_index; // 0: linear, 1: optimal
+    uint32_t block_index;
+};
+
+struct GpuAllocatorStatistics {
+    uint32_t block_count;
+    uint32_t allocation_count;
+    uint64_t reserved_size; // 向驱动申请的总大小
+    uint64_t allocated_size; // 按伙伴块大小计
+    uint64_t requested_size;
+    uint64_t free_size;
+    uint64_t largest_free_block_size;
+    float internal_fragmentation; // 1 - requested / allocated，伙伴块向上取整浪费的比例
+    float external_fragmentation; // 1 - largest_free_block / free，空闲空间被切碎的程度
+};
+
+struct BufferUpload {
+    VkBuffer staging_buffer;
+    VkDeviceSize staging_offset;
+    VkBuffer dst_buffer;
+    VkDeviceSize dst_offset;
+    VkDeviceSize size;
+};
+
+struct UploadBatch {
+    std::vector<BufferUpload> uploads;
+    std::vector<std::pair<VkBuffer, GpuAllocation>> temporary_staging_buffers; // 完成后销毁
+    std::vector<std::function<void()>> completions; // 完成后在主线程按入队顺序调用
+    uint64_t staging_ring_end; // 完成后staging ring可以回收到的位置
+};
+
+// 上传队列：worker线程把数据写入staging并入队，主线程把一帧内的所有拷贝录制进该帧的command buffer，
+// 帧的fence signal之后回收staging并通知完成
+struct UploadQueue {
+    std::mutex mutex;
+    VkBuffer staging_buffer;
+    GpuAllocation staging_allocation;
+    uint64_t staging_ring_head; // 单调递增，对STAGING_RING_SIZE取模得到偏移
+    uint64_t staging_ring_tail; // GPU可能还在读的最早位置
+    UploadBatch pending_batch; // 尚未录制
+    std::vector<UploadBatch> in_flight_batches; // 按frame index
+};
+
 struct VkContext {
     VkInstance instance;
     VkDebugUtilsMessengerEXT debug_utils_messenger;
@@ -56,6 +139,17 @@ struct VkContext {
     VkPhysicalDevice physical_device;
     uint32_t queue_family_index;
     VkDevice device;
+    bool multi_draw_indirect_supported;
+    bool draw_indirect_first_instance_supported;
+    bool draw_indirect_count_supported;
+    bool timestamps_supported;
+    // 扩展动态状态（见get_compiled_pipeline_key）：extended_dynamic_state为1.3核心的EXT_extended_dynamic_state/2，
+    // 深度测试/写入、同一类别内的topology和primitive restart在录制时设置；不支持时每种组合一个pipeline
+    bool extended_dynamic_state_supported;
+    bool dynamic_polygon_mode_supported; // EXT_extended_dynamic_state3的extendedDynamicState3PolygonMode
+    bool dynamic_primitive_topology_unrestricted; // 线和三角形可以共用一个pipeline
+    PFN_vkCmdSetPolygonModeEXT vkCmdSetPolygonModeEXT;
+    float timestamp_period; // 每个timestamp tick的纳秒数
     VkQueue queue;
     VkSwapchainKHR swapchain;
     VkFormat surface_format;
@@ -65,14 +159,21 @@ struct VkContext {
     std::vector<VkImageView> swapchain_image_views;
     VkCommandPool command_pool;
     VkRenderPass render_pass;
+    // 两阶段遮挡剔除把一帧拆成两个render pass：early清屏并保留深度，之后构建Hi-Z，late接着画并present
+    VkRenderPass early_render_pass;
+    VkRenderPass late_render_pass;
     VkFormat depth_image_format;
     std::vector<VkImage> depth_images;
-    std::vector<VkDeviceMemory> depth_image_memories;
+    std::vector<GpuAllocation> depth_image_allocations;
     std::vector<VkImageView> depth_image_views;
     std::vector<VkFramebuffer> framebuffers;
     VkDescriptorSetLayout descriptor_set_layout;
     VkPipelineLayout pipeline_layout;
-    std::unordered_map<PipelineKey, VkPipeline, PipelineKeyHash> pipelines;
+    // 启动时从PIPELINE_CACHE_FILEPATH加载，cleanup_vk时写回；所有graphics/compute pipeline都通过它创建
+    VkPipelineCache pipeline_cache;
+    std::unordered_map<uint64_t, VkShaderModule> shader_modules; // key为SPIR-V内容的hash，cleanup_vk时销毁
+    GpuAllocator gpu_allocator;
+    UploadQueue upload_queue;
 };
 
 void init_vk(VkContext *context, GLFWwindow *window, uint32_t width, uint32_t height);
@@ -87,7 +188,8 @@ void submit(VkContext *context, VkCommandBuffer command_buffer, VkSemaphore wait
 void present(VkContext *context, VkSemaphore wait_semaphore, uint32_t image_index);
 
 void begin_render_pass(VkContext *context, VkCommandBuffer command_buffer, VkRenderPass render_pass,
-                       VkFramebuffer framebuffer, uint32_t width, uint32_t height, VkClearValue *clear_values, size_t clear_value_count);
+                       VkFramebuffer framebuffer, uint32_t width, uint32_t height, VkClearValue *clear_values, size_t clear_value_count,
+                       VkSubpassContents subpass_contents = VK_SUBPASS_CONTENTS_INLINE);
 
 void end_render_pass(VkContext *context, VkCommandBuffer command_buffer);
 
@@ -100,7 +202,41 @@ void create_buffer(VkContext *context, VkDeviceSize size, VkBufferUsageFlags usa
 void get_memory_type_index(VkContext *context, const VkMemoryRequirements &memory_requirements,
                            VkMemoryPropertyFlags memory_property_flags, uint32_t *memory_type_index);
 
-void allocate_memory(VkContext *context, VkDeviceSize size, uint32_t memory_type_index, VkDeviceMemory *memory);
+// 从memory_property_flags全部满足的memory type中子分配，linear表示buffer或linear tiling的image
+void allocate_gpu_memory(VkContext *context, const VkMemoryRequirements &memory_requirements,
+                         VkMemoryPropertyFlags memory_property_flags, bool linear, GpuAllocation *allocation);
+
+void free_gpu_memory(VkContext *context, const GpuAllocation &allocation);
+
+// 创建buffer并绑定子分配的内存
+void create_buffer_with_memory(VkContext *context, VkDeviceSize size, VkBufferUsageFlags usage,
+                               VkMemoryPropertyFlags memory_property_flags, VkBuffer *buffer, GpuAllocation *allocation);
+
+void destroy_buffer_with_memory(VkContext *context, VkBuffer buffer, const GpuAllocation &allocation);
+
+// 为optimal tiling的image分配并绑定内存
+void allocate_image_memory(VkContext *context, VkImage image, VkMemoryPropertyFlags memory_property_flags,
+                           GpuAllocation *allocation);
+
+GpuAllocatorStatistics get_gpu_allocator_statistics(VkContext *context);
+
+void init_upload_queue(VkContext *context, uint32_t frame_count);
+
+// 调用前device必须已经idle：未录制和未完成的批次直接视为完成
+void cleanup_upload_queue(VkContext *context);
+
+// 线程安全：把data拷贝进staging，之后由record_uploads拷贝到dst_buffer（需要TRANSFER_DST用途）
+void enqueue_buffer_upload(VkContext *context, VkBuffer dst_buffer, VkDeviceSize dst_offset, const void *data,
+                           VkDeviceSize size);
+
+// 线程安全：在此之前入队的上传都在GPU上完成后，在主线程调用completion
+void enqueue_upload_completion(VkContext *context, std::function<void()> &&completion);
+
+// 在render pass之前调用，录制所有待上传的拷贝和一个到顶点输入阶段的barrier
+void record_uploads(VkContext *context, VkCommandBuffer command_buffer, uint32_t frame_index);
+
+// 等到frame_index的fence之后调用
+void complete_uploads(VkContext *context, uint32_t frame_index);
 
 void set_viewport(VkCommandBuffer command_buffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
 
@@ -108,7 +244,12 @@ void set_scissor(VkCommandBuffer command_buffer, uint32_t x, uint32_t y, uint32_
 
 void allocate_descriptor_set(VkContext *context, VkDescriptorPool descriptor_pool, VkDescriptorSet *descriptor_set);
 
-VkPipeline get_pipeline(VkContext *context, PipelineKey pipeline_key);
+// 内容相同的SPIR-V只创建一个VkShaderModule，由context持有，调用者不要销毁；只在主线程调用
+VkShaderModule get_shader_module(VkContext *context, const char *filepath, uint64_t *code_hash = nullptr);
+
+// 把pipeline cache写回磁盘，cleanup_vk会调用；预热完更多pipeline之后也可以提前调用
+void save_pipeline_cache(VkContext *context);
 
+// 按pipeline_key请求的状态设置pipeline中的动态状态，pipeline_key是折叠之前的key
 void apply_pipeline_dynamic_states(VkContext *context, VkCommandBuffer command_buffer, PipelineKey pipeline_key,
                                    VkCullModeFlags cull_mode);